@@ -0,0 +1,75 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Assembly source for the analysis modes.
+ *
+ * Reports name instructions and functions after the assembly source when it is given
+ * with --source=. read_source matches source lines to instructions the way the assembler
+ * lays them out, one instruction per line that is not blank, a comment, a directive or
+ * only a label.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "analysis.h"
+
+#define MAX_SOURCE_LINE 256
+
+/*
+ * Reads the assembly source and returns, per instruction, the text of the line it came
+ * from and the first label naming it. Returns NULL if there is no source; instructions
+ * past the end of it get NULL text.
+*/
+source_line_t* read_source(const char* source_name, unsigned int num_instructions)
+{
+  if (source_name == NULL)
+    return NULL;
+  FILE* file = fopen(source_name, "r");
+  if (file == NULL)
+    error_exit("unable to open source file");
+
+  source_line_t* source = calloc(num_instructions + 1, sizeof(source_line_t));
+  if (source == NULL)
+    error_exit("unable to allocate memory for source lines");
+
+  char line[MAX_SOURCE_LINE];
+  unsigned int index = 0;
+  while (index < num_instructions && fgets(line, sizeof(line), file) != NULL){
+    char* text = line + strspn(line, " \t");
+    text[strcspn(text, "#\r\n")] = '\0';
+
+    // A leading label names the next instruction
+    char* colon = strchr(text, ':');
+    if (colon != NULL && colon - text == strcspn(text, " \t:")){
+      *colon = '\0';
+      if (source[index].label == NULL && colon != text)
+	source[index].label = strdup(text);
+      text = colon + 1 + strspn(colon + 1, " \t");
+    }
+
+    if (text[0] == '\0' || text[0] == '.')
+      continue;
+    for (char* c = text; *c != '\0'; c++){
+      if (*c == '\t')
+	*c = ' ';
+    }
+    source[index++].text = strdup(text);
+  }
+
+  fclose(file);
+  return source;
+}
+
+/*
+ * Frees what read_source returned
+*/
+void free_source(source_line_t* source, unsigned int num_instructions)
+{
+  if (source == NULL)
+    return;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    free(source[i].text);
+    free(source[i].label);
+  }
+  free(source);
+}
@@ -0,0 +1,78 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * The dispatch loop the analysis modes run the program with, and the reader for the
+ * assembly source their reports quote.
+ *
+ * The analysis modes, such as --profile and --pipeline, run the program the way
+ * run_switch does and only differ in what they look at around each instruction.
+ * run_hooked is that loop, with a call into the mode before and after every
+ * instruction, so the engines and execute_instruction itself carry no analysis code. It
+ * is inline, and so are the hooks the modes pass it, so each mode compiles to a loop with
+ * its own hooks inlined into it rather than called through a pointer per instruction.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+// Called before the instruction at index runs. Returns 0 to let it run, or the number of
+// instructions the hook ran in its place, in which case the loop moves on to the next one.
+typedef unsigned long long (*before_hook_t)(void* state, unsigned int index,
+					     instruction_t instr, int* registers,
+					     unsigned long long executed);
+
+// Called after the instruction ran, with the program counter it left. Modes that only
+// look ahead pass NULL.
+typedef void (*after_hook_t)(void* state, instruction_t instr, unsigned int program_counter,
+			     int* registers, unsigned long long executed);
+
+/*
+ * Runs the program from its entry like run_switch, calling before and after around every
+ * instruction with state. Returns the number of instructions executed, including those
+ * before ran in place of one.
+*/
+static inline unsigned long long run_hooked(instruction_t* instructions,
+					    unsigned int num_instructions, int* registers,
+					    unsigned char* memory, io_t* io, before_hook_t before,
+					    after_hook_t after, void* state)
+{
+  unsigned long long executed = 0;
+  unsigned int program_counter = 0;
+  unsigned int end_pc = num_instructions * 4;
+
+  while (program_counter != end_pc && program_counter != HALT_PC)
+  {
+    if (program_counter % 4 != 0 || program_counter > end_pc)
+      error_exit("program counter out of range");
+    instruction_t instr = instructions[program_counter / 4];
+
+    unsigned long long skipped = before(state, program_counter / 4, instr, registers,
+					executed);
+    if (skipped > 0){
+      executed += skipped;
+      program_counter += 4;
+      continue;
+    }
+
+    program_counter = execute_instruction(program_counter, instructions, registers, memory, io);
+    executed++;
+    if (after != NULL)
+      after(state, instr, program_counter, registers, executed);
+  }
+
+  // The program's own output goes before the mode's report
+  io_flush(io);
+  fflush(stdout);
+  return executed;
+}
+
+// What the assembly source says about one instruction
+typedef struct
+{
+  char* text;    // the instruction as written, without label or comment, or NULL
+  char* label;   // the first label naming it, or NULL
+} source_line_t;
+
+source_line_t* read_source(const char* source_name, unsigned int num_instructions);
+void free_source(source_line_t* source, unsigned int num_instructions);
@@ -0,0 +1,229 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Batch mode for the simulator.
+ *
+ * The program is decoded once and shared read-only by every worker thread. Each worker
+ * claims the next input file, runs the program on its own registers and stack memory with
+ * readr reading that file and printr writing to a private memory stream, and hands the
+ * output back. With the lane engine a worker claims SIMD_LANES inputs and runs them
+ * together. Given a checkpoint, every run starts from a copy of it instead of a fresh
+ * machine, with readr skipping the input the checkpointed run had already consumed, so
+ * a shared prologue runs once instead of once per input. The main thread writes the
+ * outputs to stdout in input order as soon as each one and all earlier ones are finished.
+ *
+ * An input that cannot be opened, or whose run fails, only fails itself: error_exit jumps
+ * back into the worker, which ends that input's output with the "Error: ..." line the
+ * simulator would have printed, and goes on with the next input. When a group of lanes
+ * fails, its inputs run again one at a time on the switch engine, so only the one at
+ * fault reports the error.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include "simulator.h"
+#include "batch.h"
+#include "simd.h"
+#include "memory.h"
+
+typedef struct
+{
+  char* output;                // everything the run printed
+  size_t output_size;
+  unsigned long long executed;
+  int failed;
+  int done;
+} batch_result_t;
+
+typedef struct
+{
+  int engine;
+  instruction_t* instructions;
+  const compact_program_t* compact;  // for the compact engine
+  unsigned int num_instructions;
+  checkpoint_t* start;         // state every run starts from, or NULL for a fresh machine
+
+  char** input_files;
+  int num_inputs;
+  int next_input;              // next input to claim, taken with an atomic add
+
+  batch_result_t* results;
+  pthread_mutex_t lock;        // protects results
+  pthread_cond_t finished;     // signalled whenever a result is done
+} batch_t;
+
+/*
+ * Runs the program on count inputs from first, together on the lane engine and one at a
+ * time otherwise, and stores their outputs and instruction counts in results. The count
+ * of a group of lanes goes with its first input. Returns 0, or -1 if the run stopped on an
+ * error, whose "Error: ..." line then ends the output of the first input.
+*/
+static int run_inputs(batch_t* batch, int engine, int first, int count, int* registers,
+		      unsigned char* memory, batch_result_t* results)
+{
+  io_t io[SIMD_LANES];
+  FILE* volatile in[SIMD_LANES] = { NULL };
+  FILE* volatile out[SIMD_LANES] = { NULL };
+  volatile int opened = 0;
+  volatile unsigned long long executed = 0;
+
+  jmp_buf handler;
+  int failed = setjmp(handler);
+  if (!failed){
+    error_handler = &handler;
+    for (int i = 0; i < count; i++){
+      out[i] = open_memstream(&results[i].output, &results[i].output_size);
+      if (out[i] == NULL)
+	error_exit("unable to allocate memory for batch output");
+      in[i] = fopen(batch->input_files[first + i], "r");
+      if (in[i] == NULL)
+	error_exit("unable to open batch input file");
+      io_open(&io[i], in[i], out[i]);
+      opened++;
+      if (batch->start != NULL)
+	io_skip(&io[i], batch->start->input_offset);
+    }
+
+    if (engine == ENGINE_SIMD)
+      executed = run_simd(batch->instructions, batch->num_instructions, io, count, batch->start);
+    else if (batch->start != NULL){
+      memcpy(registers, batch->start->registers, sizeof(int) * REGISTER_FILE_SIZE);
+      memory_copy(memory, batch->start->memory);
+      if (batch->start->program_counter != HALT_PC)
+	executed = run_program(engine, batch->instructions, batch->compact, batch->num_instructions,
+			       registers, memory, io, batch->start->program_counter);
+    }
+    else{
+      reset_machine(registers, memory);
+      executed = run_program(engine, batch->instructions, batch->compact, batch->num_instructions,
+			     registers, memory, io, 0);
+    }
+  }
+  error_handler = NULL;
+
+  // Whatever the runs printed so far comes before the message
+  for (int i = 0; i < count; i++){
+    if (i < opened)
+      io_close(&io[i]);
+    if (in[i] != NULL)
+      fclose(in[i]);
+    if (failed && i == 0 && out[i] != NULL)
+      fprintf(out[i], "Error: %s\n", error_message);
+    if (out[i] != NULL)
+      fclose(out[i]);
+    else
+      results[i].output = NULL;
+    results[i].executed = i == 0 ? executed : 0;
+    results[i].failed = failed && i == 0;
+  }
+  return failed ? -1 : 0;
+}
+
+/*
+ * Worker thread: runs the program on inputs until none are left
+*/
+static void* batch_worker(void* arg)
+{
+  batch_t* batch = arg;
+  int* registers = malloc(sizeof(int) * REGISTER_FILE_SIZE);
+  unsigned char* memory = memory_new();
+  if (registers == NULL)
+    error_exit("unable to allocate memory for a batch context");
+
+  int claim = batch->engine == ENGINE_SIMD ? SIMD_LANES : 1;
+
+  for (;;){
+    int first = __atomic_fetch_add(&batch->next_input, claim, __ATOMIC_RELAXED);
+    if (first >= batch->num_inputs)
+      break;
+    int count = batch->num_inputs - first < claim ? batch->num_inputs - first : claim;
+
+    batch_result_t results[SIMD_LANES];
+    memset(results, 0, sizeof(results));
+    if (run_inputs(batch, batch->engine, first, count, registers, memory, results) != 0 &&
+	count > 1){
+      for (int i = 0; i < count; i++){
+	free(results[i].output);
+	run_inputs(batch, ENGINE_SWITCH, first + i, 1, registers, memory, &results[i]);
+      }
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    for (int i = 0; i < count; i++){
+      results[i].done = 1;
+      batch->results[first + i] = results[i];
+    }
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  collect_fusion_hits();
+  free(registers);
+  memory_free(memory);
+  return NULL;
+}
+
+/*
+ * Runs the program once per input file on num_threads threads, from start if it is not
+ * NULL, and writes the outputs to stdout in input order. Stores the number of inputs
+ * that failed in failed. Returns the total number of instructions executed.
+*/
+unsigned long long run_batch(int engine, instruction_t* instructions,
+			     const compact_program_t* compact, unsigned int num_instructions,
+			     checkpoint_t* start, char** input_files, int num_inputs, int num_threads,
+			     int* failed)
+{
+  batch_t batch;
+  batch.engine = engine;
+  batch.instructions = instructions;
+  batch.compact = compact;
+  batch.num_instructions = num_instructions;
+  batch.start = start;
+  batch.input_files = input_files;
+  batch.num_inputs = num_inputs;
+  batch.next_input = 0;
+  batch.results = calloc(num_inputs, sizeof(batch_result_t));
+  if (batch.results == NULL)
+    error_exit("unable to allocate memory for batch results");
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+
+  if (num_threads > num_inputs)
+    num_threads = num_inputs;
+  if (num_threads < 1)
+    num_threads = 1;
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  if (threads == NULL)
+    error_exit("unable to allocate memory for batch threads");
+  for (int i = 0; i < num_threads; i++){
+    if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0)
+      error_exit("unable to start batch thread");
+  }
+
+  // Emit outputs in input order while later inputs are still running
+  unsigned long long executed = 0;
+  *failed = 0;
+  for (int i = 0; i < num_inputs; i++){
+    pthread_mutex_lock(&batch.lock);
+    while (!batch.results[i].done)
+      pthread_cond_wait(&batch.finished, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    fwrite(batch.results[i].output, 1, batch.results[i].output_size, stdout);
+    free(batch.results[i].output);
+    executed += batch.results[i].executed;
+    *failed += batch.results[i].failed;
+  }
+
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.finished);
+  free(threads);
+  free(batch.results);
+  return executed;
+}
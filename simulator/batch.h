@@ -0,0 +1,16 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Batch mode: one decoded program run over many input files on a pool of threads.
+*/
+
+#pragma once
+
+#include "simulator.h"
+#include "checkpoint.h"
+#include "compact.h"
+
+unsigned long long run_batch(int engine, instruction_t* instructions,
+			     const compact_program_t* compact, unsigned int num_instructions,
+			     checkpoint_t* start, char** input_files, int num_inputs, int num_threads,
+			     int* failed);
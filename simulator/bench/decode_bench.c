@@ -0,0 +1,100 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Microbenchmark of the instruction decoders.
+ *
+ * Decodes a large buffer of random instruction words, mostly valid, with decode_instructions
+ * (one instruction_t at a time), decode_scalar and decode_bulk (field arrays), checks that
+ * the two field-array decoders agree, and reports nanoseconds per instruction as the best
+ * of several runs.
+ *
+ * Usage: bench/decode_bench [instructions] [runs]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../simulator.h"
+#include "../decode.h"
+
+/*
+ * Returns a monotonic timestamp in seconds
+*/
+static double get_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int num_instructions = argc > 1 ? atoi(argv[1]) : 4 * 1024 * 1024;
+  int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+  // Random fields, with one word in 64 carrying an invalid opcode or register
+  unsigned int* bytes = malloc(sizeof(unsigned int) * num_instructions);
+  unsigned char* opcodes[2];
+  unsigned char* first_registers[2];
+  unsigned char* second_registers[2];
+  int* immediates[2];
+  for (int d = 0; d < 2; d++){
+    opcodes[d] = malloc(num_instructions);
+    first_registers[d] = malloc(num_instructions);
+    second_registers[d] = malloc(num_instructions);
+    immediates[d] = malloc(sizeof(int) * num_instructions);
+    if (opcodes[d] == NULL || first_registers[d] == NULL || second_registers[d] == NULL ||
+	immediates[d] == NULL)
+      error_exit("unable to allocate memory for the benchmark");
+  }
+  if (bytes == NULL)
+    error_exit("unable to allocate memory for the benchmark");
+  srand(4400);
+  for (unsigned int i = 0; i < num_instructions; i++){
+    int broken = rand() % 64 == 0;
+    unsigned int opcode = broken ? 22 + rand() % 10 : rand() % (readr + 1);
+    bytes[i] = opcode << 27 | (rand() % NUM_REGS) << 22 | (rand() % NUM_REGS) << 17 |
+      (rand() & 0xFFFF);
+  }
+
+  double best[3] = { 1e30, 1e30, 1e30 };
+  unsigned int invalid[2] = { 0, 0 };
+  for (int run = 0; run < runs; run++){
+    double start = get_seconds();
+    instruction_t* instructions = decode_instructions(bytes, num_instructions);
+    double elapsed = get_seconds() - start;
+    free(instructions);
+    if (elapsed < best[0])
+      best[0] = elapsed;
+
+    start = get_seconds();
+    invalid[0] = decode_scalar(bytes, num_instructions, opcodes[0], first_registers[0],
+			       second_registers[0], immediates[0]);
+    elapsed = get_seconds() - start;
+    if (elapsed < best[1])
+      best[1] = elapsed;
+
+    start = get_seconds();
+    invalid[1] = decode_bulk(bytes, num_instructions, opcodes[1], first_registers[1],
+			     second_registers[1], immediates[1]);
+    elapsed = get_seconds() - start;
+    if (elapsed < best[2])
+      best[2] = elapsed;
+  }
+
+  if (invalid[0] != invalid[1] ||
+      memcmp(opcodes[0], opcodes[1], num_instructions) != 0 ||
+      memcmp(first_registers[0], first_registers[1], num_instructions) != 0 ||
+      memcmp(second_registers[0], second_registers[1], num_instructions) != 0 ||
+      memcmp(immediates[0], immediates[1], sizeof(int) * num_instructions) != 0)
+    error_exit("decode_bulk and decode_scalar disagree");
+
+  const char* names[3] = { "decode_instructions", "decode_scalar", "decode_bulk" };
+  printf("%u instructions, %u invalid, best of %d runs\n", num_instructions, invalid[0], runs);
+  printf("%-20s %12s %12s\n", "decoder", "ns/instr", "speedup");
+  for (int d = 0; d < 3; d++)
+    printf("%-20s %12.3f %12.2f\n", names[d], best[d] / num_instructions * 1e9,
+	   best[0] / best[d]);
+  return 0;
+}
@@ -0,0 +1,27 @@
+main:
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$0, %r12d
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jle	.Ldone
+	subl	$1, %r15d
+	movl	$12, %edi
+	call	fact
+	addl	%eax, %r14d
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	ret
+fact:
+	movl	$1, %eax
+	movl	$1, %r8d
+	cmpl	%r8d, %edi
+	jle	.Lbase
+	pushl	%edi
+	subl	$1, %edi
+	call	fact
+	popl	%edi
+	imull	%edi, %eax
+.Lbase:
+	ret
@@ -0,0 +1,33 @@
+main:
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$0, %r12d
+	movl	$2, %r11d
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jle	.Ldone
+	subl	$1, %r15d
+	movl	$15, %edi
+	call	fib
+	addl	%eax, %r14d
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	ret
+fib:
+	cmpl	%r11d, %edi
+	jl	.Lsmall
+	pushl	%ebx
+	pushl	%edi
+	subl	$1, %edi
+	call	fib
+	movl	%eax, %ebx
+	popl	%edi
+	subl	$2, %edi
+	call	fib
+	addl	%ebx, %eax
+	popl	%ebx
+	ret
+.Lsmall:
+	movl	%edi, %eax
+	ret
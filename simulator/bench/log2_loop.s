@@ -0,0 +1,28 @@
+main:
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$1, %r12d
+	movl	$1000, %r11d
+	imull	%r11d, %r11d
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jl	.Ldone
+	movl	%r15d, %edi
+	addl	%r11d, %edi
+	call	log2
+	addl	%eax, %r14d
+	subl	$1, %r15d
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	ret
+log2:
+	movl	$0, %eax
+.Lshift:
+	cmpl	%r12d, %edi
+	jbe	.Lfound
+	shrl	%edi
+	addl	$1, %eax
+	jmp	.Lshift
+.Lfound:
+	ret
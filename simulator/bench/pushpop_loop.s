@@ -0,0 +1,38 @@
+main:
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$0, %r12d
+	movl	$1, %eax
+	movl	$2, %ebx
+	movl	$3, %ecx
+	movl	$4, %edx
+	movl	$5, %esi
+	movl	$6, %edi
+	movl	$7, %r8d
+	movl	$8, %r9d
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jle	.Ldone
+	subl	$1, %r15d
+	pushl	%eax
+	pushl	%ebx
+	pushl	%ecx
+	pushl	%edx
+	pushl	%esi
+	pushl	%edi
+	pushl	%r8d
+	pushl	%r9d
+	popl	%eax
+	popl	%ebx
+	popl	%ecx
+	popl	%edx
+	popl	%esi
+	popl	%edi
+	popl	%r8d
+	popl	%r9d
+	addl	%eax, %r14d
+	addl	$3, %eax
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	ret
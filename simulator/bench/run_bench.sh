@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# CS 4400, University of Utah
+# Benchmark harness for the simulator.
+# Runs every workload in bench/ on each engine for a fixed instruction budget and reports
+# instructions per second as mean and variance over several runs. Each workload reads an
+# iteration count; it is calibrated once so a run executes about BUDGET instructions.
+# Run from the simulator directory: bench/run_bench.sh [engine...]
+# Environment: BUDGET (instructions per run, default 100000000), RUNS (default 5)
+
+BUDGET=${BUDGET:-100000000}
+RUNS=${RUNS:-5}
+ENGINES=${@:-switch threaded jit simd compact}
+
+if [ ! -f simulator ]
+then
+    echo "Please compile the simulator first"
+    exit 1
+fi
+
+# Prints the instruction count reported by --mips for a run with the given iteration count
+count_instructions() {
+    echo $2 | ./simulator --mips $1 2>&1 >/dev/null | awk '{ print $3 }'
+}
+
+printf "%-16s %-9s %14s %12s %12s\n" "workload" "engine" "instructions" "mean MIPS" "variance"
+for SOURCE in bench/*.s
+do
+    BINARY=${SOURCE%.s}.o
+    WORKLOAD=${SOURCE##*/}
+    WORKLOAD=${WORKLOAD%.s}
+    ./assembler $SOURCE $BINARY > /dev/null || exit 1
+
+    # Instructions per iteration, and the iteration count that fills the budget
+    ONE=$(count_instructions $BINARY 1)
+    TWO=$(count_instructions $BINARY 2)
+    ITERATIONS=$(( (BUDGET - ONE) / (TWO - ONE) + 1 ))
+    EXPECTED=$(echo $ITERATIONS | ./simulator $BINARY)
+
+    for ENGINE in $ENGINES
+    do
+	RATES=
+	for RUN in $(seq $RUNS)
+	do
+	    OUTPUT=$(echo $ITERATIONS | ./simulator --engine=$ENGINE --mips $BINARY 2>&1)
+	    if [ "$(echo "$OUTPUT" | grep -v "engine:")" != "$EXPECTED" ]
+	    then
+		echo "$WORKLOAD: $ENGINE engine output differs from the switch engine"
+		exit 1
+	    fi
+	    RATES="$RATES $(echo "$OUTPUT" | grep "engine:" | awk '{ print $3, $6 }')"
+	done
+
+	# RATES holds instruction count and seconds pairs
+	echo $RATES | awk -v workload=$WORKLOAD -v engine=$ENGINE '{
+	    for (i = 1; i < NF; i += 2){
+		mips[++n] = $i / $(i + 1) / 1e6
+		sum += mips[n]
+	    }
+	    mean = sum / n
+	    for (i = 1; i <= n; i++)
+		variance += (mips[i] - mean) ^ 2
+	    variance = n > 1 ? variance / (n - 1) : 0
+	    printf "%-16s %-9s %14d %12.2f %12.2f\n", workload, engine, $1, mean, variance
+	}'
+    done
+done
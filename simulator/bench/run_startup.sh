@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# CS 4400, University of Utah
+# Startup benchmark for the simulator.
+# Builds a large straight-line binary, bench/startup.o, and times whole runs of it with the
+# default lazy loading, with --eager-load, with --eager-load on the compact engine, and
+# through the decoded-program cache both cold (empty cache directory) and warm (cache left
+# by the previous run), plain and fused.
+# Every instruction runs once, so each run decodes all of it.
+# Run from the simulator directory: bench/run_startup.sh
+# Environment: DOUBLINGS (binary holds 4 * 2^DOUBLINGS instructions, default 18),
+#              RUNS (default 5)
+
+DOUBLINGS=${DOUBLINGS:-18}
+RUNS=${RUNS:-5}
+BINARY=bench/startup.o
+CACHE=$(mktemp -d)
+trap 'rm -rf $CACHE' EXIT
+
+if [ ! -f simulator ]
+then
+    echo "Please compile the simulator first"
+    exit 1
+fi
+
+# movl $4, %ecx; imull %esi, %ecx; cmpl %eax, %eax; je to the next instruction,
+# doubled until it is large, then printr %ecx; ret
+printf '\x04\x00\x80\x40\x00\x00\x04\x19\x00\x00\x00\x48\x00\x00\x00\x50' > $BINARY
+for i in $(seq 1 $DOUBLINGS)
+do
+    cat $BINARY $BINARY > $BINARY.tmp && mv $BINARY.tmp $BINARY
+done
+printf '\x00\x00\x80\xa0\x00\x00\x00\x88' >> $BINARY
+EXPECTED=$(./simulator $BINARY)
+
+# Prints the mean wall time in milliseconds of RUNS runs of the simulator with the given
+# options. With "cold" the cache directory is emptied before every run.
+time_runs() {
+    MODE=$1
+    shift
+    TOTAL=0
+    for RUN in $(seq 1 $RUNS)
+    do
+	if [ "$MODE" = "cold" ]
+	then
+	    rm -f $CACHE/*
+	fi
+	START=$(date +%s%N)
+	OUTPUT=$(./simulator "$@" $BINARY)
+	END=$(date +%s%N)
+	if [ "$OUTPUT" != "$EXPECTED" ]
+	then
+	    echo "startup: output differs with $*"
+	    exit 1
+	fi
+	TOTAL=$((TOTAL + END - START))
+    done
+    echo $TOTAL $RUNS | awk '{ printf "%.2f", $1 / $2 / 1e6 }'
+}
+
+printf "%s: %d instructions, %d bytes\n" $BINARY $(( $(stat -c %s $BINARY) / 4 )) \
+       $(stat -c %s $BINARY)
+printf "%-24s %12s\n" "load" "mean ms"
+printf "%-24s %12s\n" "lazy" "$(time_runs none)"
+printf "%-24s %12s\n" "eager" "$(time_runs none --eager-load)"
+printf "%-24s %12s\n" "compact eager" "$(time_runs none --eager-load --engine=compact)"
+printf "%-24s %12s\n" "cache cold" "$(time_runs cold --cache=$CACHE)"
+printf "%-24s %12s\n" "cache warm" "$(time_runs warm --cache=$CACHE)"
+printf "%-24s %12s\n" "fused eager" \
+       "$(time_runs none --eager-load --engine=threaded --fuse)"
+printf "%-24s %12s\n" "fused cache cold" "$(time_runs cold --cache=$CACHE --engine=threaded --fuse)"
+printf "%-24s %12s\n" "fused cache warm" "$(time_runs warm --cache=$CACHE --engine=threaded --fuse)"
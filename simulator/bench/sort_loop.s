@@ -0,0 +1,54 @@
+main:
+	subl	$256, %esp
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$1, %r13d
+	movl	$0, %r12d
+	movl	$64, %r11d
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jle	.Ldone
+	subl	$1, %r15d
+	movl	$0, %ecx
+.Lfill:
+	movl	$25173, %eax
+	imull	%eax, %r13d
+	addl	$13849, %r13d
+	movl	$4, %edx
+	imull	%ecx, %edx
+	addl	%esp, %edx
+	movl	%r13d, 0(%edx)
+	addl	$1, %ecx
+	cmpl	%r11d, %ecx
+	jl	.Lfill
+	movl	$1, %ecx
+.Louter:
+	cmpl	%r11d, %ecx
+	jge	.Lsorted
+	movl	$4, %edx
+	imull	%ecx, %edx
+	addl	%esp, %edx
+	movl	0(%edx), %esi
+.Linner:
+	cmpl	%esp, %edx
+	jle	.Lplace
+	movl	-4(%edx), %edi
+	cmpl	%esi, %edi
+	jle	.Lplace
+	movl	%edi, 0(%edx)
+	subl	$4, %edx
+	jmp	.Linner
+.Lplace:
+	movl	%esi, 0(%edx)
+	addl	$1, %ecx
+	jmp	.Louter
+.Lsorted:
+	movl	0(%esp), %eax
+	addl	%eax, %r14d
+	movl	252(%esp), %eax
+	addl	%eax, %r14d
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	addl	$256, %esp
+	ret
@@ -0,0 +1,27 @@
+main:
+	subl	$64, %esp
+	readr	%r15d
+	movl	$0, %r14d
+	movl	$0, %r12d
+	movl	$4660, %ebx
+.Lrepeat:
+	cmpl	%r12d, %r15d
+	jle	.Ldone
+	subl	$1, %r15d
+	movl	%ebx, 1(%esp)
+	movl	%ebx, 6(%esp)
+	movl	%ebx, 11(%esp)
+	movl	3(%esp), %eax
+	addl	%eax, %r14d
+	movl	9(%esp), %eax
+	addl	%eax, %r14d
+	movl	13(%esp), %eax
+	addl	%eax, %r14d
+	movl	2(%esp), %eax
+	addl	%eax, %ebx
+	addl	$1, %ebx
+	jmp	.Lrepeat
+.Ldone:
+	printr	%r14d
+	addl	$64, %esp
+	ret
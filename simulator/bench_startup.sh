@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# CS 4400, University of Utah
+# Startup-latency benchmark for program loading.
+# Builds synthetic binaries from 1 KB to 100 MB whose first instruction returns from main,
+# so almost all of the run time is loading and decoding. Each size is timed with
+# --eager-load (read and decode the whole file) and with the default mapped, lazily
+# decoded loading. Extra arguments are passed to the simulator, e.g. --engine=jit.
+
+if [ ! -f simulator ]
+then
+    echo "Please compile the simulator first"
+    exit 1
+fi
+
+RUNS=5
+SIZES="1024 65536 1048576 16777216 104857600"
+BINARY=$(mktemp)
+trap "rm -f $BINARY" EXIT
+
+# Prints the best wall-clock time of $RUNS runs in milliseconds
+best_time() {
+    BEST=
+    for RUN in $(seq $RUNS)
+    do
+	START=$(date +%s%N)
+	./simulator "$@" $BINARY > /dev/null || exit 1
+	END=$(date +%s%N)
+	let ELAPSED=(END-START)/1000
+	if [ -z "$BEST" ] || [ $ELAPSED -lt $BEST ]
+	then
+	    BEST=$ELAPSED
+	fi
+    done
+    printf "%d.%03d" $((BEST / 1000)) $((BEST % 1000))
+}
+
+printf "%12s %12s %12s\n" "size" "eager ms" "lazy ms"
+for SIZE in $SIZES
+do
+    # ret (opcode 17) with %esp at the top of the stack, then zero words (subl $0, %eax)
+    printf '\x00\x00\x00\x88' > $BINARY
+    head -c $((SIZE - 4)) /dev/zero >> $BINARY
+
+    EAGER=$(best_time --eager-load "$@")
+    LAZY=$(best_time "$@")
+    printf "%12d %12s %12s\n" $SIZE $EAGER $LAZY
+done
@@ -0,0 +1,307 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Call-graph profiler for the simulator.
+ *
+ * A guest function is the program entry or any call target. run_callgraph keeps a shadow
+ * call stack in step with call and ret, moving it once each of them has run. Each entry
+ * of the stack is a node of a calling context tree: one node per distinct chain of calls
+ * from the entry, so charging an instruction only adds one to the count of the node on
+ * top. factorial.s recursing five deep makes five nodes for factorial, one under the
+ * other. A ret that would leave the entry's frame ends the
+ * program, and the shadow stack is never popped below it.
+ *
+ * When the program finishes, the tree gives every count:
+ *  - exclusive: the instructions run in the function itself.
+ *  - inclusive: those plus everything it called. Only the outermost frame of a recursive
+ *    function counts, so recursion is not counted twice.
+ *  - calls: the times the function was called.
+ * The report goes to stderr. With a file for the folded stacks, every calling context is
+ * also written there as "main;f;g count", the input flamegraph.pl takes. Functions are
+ * named after their labels when the assembly source is given with --source=, otherwise
+ * "main" for the entry and their address for the others.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "callgraph.h"
+#include "analysis.h"
+#include "memory.h"
+
+#define MAX_FUNCTION_NAME 64
+#define NO_NODE 0xFFFFFFFF
+
+// A calling context: a function and the chain of calls that led to it
+typedef struct
+{
+  unsigned int function;
+  unsigned int parent;
+  unsigned int first_child;
+  unsigned int next_sibling;
+  unsigned long long self;   // instructions run with this node on top of the stack
+} node_t;
+
+// Counts for one function
+typedef struct
+{
+  unsigned int entry;        // instruction index
+  char name[MAX_FUNCTION_NAME];
+  unsigned long long calls;
+  unsigned long long exclusive;
+  unsigned long long inclusive;
+  unsigned int active;       // frames of it on the path while adding up inclusive counts
+} function_t;
+
+typedef struct
+{
+  node_t* nodes;
+  unsigned int num_nodes;
+  unsigned int nodes_size;
+  function_t* functions;
+  unsigned int num_functions;
+  unsigned int functions_size;
+  unsigned int* function_at;  // function entered at each instruction index, or NO_NODE
+  source_line_t* source;      // NULL without the source
+  unsigned int end_pc;
+  unsigned int* stack;        // the shadow call stack, of nodes
+  unsigned int depth;
+  unsigned int stack_size;
+  unsigned int current;       // node on top of the stack
+} callgraph_t;
+
+/*
+ * Returns the function entered at instruction index, adding it on first sight
+*/
+static unsigned int function_at(callgraph_t* graph, unsigned int index)
+{
+  if (graph->function_at[index] != NO_NODE)
+    return graph->function_at[index];
+
+  if (graph->num_functions == graph->functions_size){
+    graph->functions_size *= 2;
+    graph->functions = realloc(graph->functions, sizeof(function_t) * graph->functions_size);
+    if (graph->functions == NULL)
+      error_exit("unable to allocate memory for the call graph");
+  }
+  function_t* function = &graph->functions[graph->num_functions];
+  memset(function, 0, sizeof(function_t));
+  function->entry = index;
+  if (graph->source != NULL && graph->source[index].label != NULL)
+    snprintf(function->name, sizeof(function->name), "%s", graph->source[index].label);
+  else if (index == 0)
+    snprintf(function->name, sizeof(function->name), "main");
+  else
+    snprintf(function->name, sizeof(function->name), "0x%06x", index * 4);
+  graph->function_at[index] = graph->num_functions;
+  return graph->num_functions++;
+}
+
+/*
+ * Returns the node for calling function from node parent, adding it on first sight
+*/
+static unsigned int child_node(callgraph_t* graph, unsigned int parent, unsigned int function)
+{
+  unsigned int child = parent == NO_NODE ? NO_NODE : graph->nodes[parent].first_child;
+  for (; child != NO_NODE; child = graph->nodes[child].next_sibling){
+    if (graph->nodes[child].function == function)
+      return child;
+  }
+
+  if (graph->num_nodes == graph->nodes_size){
+    graph->nodes_size *= 2;
+    graph->nodes = realloc(graph->nodes, sizeof(node_t) * graph->nodes_size);
+    if (graph->nodes == NULL)
+      error_exit("unable to allocate memory for the call graph");
+  }
+  node_t* node = &graph->nodes[graph->num_nodes];
+  node->function = function;
+  node->parent = parent;
+  node->first_child = NO_NODE;
+  node->next_sibling = NO_NODE;
+  node->self = 0;
+  if (parent != NO_NODE){
+    node->next_sibling = graph->nodes[parent].first_child;
+    graph->nodes[parent].first_child = graph->num_nodes;
+  }
+  return graph->num_nodes++;
+}
+
+/*
+ * Adds up the counts of every function from the tree. Children are always added after
+ * their parent, so walking the nodes backwards sees a subtree before its root.
+ * Inclusive counts need the functions on each path, so they are added in a depth-first
+ * walk with an explicit stack.
+*/
+static void add_up(callgraph_t* graph)
+{
+  unsigned long long* total = malloc(sizeof(unsigned long long) * graph->num_nodes);
+  unsigned int* stack = malloc(sizeof(unsigned int) * graph->num_nodes);
+  if (total == NULL || stack == NULL)
+    error_exit("unable to allocate memory for the call graph");
+  for (unsigned int n = 0; n < graph->num_nodes; n++)
+    total[n] = graph->nodes[n].self;
+  for (unsigned int n = graph->num_nodes; n-- > 1;)
+    total[graph->nodes[n].parent] += total[n];
+
+  for (unsigned int n = 0; n < graph->num_nodes; n++)
+    graph->functions[graph->nodes[n].function].exclusive += graph->nodes[n].self;
+
+  // Enter a node by pushing it, leave it when it comes back to the top with its children
+  // done; the top bit marks a node whose children have been pushed
+  unsigned int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0){
+    unsigned int n = stack[depth - 1];
+    if (n & 0x80000000){
+      graph->functions[graph->nodes[n & 0x7FFFFFFF].function].active--;
+      depth--;
+      continue;
+    }
+    function_t* function = &graph->functions[graph->nodes[n].function];
+    if (function->active++ == 0)
+      function->inclusive += total[n];
+    stack[depth - 1] = n | 0x80000000;
+    for (unsigned int child = graph->nodes[n].first_child; child != NO_NODE;
+	 child = graph->nodes[child].next_sibling)
+      stack[depth++] = child;
+  }
+
+  free(stack);
+  free(total);
+}
+
+/*
+ * Writes every calling context that ran instructions as "main;f;g count"
+*/
+static void write_folded(callgraph_t* graph, FILE* folded)
+{
+  unsigned int* path = malloc(sizeof(unsigned int) * graph->num_nodes);
+  if (path == NULL)
+    error_exit("unable to allocate memory for the call graph");
+  for (unsigned int n = 0; n < graph->num_nodes; n++){
+    if (graph->nodes[n].self == 0)
+      continue;
+    unsigned int length = 0;
+    for (unsigned int p = n; p != NO_NODE; p = graph->nodes[p].parent)
+      path[length++] = graph->nodes[p].function;
+    while (length-- > 0)
+      fprintf(folded, "%s%c", graph->functions[path[length]].name, length > 0 ? ';' : ' ');
+    fprintf(folded, "%llu\n", graph->nodes[n].self);
+  }
+  free(path);
+}
+
+/*
+ * Orders functions by inclusive count, then exclusive count, most first
+*/
+static int compare_functions(const void* a, const void* b)
+{
+  const function_t* left = a;
+  const function_t* right = b;
+  if (left->inclusive != right->inclusive)
+    return left->inclusive < right->inclusive ? 1 : -1;
+  if (left->exclusive != right->exclusive)
+    return left->exclusive < right->exclusive ? 1 : -1;
+  return left->entry < right->entry ? -1 : 1;
+}
+
+/*
+ * Writes the per-function report to stderr
+*/
+static void print_callgraph(callgraph_t* graph, unsigned long long executed)
+{
+  qsort(graph->functions, graph->num_functions, sizeof(function_t), compare_functions);
+  fprintf(stderr, "callgraph: %llu instructions, %u functions, %u calling contexts\n\n",
+	  executed, graph->num_functions, graph->num_nodes);
+  fprintf(stderr, "%-24s %10s %12s %14s %7s %14s %7s\n", "function", "address", "calls",
+	  "inclusive", "share", "exclusive", "share");
+  for (unsigned int f = 0; f < graph->num_functions; f++){
+    function_t* function = &graph->functions[f];
+    fprintf(stderr, "%-24s   0x%06x %12llu %14llu %6.2f%% %14llu %6.2f%%\n", function->name,
+	    function->entry * 4, function->calls, function->inclusive,
+	    executed > 0 ? 100.0 * function->inclusive / executed : 0.0, function->exclusive,
+	    executed > 0 ? 100.0 * function->exclusive / executed : 0.0);
+  }
+}
+
+/*
+ * Charges the instruction about to run to the calling context on top of the stack
+*/
+static inline unsigned long long count_context(void* state, unsigned int index, instruction_t instr,
+					       int* registers, unsigned long long executed)
+{
+  callgraph_t* graph = state;
+  graph->nodes[graph->current].self++;
+  return 0;
+}
+
+/*
+ * Moves the shadow stack along after a call or a ret
+*/
+static inline void follow_call(void* state, instruction_t instr, unsigned int program_counter,
+			       int* registers, unsigned long long executed)
+{
+  callgraph_t* graph = state;
+  if (instr.opcode == call && program_counter % 4 == 0 && program_counter < graph->end_pc){
+    unsigned int function = function_at(graph, program_counter / 4);
+    graph->functions[function].calls++;
+    if (graph->depth == graph->stack_size){
+      graph->stack_size *= 2;
+      graph->stack = realloc(graph->stack, sizeof(unsigned int) * graph->stack_size);
+      if (graph->stack == NULL)
+	error_exit("unable to allocate memory for the call graph");
+    }
+    graph->current = graph->stack[graph->depth++] = child_node(graph, graph->current, function);
+  }
+  else if (instr.opcode == ret && program_counter != HALT_PC && graph->depth > 1){
+    graph->depth--;
+    graph->current = graph->stack[graph->depth - 1];
+  }
+}
+
+/*
+ * Runs the program through run_hooked, attributing every instruction to the guest
+ * function it runs in, then prints the report, and writes the folded stacks unless
+ * folded is NULL. Returns the number of instructions executed.
+*/
+unsigned long long run_callgraph(instruction_t* instructions, unsigned int num_instructions,
+				 int* registers, unsigned char* memory, io_t* io,
+				 const char* source_name, FILE* folded)
+{
+  callgraph_t graph;
+  graph.nodes_size = 64;
+  graph.num_nodes = 0;
+  graph.nodes = malloc(sizeof(node_t) * graph.nodes_size);
+  graph.functions_size = 16;
+  graph.num_functions = 0;
+  graph.functions = malloc(sizeof(function_t) * graph.functions_size);
+  graph.function_at = malloc(sizeof(unsigned int) * (num_instructions + 1));
+  graph.stack_size = 64;
+  graph.stack = malloc(sizeof(unsigned int) * graph.stack_size);
+  if (graph.nodes == NULL || graph.functions == NULL || graph.function_at == NULL ||
+      graph.stack == NULL)
+    error_exit("unable to allocate memory for the call graph");
+  memset(graph.function_at, 0xFF, sizeof(unsigned int) * (num_instructions + 1));
+  graph.source = read_source(source_name, num_instructions);
+  graph.end_pc = num_instructions * 4;
+
+  // The entry is the root of the tree and the bottom of the shadow stack
+  graph.depth = 1;
+  graph.stack[0] = child_node(&graph, NO_NODE, function_at(&graph, 0));
+  graph.functions[0].calls = 1;
+  graph.current = graph.stack[0];
+
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, count_context, follow_call, &graph);
+  add_up(&graph);
+  if (folded != NULL)
+    write_folded(&graph, folded);
+  print_callgraph(&graph, executed);
+
+  free_source(graph.source, num_instructions);
+  free(graph.stack);
+  free(graph.function_at);
+  free(graph.functions);
+  free(graph.nodes);
+  return executed;
+}
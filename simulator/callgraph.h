@@ -0,0 +1,13 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Call-graph profiler over a shadow call stack, with folded-stack output for flame graphs.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_callgraph(instruction_t* instructions, unsigned int num_instructions,
+				 int* registers, unsigned char* memory, io_t* io,
+				 const char* source_name, FILE* folded);
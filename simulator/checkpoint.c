@@ -0,0 +1,148 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Checkpoint files for the simulator.
+ *
+ * A checkpoint holds the register file, guest memory, the program counter, the
+ * instruction count and how far readr had read into the input, so a later run can go on
+ * from there instead of executing everything up to it again. It also records the size and
+ * a hash of the program it was taken from, and is only restored into the same program.
+ *
+ * File layout, little-endian:
+ *   8 bytes    "SIMSNAP2"
+ *   4 bytes    number of instructions
+ *   4 bytes    program counter
+ *   8 bytes    FNV-1a hash of the decoded instructions
+ *   8 bytes    instructions executed
+ *   8 bytes    input offset
+ *   80 bytes   registers, including the lazy flag slots
+ *   4 bytes    guest memory size
+ *   then for each page the run touched and left nonzero, in address order:
+ *   4 bytes    page index
+ *   4096 bytes the page, or what is left of memory if that is less
+ *   4 bytes    0xFFFFFFFF, the end of the pages
+ * so a checkpoint of a gigabyte memory is as large as what the program used.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "checkpoint.h"
+#include "memory.h"
+
+#define CHECKPOINT_MAGIC "SIMSNAP2"
+#define END_OF_PAGES 0xFFFFFFFFu
+
+/*
+ * Returns the number of bytes of guest memory in page
+*/
+static unsigned int page_bytes(unsigned int page)
+{
+  unsigned int offset = page * MEMORY_PAGE_SIZE;
+  return memory_size - offset < MEMORY_PAGE_SIZE ? memory_size - offset : MEMORY_PAGE_SIZE;
+}
+
+/*
+ * Returns whether the bytes are all zero
+*/
+static int is_zero(unsigned char* bytes, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; i++){
+    if (bytes[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns the 64-bit FNV-1a hash of every field of the decoded instructions
+*/
+static unsigned long long hash_program(instruction_t* instructions, unsigned int num_instructions)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    unsigned char fields[5] = {
+      instructions[i].opcode, instructions[i].first_register, instructions[i].second_register,
+      instructions[i].immediate & 0xFF, (instructions[i].immediate >> 8) & 0xFF
+    };
+    for (int f = 0; f < 5; f++){
+      hash ^= fields[f];
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+/*
+ * Writes the checkpoint of a run of the given program to out
+*/
+void write_checkpoint(FILE* out, checkpoint_t* checkpoint, instruction_t* instructions,
+		      unsigned int num_instructions)
+{
+  unsigned long long hash = hash_program(instructions, num_instructions);
+  if (fwrite(CHECKPOINT_MAGIC, 1, 8, out) != 8 ||
+      fwrite(&num_instructions, 4, 1, out) != 1 ||
+      fwrite(&checkpoint->program_counter, 4, 1, out) != 1 ||
+      fwrite(&hash, 8, 1, out) != 1 ||
+      fwrite(&checkpoint->executed, 8, 1, out) != 1 ||
+      fwrite(&checkpoint->input_offset, 8, 1, out) != 1 ||
+      fwrite(checkpoint->registers, sizeof(int), REGISTER_FILE_SIZE, out) != REGISTER_FILE_SIZE ||
+      fwrite(&memory_size, 4, 1, out) != 1)
+    error_exit("unable to write checkpoint");
+
+  // Pages never touched are zero, and so are many touched ones
+  unsigned char* resident = memory_resident(checkpoint->memory);
+  unsigned int num_pages = (memory_size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+  for (unsigned int page = 0; page < num_pages; page++){
+    unsigned char* bytes = checkpoint->memory + (size_t)page * MEMORY_PAGE_SIZE;
+    if (!resident[page] || is_zero(bytes, page_bytes(page)))
+      continue;
+    if (fwrite(&page, 4, 1, out) != 1 ||
+	fwrite(bytes, 1, page_bytes(page), out) != page_bytes(page))
+      error_exit("unable to write checkpoint");
+  }
+  free(resident);
+
+  unsigned int end = END_OF_PAGES;
+  if (fwrite(&end, 4, 1, out) != 1)
+    error_exit("unable to write checkpoint");
+}
+
+/*
+ * Reads a checkpoint from in, which must have been taken from the given program with the
+ * same memory size. Its memory goes into checkpoint->memory, which the caller provides.
+*/
+void read_checkpoint(FILE* in, checkpoint_t* checkpoint, instruction_t* instructions,
+		     unsigned int num_instructions)
+{
+  char magic[8];
+  unsigned int size;
+  unsigned int saved_memory_size;
+  unsigned long long hash;
+  if (fread(magic, 1, 8, in) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+      fread(&size, 4, 1, in) != 1 ||
+      fread(&checkpoint->program_counter, 4, 1, in) != 1 ||
+      fread(&hash, 8, 1, in) != 1 ||
+      fread(&checkpoint->executed, 8, 1, in) != 1 ||
+      fread(&checkpoint->input_offset, 8, 1, in) != 1 ||
+      fread(checkpoint->registers, sizeof(int), REGISTER_FILE_SIZE, in) != REGISTER_FILE_SIZE ||
+      fread(&saved_memory_size, 4, 1, in) != 1)
+    error_exit("invalid checkpoint file");
+  if (size != num_instructions || hash != hash_program(instructions, num_instructions))
+    error_exit("checkpoint was taken from a different program");
+  if (saved_memory_size != memory_size)
+    error_exit("checkpoint was taken with a different memory size");
+
+  memory_clear(checkpoint->memory);
+  unsigned int num_pages = (memory_size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+  for (;;){
+    unsigned int page;
+    if (fread(&page, 4, 1, in) != 1)
+      error_exit("invalid checkpoint file");
+    if (page == END_OF_PAGES)
+      break;
+    if (page >= num_pages ||
+	fread(checkpoint->memory + (size_t)page * MEMORY_PAGE_SIZE, 1, page_bytes(page), in) !=
+	page_bytes(page))
+      error_exit("invalid checkpoint file");
+  }
+}
@@ -0,0 +1,25 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Snapshots of a complete machine state, written to and read from compact binary files.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include "simulator.h"
+
+// Everything a run needs to go on from where the snapshot was taken
+typedef struct
+{
+  int registers[REGISTER_FILE_SIZE];  // with the lazy flag slots
+  unsigned char* memory;              // memory_size bytes, see memory.c
+  unsigned int program_counter;
+  unsigned long long executed;
+  unsigned long long input_offset;    // bytes of input readr had consumed
+} checkpoint_t;
+
+void write_checkpoint(FILE* out, checkpoint_t* checkpoint, instruction_t* instructions,
+		      unsigned int num_instructions);
+void read_checkpoint(FILE* in, checkpoint_t* checkpoint, instruction_t* instructions,
+		     unsigned int num_instructions);
@@ -0,0 +1,256 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Compact program form for the simulator.
+ *
+ * instruction_t holds 5 bytes that the compiler pads to 6, and execute_instruction copies
+ * all of it on every step, then turns the byte program counter into an index and adds
+ * the immediate and 4 on every branch. Here the program is kept as parallel arrays, one
+ * per field, and a step only loads the fields its opcode uses: ret reads nothing but its
+ * opcode byte. The program counter is an instruction index, and the operand of a jump or
+ * call is its target index, resolved once when the arrays are built, so a taken branch is
+ * a single load.
+ *
+ * The arrays have two extra slots, like the threaded engine's code: one past the last
+ * instruction, where the program ends, and one that invalid targets point to.
+ *
+ * The form is built once, when the program is loaded: decode_fields already produces the
+ * field arrays, and compact_build rewrites them in place. Programs decoded lazily or
+ * mapped from the cache get it from their instruction_t array when a compact run first
+ * needs it.
+*/
+
+#include "simulator.h"
+#include "compact.h"
+#include "memory.h"
+
+// Opcodes past readr, only found in the compact form
+enum compact_opcodes{
+  compact_end = readr + 1,  // slot past the last instruction
+  compact_bad               // slot that jumps outside the program go to
+};
+
+// Added to the opcode of an instruction that names %eflags, which must be brought up to
+// date before it runs
+#define SYNC_FLAGS 32
+
+/*
+ * Returns the index of the instruction a jump or call at index i lands on, or bad_index
+ * if its byte target is not an instruction boundary of the program
+*/
+static unsigned int resolve_target(unsigned int i, int immediate, unsigned int num_instructions,
+				   unsigned int bad_index)
+{
+  long long target = (long long)i * 4 + immediate + 4;
+  if (target < 0 || target % 4 != 0 || target > (long long)num_instructions * 4)
+    return bad_index;
+  return (unsigned int)(target / 4);
+}
+
+/*
+ * Builds the compact form of a program from its fields, which must have
+ * COMPACT_EXTRA_SLOTS extra slots, rewriting them in place. The program takes over their
+ * allocation.
+*/
+void compact_build(compact_program_t* program, program_fields_t* fields,
+		   unsigned int num_instructions)
+{
+  program->operands = fields->immediates;
+  program->opcodes = fields->opcodes;
+  program->first_registers = fields->first_registers;
+  program->second_registers = fields->second_registers;
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    unsigned char opcode = program->opcodes[i];
+    if (opcode >= je && opcode <= call)
+      program->operands[i] = resolve_target(i, program->operands[i], num_instructions,
+					    num_instructions + 1);
+    if (program->first_registers[i] == EFLAGS_REG || program->second_registers[i] == EFLAGS_REG)
+      program->opcodes[i] = opcode + SYNC_FLAGS;
+  }
+
+  for (unsigned int i = num_instructions; i < num_instructions + COMPACT_EXTRA_SLOTS; i++){
+    program->opcodes[i] = i == num_instructions ? compact_end : compact_bad;
+    program->operands[i] = 0;
+    program->first_registers[i] = 0;
+    program->second_registers[i] = 0;
+  }
+}
+
+/*
+ * Builds the compact form of a decoded, unfused program from its instruction_t array
+*/
+void compact_from_instructions(compact_program_t* program, instruction_t* instructions,
+			       unsigned int num_instructions)
+{
+  program_fields_t fields;
+  fields_allocate(&fields, num_instructions, COMPACT_EXTRA_SLOTS);
+  for (unsigned int i = 0; i < num_instructions; i++){
+    fields.immediates[i] = instructions[i].immediate;
+    fields.opcodes[i] = instructions[i].opcode;
+    fields.first_registers[i] = instructions[i].first_register;
+    fields.second_registers[i] = instructions[i].second_register;
+  }
+  compact_build(program, &fields, num_instructions);
+}
+
+/*
+ * Runs the program from program_counter over its compact form.
+ * Returns the number of instructions executed.
+*/
+unsigned long long run_compact(const compact_program_t* program, unsigned int num_instructions,
+			       int* registers, unsigned char* memory, io_t* io,
+			       unsigned int program_counter)
+{
+  // The arrays follow operands as fields_allocate lays them out. Found this way rather than
+  // loaded from program, they keep the loop from running out of registers.
+  unsigned int slots = num_instructions + COMPACT_EXTRA_SLOTS;
+  const int* operands = program->operands;
+  const unsigned char* opcodes = (const unsigned char*)(operands + slots);
+  const unsigned char* first_registers = opcodes + slots;
+  const unsigned char* second_registers = first_registers + slots;
+
+  int* esp = &registers[ESP_REG];
+  unsigned long long executed = 0;
+  unsigned int top = memory_size;     // %esp when the outermost ret halts
+  unsigned int last = memory_size - 4; // highest address a 4-byte access may start at
+
+  // The lazy flags live in locals here and go back to the register file when observed
+  int cmp_left = registers[CMP_LEFT];
+  int cmp_right = registers[CMP_RIGHT];
+  int flags_pending = registers[FLAGS_PENDING];
+  unsigned int pc = program_counter % 4 == 0 && program_counter <= num_instructions * 4 ?
+    program_counter / 4 : num_instructions + 1;
+
+#define R1 registers[first_registers[pc]]
+#define R2 registers[second_registers[pc]]
+#define TAKEN(opcode) (flags_pending ? compare_taken(opcode, cmp_left, cmp_right) \
+		       : eflags_taken(opcode, registers[EFLAGS_REG]))
+
+  for (;; executed++){
+    unsigned int opcode = opcodes[pc];
+  execute:
+    switch(opcode)
+    {
+    case subl:
+      R1 -= operands[pc];
+      break;
+
+    case addl_reg_reg:
+      R2 += R1;
+      break;
+
+    case addl_imm_reg:
+      R1 += operands[pc];
+      break;
+
+    case imull:
+      R2 = R1 * R2;
+      break;
+
+    case shrl:
+      R1 = (int)((unsigned int)R1 >> 1);
+      break;
+
+    case movl_reg_reg:
+      R2 = R1;
+      break;
+
+    case movl_deref_reg:
+      R2 = *guest_word(memory, last, R1 + operands[pc]);
+      break;
+
+    case movl_reg_deref:
+      *guest_word(memory, last, R2 + operands[pc]) = R1;
+      break;
+
+    case movl_imm_reg:
+      R1 = operands[pc];
+      break;
+
+    case cmpl:
+      cmp_left = R2;
+      cmp_right = R1;
+      flags_pending = 1;
+      break;
+
+    case je:
+    case jl:
+    case jle:
+    case jge:
+    case jbe:
+      pc = TAKEN(opcode) ? operands[pc] : pc + 1;
+      continue;
+
+    case jmp:
+      pc = operands[pc];
+      continue;
+
+    case call:
+      *esp -= 4;
+      *guest_word(memory, last, *esp) = (int)(pc * 4 + 4);
+      pc = operands[pc];
+      continue;
+
+    case ret:{
+      if ((unsigned int)*esp == top){
+	executed++;
+	goto done;
+      }
+      unsigned int return_address = *guest_word(memory, last, *esp);
+      *esp += 4;
+      if (return_address % 4 != 0 || return_address > num_instructions * 4)
+	pc = num_instructions + 1;
+      else
+	pc = return_address / 4;
+      continue;
+    }
+
+    case pushl:
+      *esp -= 4;
+      *guest_word(memory, last, *esp) = R1;
+      break;
+
+    case popl:
+      R1 = *guest_word(memory, last, *esp);
+      *esp += 4;
+      break;
+
+    case printr:
+      io_print(io, R1);
+      break;
+
+    case readr:
+      io_read(io, &R1);
+      break;
+
+    case compact_end:
+      goto done;
+
+    case compact_bad:
+      error_exit("program counter out of range");
+
+    default:
+      // The instruction names %eflags
+      if (flags_pending){
+	registers[CMP_LEFT] = cmp_left;
+	registers[CMP_RIGHT] = cmp_right;
+	registers[FLAGS_PENDING] = 1;
+	materialize_flags(registers);
+	flags_pending = 0;
+      }
+      opcode -= SYNC_FLAGS;
+      goto execute;
+    }
+    pc++;
+  }
+
+ done:
+#undef R1
+#undef R2
+#undef TAKEN
+  registers[CMP_LEFT] = cmp_left;
+  registers[CMP_RIGHT] = cmp_right;
+  registers[FLAGS_PENDING] = flags_pending;
+  return executed;
+}
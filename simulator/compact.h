@@ -0,0 +1,31 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Interpreter over a compact structure-of-arrays form of the program, with jump and call
+ * targets resolved to instruction indices.
+*/
+
+#pragma once
+
+#include "simulator.h"
+#include "decode.h"
+
+// Slots the compact form has past the last instruction
+#define COMPACT_EXTRA_SLOTS 2
+
+// One array per field in one allocation, which starts at operands
+typedef struct compact_program
+{
+  int* operands;                    // immediate, or target index of a jump or call
+  unsigned char* opcodes;
+  unsigned char* first_registers;
+  unsigned char* second_registers;
+} compact_program_t;
+
+void compact_build(compact_program_t* program, program_fields_t* fields,
+		   unsigned int num_instructions);
+void compact_from_instructions(compact_program_t* program, instruction_t* instructions,
+			       unsigned int num_instructions);
+unsigned long long run_compact(const compact_program_t* program, unsigned int num_instructions,
+			       int* registers, unsigned char* memory, io_t* io,
+			       unsigned int program_counter);
@@ -0,0 +1,378 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Data cache model for the simulator.
+ *
+ * Ahead of each instruction that touches guest memory (movl to or from memory, pushl,
+ * popl, call and ret), run_dcache records the address and the instruction in a buffer. A
+ * full buffer is run through the cache model in one go, so recording an access is only a
+ * few stores. The model is an L1, and optionally an L2 behind it, each set-associative
+ * with its own size, associativity, line size and replacement policy: least recently
+ * used, first in first out, or random. A 4-byte access that crosses a line
+ * boundary, as in unaligned1.s, touches both lines. Stores allocate like loads.
+ *
+ * When the program finishes, the hits and misses of each level overall and per
+ * instruction go to stderr.
+*/
+
+#include <stdlib.h>
+#include "dcache.h"
+#include "analysis.h"
+#include "memory.h"
+
+// Accesses recorded before the cache model runs over them
+#define DCACHE_BATCH 4096
+
+static const char* policy_names[] = { "lru", "fifo", "random" };
+
+// A recorded access, before the cache model has seen it
+typedef struct
+{
+  unsigned int address;
+  unsigned int index;  // of the instruction that made it
+} access_t;
+
+// One level of the cache
+typedef struct
+{
+  sim_cache_config_t config;
+  unsigned int sets;
+  unsigned int line_shift;
+  unsigned int* tags;          // line number + 1 per way, 0 while empty
+  unsigned long long* stamps;  // last use with LRU, fill with FIFO
+  unsigned long long clock;
+  unsigned int seed;           // xorshift state for random replacement
+  unsigned long long hits;
+  unsigned long long misses;
+} cache_level_t;
+
+// Counters for one instruction of the program
+typedef struct
+{
+  unsigned long long accesses;  // line accesses, two for a split access
+  unsigned long long l1_misses;
+  unsigned long long l2_misses;
+} memory_site_t;
+
+// The model while the program runs
+typedef struct
+{
+  cache_level_t l1;
+  cache_level_t l2;
+  cache_level_t* second;        // &l2, or NULL without an L2
+  memory_site_t* sites;
+  access_t* accesses;
+  unsigned int count;           // recorded and not yet run through the levels
+  unsigned long long total;
+  unsigned long long split;
+} dcache_t;
+
+/*
+ * Returns log2 of a power of two, or -1 for anything else
+*/
+static int power_of_two(unsigned int value)
+{
+  if (value == 0 || (value & (value - 1)) != 0)
+    return -1;
+  return __builtin_ctz(value);
+}
+
+/*
+ * Sets up an empty cache level with the given geometry
+*/
+static void level_init(cache_level_t* level, const sim_cache_config_t* config)
+{
+  // In 64 bits, a set of 65536 ways of 65536-byte lines does not wrap to 0
+  unsigned long long set_size = (unsigned long long)config->line * config->ways;
+  if (config->size == 0 || power_of_two(config->line) < 2 || config->ways == 0 ||
+      config->size % set_size != 0 || power_of_two(config->size / set_size) < 0 ||
+      config->policy < REPLACE_LRU || config->policy > REPLACE_RANDOM)
+    error_exit("invalid cache geometry");
+
+  level->config = *config;
+  level->sets = config->size / set_size;
+  level->line_shift = power_of_two(config->line);
+  level->tags = calloc((size_t)level->sets * config->ways, sizeof(unsigned int));
+  level->stamps = calloc((size_t)level->sets * config->ways, sizeof(unsigned long long));
+  if (level->tags == NULL || level->stamps == NULL)
+    error_exit("unable to allocate memory for the cache model");
+  level->clock = 0;
+  level->seed = 4400;
+  level->hits = 0;
+  level->misses = 0;
+}
+
+/*
+ * Frees the arrays of a cache level
+*/
+static void level_free(cache_level_t* level)
+{
+  free(level->tags);
+  free(level->stamps);
+}
+
+/*
+ * Looks up a line number in a cache level and brings it in on a miss.
+ * Returns whether it hit.
+*/
+static int level_access(cache_level_t* level, unsigned int line)
+{
+  unsigned int ways = level->config.ways;
+  unsigned int* tags = &level->tags[(size_t)(line & (level->sets - 1)) * ways];
+  unsigned long long* stamps = &level->stamps[tags - level->tags];
+  level->clock++;
+
+  for (unsigned int way = 0; way < ways; way++){
+    if (tags[way] == line + 1){
+      if (level->config.policy == REPLACE_LRU)
+	stamps[way] = level->clock;
+      level->hits++;
+      return 1;
+    }
+  }
+  level->misses++;
+
+  // An empty way if there is one, otherwise the policy's victim
+  unsigned int victim = 0;
+  if (level->config.policy == REPLACE_RANDOM){
+    level->seed ^= level->seed << 13;
+    level->seed ^= level->seed >> 17;
+    level->seed ^= level->seed << 5;
+    victim = level->seed % ways;
+  }
+  for (unsigned int way = 0; way < ways; way++){
+    if (tags[way] == 0){
+      victim = way;
+      break;
+    }
+    if (level->config.policy != REPLACE_RANDOM && stamps[way] < stamps[victim])
+      victim = way;
+  }
+  tags[victim] = line + 1;
+  stamps[victim] = level->clock;
+  return 0;
+}
+
+/*
+ * Runs the recorded accesses through the cache levels, l2 being NULL without an L2.
+ * Returns the number of accesses that were split across two lines.
+*/
+static unsigned long long run_accesses(access_t* accesses, unsigned int count,
+				       cache_level_t* l1, cache_level_t* l2,
+				       memory_site_t* sites)
+{
+  unsigned long long split = 0;
+  for (unsigned int a = 0; a < count; a++){
+    memory_site_t* site = &sites[accesses[a].index];
+    unsigned int first = accesses[a].address >> l1->line_shift;
+    unsigned int last = (accesses[a].address + 3) >> l1->line_shift;
+    split += first != last;
+    for (unsigned int line = first; line <= last; line++){
+      site->accesses++;
+      if (level_access(l1, line))
+	continue;
+      site->l1_misses++;
+      if (l2 != NULL &&
+	  !level_access(l2, (unsigned int)((unsigned long long)line << l1->line_shift >>
+					   l2->line_shift)))
+	site->l2_misses++;
+    }
+  }
+  return split;
+}
+
+/*
+ * Returns the name of an instruction that accesses memory
+*/
+static const char* access_name(unsigned char opcode)
+{
+  switch (opcode)
+  {
+  case movl_deref_reg:
+    return "movl_deref_reg";
+  case movl_reg_deref:
+    return "movl_reg_deref";
+  case call:
+    return "call";
+  case ret:
+    return "ret";
+  case pushl:
+    return "pushl";
+  case popl:
+    return "popl";
+  }
+  return "unknown";
+}
+
+// A memory site with the index of its instruction, for sorting
+typedef struct
+{
+  memory_site_t site;
+  unsigned int index;
+} ranked_memory_site_t;
+
+/*
+ * Orders ranked memory sites by L1 misses, then accesses, most first
+*/
+static int compare_memory_sites(const void* a, const void* b)
+{
+  const ranked_memory_site_t* left = a;
+  const ranked_memory_site_t* right = b;
+  if (left->site.l1_misses != right->site.l1_misses)
+    return left->site.l1_misses < right->site.l1_misses ? 1 : -1;
+  if (left->site.accesses != right->site.accesses)
+    return left->site.accesses < right->site.accesses ? 1 : -1;
+  return left->index < right->index ? -1 : 1;
+}
+
+/*
+ * Prints one line of the summary for a cache level
+*/
+static void print_level(const char* name, cache_level_t* level)
+{
+  unsigned long long accesses = level->hits + level->misses;
+  fprintf(stderr, "%-10s %14llu %14llu %14llu %9.2f%%\n", name, accesses, level->hits,
+	  level->misses, accesses > 0 ? 100.0 * level->misses / accesses : 0.0);
+}
+
+/*
+ * Writes the cache report to stderr
+*/
+static void print_dcache(instruction_t* instructions, unsigned int num_instructions,
+			 cache_level_t* l1, cache_level_t* l2, memory_site_t* sites,
+			 unsigned long long accesses, unsigned long long split)
+{
+  cache_level_t* levels[] = { l1, l2 };
+  for (int l = 0; l < 2 && levels[l] != NULL; l++){
+    sim_cache_config_t* config = &levels[l]->config;
+    fprintf(stderr, "%s L%d: %u bytes, %u-way, %u-byte lines, %s\n",
+	    l == 0 ? "dcache:" : "       ", l + 1, config->size, config->ways, config->line,
+	    policy_names[config->policy]);
+  }
+  fprintf(stderr, "%-20s %14llu\n", "accesses", accesses);
+  fprintf(stderr, "%-20s %14llu\n", "split accesses", split);
+
+  fprintf(stderr, "\n%-10s %14s %14s %14s %10s\n", "level", "accesses", "hits", "misses",
+	  "miss rate");
+  print_level("L1", l1);
+  if (l2 != NULL)
+    print_level("L2", l2);
+
+  ranked_memory_site_t* order = malloc(sizeof(ranked_memory_site_t) * num_instructions);
+  if (num_instructions > 0 && order == NULL)
+    error_exit("unable to allocate memory for the cache report");
+  unsigned int num_sites = 0;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (sites[i].accesses > 0){
+      order[num_sites].site = sites[i];
+      order[num_sites++].index = i;
+    }
+  }
+  qsort(order, num_sites, sizeof(ranked_memory_site_t), compare_memory_sites);
+
+  fprintf(stderr, "\n%-10s %14s %14s %10s %14s %10s   %s\n", "memory", "accesses",
+	  "L1 misses", "L1 rate", "L2 misses", "L2 rate", "instruction");
+  for (unsigned int n = 0; n < num_sites; n++){
+    memory_site_t* site = &order[n].site;
+    fprintf(stderr, "  0x%06x %14llu %14llu %9.2f%% ", order[n].index * 4, site->accesses,
+	    site->l1_misses, 100.0 * site->l1_misses / site->accesses);
+    if (l2 != NULL)
+      fprintf(stderr, "%14llu %9.2f%%", site->l2_misses,
+	      site->l1_misses > 0 ? 100.0 * site->l2_misses / site->l1_misses : 0.0);
+    else
+      fprintf(stderr, "%14s %10s", "-", "-");
+    fprintf(stderr, "   %s\n", access_name(instructions[order[n].index].opcode));
+  }
+  free(order);
+}
+
+/*
+ * Runs the recorded accesses through the cache levels and empties the buffer
+*/
+static void flush_accesses(dcache_t* dcache)
+{
+  dcache->split += run_accesses(dcache->accesses, dcache->count, &dcache->l1, dcache->second,
+				dcache->sites);
+  dcache->total += dcache->count;
+  dcache->count = 0;
+}
+
+/*
+ * Records the access the instruction at index is about to make, if any
+*/
+static inline unsigned long long record_access(void* state, unsigned int index, instruction_t instr,
+					       int* registers, unsigned long long executed)
+{
+  dcache_t* dcache = state;
+  access_t* access = &dcache->accesses[dcache->count];
+
+  // Addresses come from the registers as the instruction will see them
+  if (registers[FLAGS_PENDING] &&
+      (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG))
+    materialize_flags(registers);
+  int esp = registers[ESP_REG];
+  access->index = index;
+  switch (instr.opcode)
+  {
+  case movl_deref_reg:
+    access->address = registers[instr.first_register] + instr.immediate;
+    break;
+  case movl_reg_deref:
+    access->address = registers[instr.second_register] + instr.immediate;
+    break;
+  case pushl:
+  case call:
+    access->address = esp - 4;
+    break;
+  case popl:
+    access->address = esp;
+    break;
+  case ret:
+    // Returning from main reads nothing
+    if ((unsigned int)esp == memory_size)
+      return 0;
+    access->address = esp;
+    break;
+  default:
+    return 0;
+  }
+  if (++dcache->count == DCACHE_BATCH)
+    flush_accesses(dcache);
+  return 0;
+}
+
+/*
+ * Runs the program through run_hooked, feeding its memory accesses to the cache model,
+ * then prints the report. l2 is NULL for a single level. Returns the number of
+ * instructions executed.
+*/
+unsigned long long run_dcache(instruction_t* instructions, unsigned int num_instructions,
+			      int* registers, unsigned char* memory, io_t* io,
+			      const sim_cache_config_t* l1_config, const sim_cache_config_t* l2_config)
+{
+  dcache_t dcache = { 0 };
+  level_init(&dcache.l1, l1_config);
+  if (l2_config != NULL){
+    level_init(&dcache.l2, l2_config);
+    if (dcache.l2.line_shift < dcache.l1.line_shift)
+      error_exit("the L2 lines must be at least as large as the L1 lines");
+    dcache.second = &dcache.l2;
+  }
+  dcache.sites = calloc(num_instructions, sizeof(memory_site_t));
+  dcache.accesses = malloc(sizeof(access_t) * DCACHE_BATCH);
+  if ((num_instructions > 0 && dcache.sites == NULL) || dcache.accesses == NULL)
+    error_exit("unable to allocate memory for the cache model");
+
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, record_access, NULL, &dcache);
+  flush_accesses(&dcache);
+  print_dcache(instructions, num_instructions, &dcache.l1, dcache.second, dcache.sites,
+	       dcache.total, dcache.split);
+
+  level_free(&dcache.l1);
+  if (dcache.second != NULL)
+    level_free(&dcache.l2);
+  free(dcache.accesses);
+  free(dcache.sites);
+  return executed;
+}
@@ -0,0 +1,13 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Set-associative L1/L2 data cache model fed by the guest's memory accesses.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_dcache(instruction_t* instructions, unsigned int num_instructions,
+			      int* registers, unsigned char* memory, io_t* io,
+			      const sim_cache_config_t* l1, const sim_cache_config_t* l2);
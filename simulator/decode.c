@@ -0,0 +1,140 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Bulk instruction decoder for the simulator.
+ *
+ * decode_instruction takes one word at a time: four shifts and masks, and a branch to
+ * sign-extend the immediate. decode_bulk does the same to DECODE_WIDTH words at once with
+ * GCC vector types and writes each field to its own array, structure of arrays, with the
+ * immediate sign-extended to an int. In the same pass it counts the invalid instructions,
+ * those with an opcode past readr or a register past %eflags.
+ *
+ * Loading goes through decode_fields, so a program with an invalid instruction is refused
+ * by the same pass that decodes it.
+ *
+ * GCC builds decode_bulk twice, for AVX2 and for plain x86-64, where each vector becomes
+ * a pair of SSE2 registers, and picks one for the CPU when the program is loaded, so the
+ * Makefile needs no -mavx2.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "decode.h"
+
+typedef unsigned int words_t __attribute__((vector_size(DECODE_WIDTH * sizeof(int))));
+typedef int swords_t __attribute__((vector_size(DECODE_WIDTH * sizeof(int))));
+typedef unsigned char fields_t __attribute__((vector_size(DECODE_WIDTH)));
+typedef unsigned char word_bytes_t __attribute__((vector_size(DECODE_WIDTH * sizeof(int))));
+
+// The low byte of each lane, all a field needs once it is shifted and masked
+#define NARROW(words) __builtin_shufflevector((word_bytes_t)(words), (word_bytes_t)(words), \
+					      0, 4, 8, 12, 16, 20, 24, 28)
+
+/*
+ * Decodes num_instructions words into the four field arrays, one word at a time.
+ * Returns the number of invalid instructions.
+*/
+unsigned int decode_scalar(const unsigned int* bytes, unsigned int num_instructions,
+			   unsigned char* opcodes, unsigned char* first_registers,
+			   unsigned char* second_registers, int* immediates)
+{
+  unsigned int invalid = 0;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    unsigned int word = bytes[i];
+    opcodes[i] = word >> 27;
+    first_registers[i] = (word >> 22) & 0x1F;
+    second_registers[i] = (word >> 17) & 0x1F;
+    immediates[i] = (int16_t)(word & 0xFFFF);
+    invalid += opcodes[i] > readr || first_registers[i] >= NUM_REGS ||
+      second_registers[i] >= NUM_REGS;
+  }
+  return invalid;
+}
+
+/*
+ * Decodes num_instructions words into the four field arrays, DECODE_WIDTH at a time.
+ * Returns the number of invalid instructions.
+*/
+__attribute__((target_clones("avx2", "default")))
+unsigned int decode_bulk(const unsigned int* bytes, unsigned int num_instructions,
+			 unsigned char* opcodes, unsigned char* first_registers,
+			 unsigned char* second_registers, int* immediates)
+{
+  // Lanes count down by one for each invalid instruction they see
+  swords_t invalid = { 0 };
+  unsigned int i = 0;
+  for (; i + DECODE_WIDTH <= num_instructions; i += DECODE_WIDTH){
+    words_t words;
+    memcpy(&words, bytes + i, sizeof(words));
+    words_t opcode = words >> 27;
+    words_t first_register = (words >> 22) & 0x1F;
+    words_t second_register = (words >> 17) & 0x1F;
+    swords_t immediate = (swords_t)(words << 16) >> 16;
+    invalid += (opcode > readr) | (first_register >= NUM_REGS) |
+      (second_register >= NUM_REGS);
+
+    fields_t narrowed = NARROW(opcode);
+    memcpy(opcodes + i, &narrowed, DECODE_WIDTH);
+    narrowed = NARROW(first_register);
+    memcpy(first_registers + i, &narrowed, DECODE_WIDTH);
+    narrowed = NARROW(second_register);
+    memcpy(second_registers + i, &narrowed, DECODE_WIDTH);
+    memcpy(immediates + i, &immediate, sizeof(immediate));
+  }
+
+  unsigned int count = 0;
+  for (int lane = 0; lane < DECODE_WIDTH; lane++)
+    count -= invalid[lane];
+  return count + decode_scalar(bytes + i, num_instructions - i, opcodes + i,
+			       first_registers + i, second_registers + i, immediates + i);
+}
+
+/*
+ * Allocates fields for num_instructions with room for extra_slots more after them
+*/
+void fields_allocate(program_fields_t* fields, unsigned int num_instructions,
+		     unsigned int extra_slots)
+{
+  // One byte more than the fields need, so the allocation is never empty
+  size_t slots = (size_t)num_instructions + extra_slots;
+  fields->immediates = malloc((sizeof(int) + 3) * slots + 1);
+  if (fields->immediates == NULL)
+    error_exit("unable to allocate memory for the program");
+  fields->opcodes = (unsigned char*)(fields->immediates + slots);
+  fields->first_registers = fields->opcodes + slots;
+  fields->second_registers = fields->first_registers + slots;
+}
+
+/*
+ * Decodes a program into new fields with decode_bulk, leaving extra_slots after it.
+ * Returns 0, with nothing allocated, if any of its instructions is invalid.
+*/
+int decode_fields(const unsigned int* bytes, unsigned int num_instructions,
+		  unsigned int extra_slots, program_fields_t* fields)
+{
+  fields_allocate(fields, num_instructions, extra_slots);
+  if (decode_bulk(bytes, num_instructions, fields->opcodes, fields->first_registers,
+		  fields->second_registers, fields->immediates) != 0){
+    free(fields->immediates);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns a new array of the program's instructions as instruction_t, for the engines
+ * that run those
+*/
+instruction_t* fields_instructions(const program_fields_t* fields, unsigned int num_instructions)
+{
+  instruction_t* instructions = malloc(sizeof(instruction_t) * num_instructions + 1);
+  if (instructions == NULL)
+    error_exit("unable to allocate memory for the program");
+  for (unsigned int i = 0; i < num_instructions; i++){
+    instructions[i].opcode = fields->opcodes[i];
+    instructions[i].first_register = fields->first_registers[i];
+    instructions[i].second_register = fields->second_registers[i];
+    instructions[i].immediate = fields->immediates[i];
+  }
+  return instructions;
+}
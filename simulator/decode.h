@@ -0,0 +1,33 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Bulk instruction decoder from raw words into parallel field arrays.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+// Instruction words decoded per vector step
+#define DECODE_WIDTH 8
+
+// A program as one array per field, in a single allocation that starts at immediates
+typedef struct
+{
+  int* immediates;
+  unsigned char* opcodes;
+  unsigned char* first_registers;
+  unsigned char* second_registers;
+} program_fields_t;
+
+unsigned int decode_bulk(const unsigned int* bytes, unsigned int num_instructions,
+			 unsigned char* opcodes, unsigned char* first_registers,
+			 unsigned char* second_registers, int* immediates);
+unsigned int decode_scalar(const unsigned int* bytes, unsigned int num_instructions,
+			   unsigned char* opcodes, unsigned char* first_registers,
+			   unsigned char* second_registers, int* immediates);
+void fields_allocate(program_fields_t* fields, unsigned int num_instructions,
+		     unsigned int extra_slots);
+int decode_fields(const unsigned int* bytes, unsigned int num_instructions,
+		  unsigned int extra_slots, program_fields_t* fields);
+instruction_t* fields_instructions(const program_fields_t* fields, unsigned int num_instructions);
@@ -0,0 +1,131 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Bounds-check hoisting for the JIT.
+ *
+ * Every guest memory access is checked against memory_size (see memory.c). Within a basic
+ * block, accesses often go through one base register at constant offsets: the
+ * 0(%esp)..20(%esp) stores of a stack frame, or pushes and pops that move %esp by 4 each
+ * time. This pass follows each register through the block as its entry value plus a known
+ * constant, as long as only subl, addl $imm, pushl, popl and call change it, and gathers
+ * the offsets accessed through it. A register with two or more accesses gets one range
+ * check at block entry covering all of them, and those accesses need no check of their own.
+ *
+ * Every instruction of a block runs once the block is entered, so the check fails only if
+ * one of the covered accesses would fault, or the block ends with the ret that returns from
+ * main. The block then has to run with a check on every access instead.
+*/
+
+#include "hoist.h"
+#include "memory.h"
+
+// Offsets beyond this stop being followed, so they always fit in an int
+#define MAX_OFFSET (1 << 30)
+
+/*
+ * Counts an access through reg at offset from its entry value, and returns reg + 1, what
+ * covered holds for the access until the checks are chosen
+*/
+static unsigned char note_access(range_check_t* ranges, int* counts, int reg, long long offset)
+{
+  if (offset < -MAX_OFFSET || offset > MAX_OFFSET)
+    return 0;
+  if (counts[reg] == 0 || offset < ranges[reg].low)
+    ranges[reg].low = offset;
+  if (counts[reg] == 0 || offset > ranges[reg].high)
+    ranges[reg].high = offset;
+  counts[reg]++;
+  return reg + 1;
+}
+
+/*
+ * Finds the range checks for the block of instructions start..end-1, storing them in
+ * checks (room for MAX_RANGE_CHECKS) and setting covered[i - start] for every instruction
+ * whose access they cover. Returns the number of checks.
+*/
+int hoist_range_checks(instruction_t* instructions, unsigned int start, unsigned int end,
+		       range_check_t* checks, unsigned char* covered)
+{
+  // Each register is its value at entry plus delta[r] while known[r]
+  long long delta[NUM_REGS];
+  int known[NUM_REGS];
+  range_check_t ranges[NUM_REGS];
+  int counts[NUM_REGS];
+  for (int r = 0; r < NUM_REGS; r++){
+    delta[r] = 0;
+    known[r] = r != EFLAGS_REG;  // written whenever the lazy flags are brought up to date
+    counts[r] = 0;
+  }
+
+  for (unsigned int i = start; i < end; i++){
+    instruction_t instr = instructions[i];
+    int reg1 = instr.first_register;
+    int reg2 = instr.second_register;
+    covered[i - start] = 0;
+    if (instr.opcode > readr || reg1 >= NUM_REGS || reg2 >= NUM_REGS){
+      for (unsigned int j = start; j <= i; j++)
+	covered[j - start] = 0;
+      return 0;
+    }
+
+    switch(instr.opcode)
+    {
+    case subl:
+      delta[reg1] -= instr.immediate;
+      break;
+    case addl_imm_reg:
+      delta[reg1] += instr.immediate;
+      break;
+    case addl_reg_reg:
+    case imull:
+    case movl_reg_reg:
+      known[reg2] = 0;
+      break;
+    case shrl:
+    case movl_imm_reg:
+    case readr:
+      known[reg1] = 0;
+      break;
+    case movl_deref_reg:
+      if (known[reg1])
+	covered[i - start] = note_access(ranges, counts, reg1, delta[reg1] + instr.immediate);
+      known[reg2] = 0;
+      break;
+    case movl_reg_deref:
+      if (known[reg2])
+	covered[i - start] = note_access(ranges, counts, reg2, delta[reg2] + instr.immediate);
+      break;
+    case pushl:
+    case call:
+      delta[ESP_REG] -= 4;
+      if (known[ESP_REG])
+	covered[i - start] = note_access(ranges, counts, ESP_REG, delta[ESP_REG]);
+      break;
+    case popl:
+    case ret:
+      if (known[ESP_REG])
+	covered[i - start] = note_access(ranges, counts, ESP_REG, delta[ESP_REG]);
+      if (instr.opcode == popl)
+	known[reg1] = 0;
+      delta[ESP_REG] += 4;
+      break;
+    }
+  }
+
+  // A lone access keeps its own check, and so do ranges wider than memory
+  int num_checks = 0;
+  int hoisted[NUM_REGS];
+  for (int r = 0; r < NUM_REGS; r++){
+    hoisted[r] = counts[r] >= 2 &&
+      (long long)ranges[r].high - ranges[r].low <= (long long)memory_size - 4;
+    if (hoisted[r]){
+      checks[num_checks] = ranges[r];
+      checks[num_checks++].reg = r;
+    }
+  }
+  for (unsigned int i = start; i < end; i++){
+    if (covered[i - start])
+      covered[i - start] = hoisted[covered[i - start] - 1];
+  }
+  return num_checks;
+}
@@ -0,0 +1,26 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Bounds-check hoisting: one range check at the entry of a basic block for the memory
+ * accesses in it that go through the same base register.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+// Most range checks for one block, one per base register
+#define MAX_RANGE_CHECKS NUM_REGS
+
+// Accesses through reg, at offsets low..high from its value at block entry.
+// They are all in memory exactly when reg + low, as unsigned, is at most
+// memory_size - 4 - (high - low).
+typedef struct
+{
+  unsigned char reg;
+  int low;
+  int high;
+} range_check_t;
+
+int hoist_range_checks(instruction_t* instructions, unsigned int start, unsigned int end,
+		       range_check_t* checks, unsigned char* covered);
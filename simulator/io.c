@@ -0,0 +1,215 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Buffered I/O layer for the simulator's printr and readr.
+ *
+ * printr used to be one fprintf("%d (0x%x)\n") and readr one fscanf("%d") per execution,
+ * and programs that print or read in a loop spent most of their time parsing the format
+ * strings. Here the decimal and hex digits are produced by hand into a 64 KB buffer, which
+ * is written out when it fills up and when the io_t is closed, and the input is read in
+ * 64 KB chunks and parsed directly. The bytes produced and the integers accepted are the
+ * same as with the stdio calls.
+ *
+ * Before refilling the input buffer the pending output is flushed, so a program that
+ * prompts and then reads still shows the prompt first.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include "simulator.h"
+
+// Room for "-2147483648 (0x80000000)\n"
+#define MAX_LINE 32
+
+// The io_t writing to stdout, flushed before error_exit prints its message
+static io_t* stdout_io;
+
+/*
+ * Sets up io to read from in and write to out
+*/
+void io_open(io_t* io, FILE* in, FILE* out)
+{
+  io->in = in;
+  io->out = out;
+  io->in_buffer = malloc(IO_BUFFER_SIZE);
+  io->out_buffer = malloc(IO_BUFFER_SIZE);
+  if (io->in_buffer == NULL || io->out_buffer == NULL)
+    error_exit("unable to allocate memory for I/O buffers");
+  io->in_position = 0;
+  io->in_length = 0;
+  io->in_offset = 0;
+  io->out_length = 0;
+  io->line_buffered = isatty(fileno(out));
+  io->print = NULL;
+  io->read = NULL;
+  io->user = NULL;
+  if (out == stdout)
+    stdout_io = io;
+}
+
+/*
+ * Flushes the pending output and frees the buffers. The files stay open.
+*/
+void io_close(io_t* io)
+{
+  io_flush(io);
+  if (stdout_io == io)
+    stdout_io = NULL;
+  free(io->in_buffer);
+  free(io->out_buffer);
+}
+
+/*
+ * Writes the buffered output to the output file
+*/
+void io_flush(io_t* io)
+{
+  if (io->out_length > 0)
+    fwrite(io->out_buffer, 1, io->out_length, io->out);
+  io->out_length = 0;
+  if (io->line_buffered)
+    fflush(io->out);
+}
+
+/*
+ * Flushes the output of the io_t writing to stdout, if there is one
+*/
+void io_flush_stdout()
+{
+  if (stdout_io != NULL){
+    io_flush(stdout_io);
+    fflush(stdout);
+  }
+}
+
+/*
+ * Appends "<value> (0x<hex value>)\n" to the output, same as printf("%d (0x%x)\n")
+*/
+void io_print(io_t* io, int value)
+{
+  if (io->print != NULL){
+    io->print(io->user, value);
+    return;
+  }
+  if (io->out_length > IO_BUFFER_SIZE - MAX_LINE)
+    io_flush(io);
+
+  char* out = io->out_buffer + io->out_length;
+  char digits[10];
+  int count = 0;
+
+  // Decimal, going through unsigned so INT_MIN negates cleanly
+  unsigned int magnitude = value < 0 ? -(unsigned int)value : value;
+  if (value < 0)
+    *out++ = '-';
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  while (count > 0)
+    *out++ = digits[--count];
+
+  *out++ = ' ';
+  *out++ = '(';
+  *out++ = '0';
+  *out++ = 'x';
+
+  unsigned int bits = value;
+  do {
+    digits[count++] = "0123456789abcdef"[bits & 0xF];
+    bits >>= 4;
+  } while (bits != 0);
+  while (count > 0)
+    *out++ = digits[--count];
+
+  *out++ = ')';
+  *out++ = '\n';
+  io->out_length = out - io->out_buffer;
+
+  if (io->line_buffered)
+    io_flush(io);
+}
+
+/*
+ * Returns the next input character without consuming it, or EOF
+*/
+static inline int peek_char(io_t* io)
+{
+  if (io->in_position == io->in_length){
+    io_flush(io);
+    // A memory stream has no descriptor to read from
+    int descriptor = fileno(io->in);
+    ssize_t num_read = descriptor >= 0 ? read(descriptor, io->in_buffer, IO_BUFFER_SIZE) :
+      (ssize_t)fread(io->in_buffer, 1, IO_BUFFER_SIZE, io->in);
+    if (num_read <= 0)
+      return EOF;
+    io->in_offset += io->in_length;
+    io->in_position = 0;
+    io->in_length = num_read;
+  }
+  return (unsigned char)io->in_buffer[io->in_position];
+}
+
+/*
+ * Parses a decimal integer the way scanf("%d") does: leading white space is skipped, then
+ * an optional sign and the digits. Returns 1 and sets *value on success, 0 if the next
+ * character cannot start a number, and EOF at the end of the input, leaving *value alone
+ * in the last two cases. Out-of-range numbers saturate at the range of long and are then
+ * truncated to int, like glibc.
+*/
+int io_read(io_t* io, int* value)
+{
+  if (io->read != NULL)
+    return io->read(io->user, value) == 1 ? 1 : EOF;
+  int c;
+  while ((c = peek_char(io)) == ' ' || (c >= '\t' && c <= '\r'))
+    io->in_position++;
+  if (c == EOF)
+    return EOF;
+
+  int negative = 0;
+  if (c == '+' || c == '-'){
+    negative = c == '-';
+    io->in_position++;
+    c = peek_char(io);
+  }
+  if (c < '0' || c > '9')
+    return 0;
+
+  unsigned long magnitude = 0;
+  int overflow = 0;
+  do {
+    unsigned long digit = c - '0';
+    if (magnitude > (ULONG_MAX - digit) / 10)
+      overflow = 1;
+    else
+      magnitude = magnitude * 10 + digit;
+    io->in_position++;
+  } while ((c = peek_char(io)) >= '0' && c <= '9');
+
+  long result;
+  if (negative)
+    result = overflow || magnitude > (unsigned long)LONG_MAX + 1 ? LONG_MIN : -(long)(magnitude - 1) - 1;
+  else
+    result = overflow || magnitude > LONG_MAX ? LONG_MAX : (long)magnitude;
+  *value = (int)result;
+  return 1;
+}
+
+/*
+ * Consumes count bytes of input, as if readr had already read past them. The input
+ * position moves on by count even where the input ends first.
+*/
+void io_skip(io_t* io, unsigned long long count)
+{
+  if (io->read != NULL)
+    return;
+  while (count > 0 && peek_char(io) != EOF){
+    unsigned int available = io->in_length - io->in_position;
+    unsigned int skipped = count < available ? count : available;
+    io->in_position += skipped;
+    count -= skipped;
+  }
+  io->in_offset += count;
+}
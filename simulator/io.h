@@ -0,0 +1,39 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Buffered I/O for printr and readr.
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+#define IO_BUFFER_SIZE 65536
+
+// Where readr reads from and printr writes to. printr output is formatted into out_buffer
+// and written to out in large chunks, readr parses integers out of in_buffer, which is
+// refilled from in with large reads.
+typedef struct
+{
+  FILE* in;
+  FILE* out;
+  char* in_buffer;
+  unsigned int in_position;
+  unsigned int in_length;
+  unsigned long long in_offset;  // input bytes before in_buffer, so the cursor is this plus in_position
+  char* out_buffer;
+  unsigned int out_length;
+  int line_buffered;  // out is a terminal, so every line goes out right away like stdio does
+  // Set with sim_set_io, these replace the files and buffers
+  void (*print)(void* user, int value);
+  int (*read)(void* user, int* value);
+  void* user;
+} io_t;
+
+void io_open(io_t* io, FILE* in, FILE* out);
+void io_close(io_t* io);
+void io_flush(io_t* io);
+void io_flush_stdout();
+void io_print(io_t* io, int value);
+int io_read(io_t* io, int* value);
+void io_skip(io_t* io, unsigned long long count);
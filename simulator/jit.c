@@ -0,0 +1,675 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Basic-block JIT compiler for the simulator.
+ *
+ * A block starts at whatever PC the dispatcher is asked to run and ends at the first
+ * jmp, jcc, call or ret. The dispatcher interprets a block with execute_instruction
+ * until it has been entered JIT_HOT_THRESHOLD times, then translates it to x86-64 in an
+ * mmap'd executable buffer. A compiled block exits by jumping straight into its
+ * successor's native code. Exits to blocks that are not compiled yet return to the
+ * dispatcher, and are patched into direct jumps once the successor gets compiled.
+ *
+ * Native code keeps these host registers for the whole time it runs:
+ *   rbx  guest register file
+ *   r12  guest memory
+ *   r13  executed instruction counter
+ *   r14  native entry point per instruction index, used by ret
+ *   r15  the run's io_t, passed to printr and readr
+ * On the way back to the dispatcher, eax holds the next guest PC. Every access to guest
+ * memory is compared with its size first and leaves through the fault stub if it is out of
+ * range, so the dispatcher can stop the run. Accesses that share a base register in a
+ * block are covered by one range check at block entry instead, see hoist.c; when that
+ * check fails the block returns its own PC plus RECHECK and the dispatcher interprets it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "simulator.h"
+#include "jit.h"
+#include "memory.h"
+#include "hoist.h"
+
+// Size of the code buffer. Once it is full, the remaining cold blocks stay interpreted
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+// Times a block is interpreted before it is compiled
+#define JIT_HOT_THRESHOLD 16
+// Longest straight-line block, longer runs are split and chained. It also keeps the
+// count a bounds check takes back within a sign-extended imm8.
+#define JIT_MAX_BLOCK 100
+// Upper bound on the native bytes emitted for one guest instruction (ret is the largest)
+#define JIT_MAX_INSTR_BYTES 128
+
+// What the fault stub hands the dispatcher, never a valid PC since it is not a multiple of 4
+#define FAULT_PC 0xFFFFFFFEu
+// Added to the PC of a block whose range check at entry failed
+#define RECHECK 2
+
+// Byte offset of a guest register in the register file pointed to by rbx
+#define REG(r) ((r) * 4)
+
+// What a block knows at compile time about the lazy flags
+enum flag_states{
+  FLAGS_UNKNOWN, // depends on how the block was entered
+  FLAGS_LAZY,    // a cmpl in this block recorded its operands
+  FLAGS_CURRENT  // %eflags holds the flags
+};
+
+// A block exit that still returns to the dispatcher, waiting for its target to be compiled
+typedef struct
+{
+  unsigned int offset; // position of the "mov eax, pc" that gets overwritten with a jmp
+  int next;            // next pending exit to the same target, or -1
+} pending_exit_t;
+
+typedef struct
+{
+  instruction_t* instructions;
+  unsigned int num_instructions;
+
+  unsigned char* buffer;
+  unsigned int used;
+  int full;
+
+  void** blocks;                 // native entry point per instruction index, NULL if none
+  unsigned int* entry_counts;    // times the dispatcher interpreted a block
+  unsigned char* not_compilable; // blocks the JIT cannot translate
+
+  pending_exit_t* exits;
+  unsigned int num_exits;
+  unsigned int max_exits;
+  int* first_exit;               // head of the pending exit list per target index
+
+  unsigned int exit_stub;        // offset of the code that returns to the dispatcher
+  unsigned int fault_stub;       // offset of the code that returns FAULT_PC
+  unsigned long long executed;
+} jit_t;
+
+// Signature of the entry trampoline at the start of the buffer
+typedef unsigned int (*jit_entry_t)(void* block, int* registers, unsigned char* memory,
+				    unsigned long long* executed, void** blocks, io_t* io);
+
+/*
+ * Called from native code for printr
+*/
+static void jit_printr(io_t* io, int value)
+{
+  io_print(io, value);
+}
+
+/*
+ * Called from native code for readr
+*/
+static void jit_readr(io_t* io, int* reg)
+{
+  io_read(io, reg);
+}
+
+/*
+ * Appends count bytes, given as int arguments, to the code buffer
+*/
+static void emit(jit_t* jit, int count, ...)
+{
+  va_list bytes;
+  va_start(bytes, count);
+  for (int i = 0; i < count; i++)
+    jit->buffer[jit->used++] = (unsigned char)va_arg(bytes, int);
+  va_end(bytes);
+}
+
+static void emit32(jit_t* jit, uint32_t value)
+{
+  memcpy(&jit->buffer[jit->used], &value, 4);
+  jit->used += 4;
+}
+
+static void emit64(jit_t* jit, uint64_t value)
+{
+  memcpy(&jit->buffer[jit->used], &value, 8);
+  jit->used += 8;
+}
+
+/*
+ * Emits the 32-bit displacement from the end of the current instruction to target
+*/
+static void emit_rel32(jit_t* jit, unsigned int target)
+{
+  emit32(jit, target - (jit->used + 4));
+}
+
+/*
+ * Points the rel32 at offset (the last 4 bytes of a jump) to target
+*/
+static void patch_rel32(jit_t* jit, unsigned int offset, unsigned int target)
+{
+  uint32_t displacement = target - (offset + 4);
+  memcpy(&jit->buffer[offset], &displacement, 4);
+}
+
+/*
+ * Emits a call to a C function, with the arguments already in rdi and rsi
+*/
+static void emit_call(jit_t* jit, void* function)
+{
+  emit(jit, 2, 0x48, 0xB8); // mov rax, imm64
+  emit64(jit, (uint64_t)(uintptr_t)function);
+  emit(jit, 2, 0xFF, 0xD0); // call rax
+}
+
+/*
+ * Emits a block exit to target_pc: a direct jump if that block is already compiled,
+ * otherwise a return to the dispatcher that is patched once the block is compiled.
+*/
+static void emit_exit(jit_t* jit, unsigned int target_pc)
+{
+  unsigned int index = target_pc / 4;
+  int chainable = target_pc % 4 == 0 && index < jit->num_instructions;
+
+  if (chainable && jit->blocks[index] != NULL){
+    emit(jit, 1, 0xE9); // jmp rel32
+    emit_rel32(jit, (unsigned char*)jit->blocks[index] - jit->buffer);
+    return;
+  }
+
+  if (chainable){
+    if (jit->num_exits == jit->max_exits){
+      jit->max_exits = jit->max_exits ? jit->max_exits * 2 : 256;
+      jit->exits = realloc(jit->exits, sizeof(pending_exit_t) * jit->max_exits);
+      if (jit->exits == NULL)
+	error_exit("unable to allocate memory for JIT exits");
+    }
+    jit->exits[jit->num_exits].offset = jit->used;
+    jit->exits[jit->num_exits].next = jit->first_exit[index];
+    jit->first_exit[index] = jit->num_exits++;
+  }
+
+  emit(jit, 1, 0xB8); // mov eax, target_pc
+  emit32(jit, target_pc);
+  emit(jit, 1, 0xE9); // jmp exit_stub
+  emit_rel32(jit, jit->exit_stub);
+}
+
+/*
+ * Emits the entry trampoline and the exit stub at the start of the buffer
+*/
+static void emit_trampoline(jit_t* jit)
+{
+  // Save the callee-saved registers we use, five pushes keep rsp 16-byte aligned for calls
+  emit(jit, 9, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, r12-r15
+  emit(jit, 3, 0x48, 0x89, 0xF3);  // mov rbx, rsi
+  emit(jit, 3, 0x49, 0x89, 0xD4);  // mov r12, rdx
+  emit(jit, 3, 0x49, 0x89, 0xCD);  // mov r13, rcx
+  emit(jit, 3, 0x4D, 0x89, 0xC6);  // mov r14, r8
+  emit(jit, 3, 0x4D, 0x89, 0xCF);  // mov r15, r9
+  emit(jit, 2, 0xFF, 0xE7);        // jmp rdi
+
+  jit->exit_stub = jit->used;
+  emit(jit, 10, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); // pop; ret
+
+  jit->fault_stub = jit->used;
+  emit(jit, 1, 0xB8);              // mov eax, FAULT_PC
+  emit32(jit, FAULT_PC);
+  emit(jit, 1, 0xE9);              // jmp exit_stub
+  emit_rel32(jit, jit->exit_stub);
+}
+
+/*
+ * Emits the check that the guest address in eax starts a word inside guest memory.
+ * Past it rax is the zero-extended address, ready to index r12. The block was counted
+ * whole at entry, so on the way to the fault stub the check takes back the unexecuted
+ * instructions, the faulting one and those after it.
+*/
+static void emit_bounds_check(jit_t* jit, unsigned int unexecuted)
+{
+  emit(jit, 1, 0x3D);                            // cmp eax, memory_size - 4
+  emit32(jit, memory_size - 4);
+  emit(jit, 2, 0x76, 10);                        // jbe over the fault
+  emit(jit, 5, 0x49, 0x83, 0x6D, 0x00, unexecuted);  // sub qword [r13], unexecuted
+  emit(jit, 1, 0xE9);                            // jmp fault_stub
+  emit_rel32(jit, jit->fault_stub);
+}
+
+/*
+ * Returns whether opcode is the last instruction of a basic block
+*/
+static int ends_block(unsigned char opcode)
+{
+  return (opcode >= je && opcode <= ret);
+}
+
+/*
+ * Returns whether the JIT knows how to translate instr
+*/
+static int can_translate(instruction_t instr)
+{
+  if (instr.opcode > readr)
+    return 0;
+
+  // Every opcode but the control transfers reads the first register
+  int uses_reg1 = !ends_block(instr.opcode);
+  int uses_reg2 = instr.opcode == addl_reg_reg || instr.opcode == imull ||
+    instr.opcode == movl_reg_reg || instr.opcode == movl_deref_reg ||
+    instr.opcode == movl_reg_deref || instr.opcode == cmpl;
+
+  if (uses_reg1 && instr.first_register >= NUM_REGS)
+    return 0;
+  if (uses_reg2 && instr.second_register >= NUM_REGS)
+    return 0;
+  return 1;
+}
+
+/*
+ * Emits a comparison of the operands recorded by cmpl and the conditional jump to the
+ * taken exit. Returns the offset of the jump's rel32 to patch.
+*/
+static unsigned int emit_lazy_test(jit_t* jit, unsigned char opcode)
+{
+  // Host condition codes for je, jl, jle, jge and jbe after "cmp left, right"
+  static const unsigned char conditions[] = { 0x84, 0x8C, 0x8E, 0x8D, 0x86 };
+
+  emit(jit, 3, 0x8B, 0x43, REG(CMP_LEFT));   // mov eax, [rbx+left]
+  emit(jit, 3, 0x3B, 0x43, REG(CMP_RIGHT));  // cmp eax, [rbx+right]
+  emit(jit, 2, 0x0F, conditions[opcode - je]);
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+/*
+ * Emits a test of the bits in %eflags and the conditional jump to the taken exit.
+ * Returns the offset of the jump's rel32 to patch.
+*/
+static unsigned int emit_eflags_test(jit_t* jit, unsigned char opcode)
+{
+  // Leave the host zero flag clear exactly when the branch is taken (jge: set)
+  emit(jit, 3, 0x8B, 0x43, REG(EFLAGS_REG));  // mov eax, [rbx+eflags]
+  if (opcode == je || opcode == jbe){
+    emit(jit, 1, 0xA9);                       // test eax, imm32
+    emit32(jit, opcode == je ? ZF_FLAG : CF_FLAG | ZF_FLAG);
+  }
+  else{
+    // SF ^ OF ends up in bit 7 of ecx
+    emit(jit, 2, 0x89, 0xC1);                 // mov ecx, eax
+    emit(jit, 3, 0xC1, 0xE9, 4);              // shr ecx, 4
+    emit(jit, 2, 0x31, 0xC1);                 // xor ecx, eax
+    if (opcode == jle){
+      emit(jit, 2, 0x81, 0xE1);               // and ecx, SF
+      emit32(jit, SF_FLAG);
+      emit(jit, 1, 0x25);                     // and eax, ZF
+      emit32(jit, ZF_FLAG);
+      emit(jit, 2, 0x09, 0xC1);               // or ecx, eax
+    }
+    else{
+      emit(jit, 2, 0xF7, 0xC1);               // test ecx, SF
+      emit32(jit, SF_FLAG);
+    }
+  }
+  emit(jit, 2, 0x0F, opcode == jge ? 0x84 : 0x85);  // jz/jnz taken
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+/*
+ * Emits the native code for the instruction at index, in the block that ends before end.
+ * flags tracks what is known about the lazy flags at this point of the block, and covered
+ * says whether a range check at block entry already covers its memory access.
+*/
+static void emit_instruction(jit_t* jit, unsigned int index, unsigned int end, int* flags,
+			     int covered)
+{
+  instruction_t instr = jit->instructions[index];
+  unsigned int program_counter = index * 4;
+  unsigned int target = program_counter + instr.immediate + 4;
+  int reg1 = REG(instr.first_register);
+  int reg2 = REG(instr.second_register);
+
+  // Instructions that name %eflags see it up to date
+  if (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG){
+    if (*flags != FLAGS_CURRENT){
+      emit(jit, 3, 0x48, 0x89, 0xDF);  // mov rdi, rbx
+      emit_call(jit, (void*)materialize_flags);
+    }
+    *flags = FLAGS_CURRENT;
+  }
+
+  switch(instr.opcode)
+  {
+  case subl:
+    emit(jit, 3, 0x81, 0x6B, reg1);  // sub dword [rbx+reg1], imm32
+    emit32(jit, instr.immediate);
+    break;
+
+  case addl_reg_reg:
+    emit(jit, 3, 0x8B, 0x43, reg1);  // mov eax, [rbx+reg1]
+    emit(jit, 3, 0x01, 0x43, reg2);  // add [rbx+reg2], eax
+    break;
+
+  case addl_imm_reg:
+    emit(jit, 3, 0x81, 0x43, reg1);  // add dword [rbx+reg1], imm32
+    emit32(jit, instr.immediate);
+    break;
+
+  case imull:
+    emit(jit, 3, 0x8B, 0x43, reg1);        // mov eax, [rbx+reg1]
+    emit(jit, 4, 0x0F, 0xAF, 0x43, reg2);  // imul eax, [rbx+reg2]
+    emit(jit, 3, 0x89, 0x43, reg2);        // mov [rbx+reg2], eax
+    break;
+
+  case shrl:
+    emit(jit, 3, 0xD1, 0x6B, reg1);  // shr dword [rbx+reg1], 1
+    break;
+
+  case movl_reg_reg:
+    emit(jit, 3, 0x8B, 0x43, reg1);  // mov eax, [rbx+reg1]
+    emit(jit, 3, 0x89, 0x43, reg2);  // mov [rbx+reg2], eax
+    break;
+
+  case movl_deref_reg:
+    emit(jit, 3, 0x8B, 0x43, reg1);        // mov eax, [rbx+reg1]
+    emit(jit, 1, 0x05);                    // add eax, imm32
+    emit32(jit, instr.immediate);
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 4, 0x41, 0x8B, 0x04, 0x04);  // mov eax, [r12+rax]
+    emit(jit, 3, 0x89, 0x43, reg2);        // mov [rbx+reg2], eax
+    break;
+
+  case movl_reg_deref:
+    emit(jit, 3, 0x8B, 0x43, reg2);        // mov eax, [rbx+reg2]
+    emit(jit, 1, 0x05);                    // add eax, imm32
+    emit32(jit, instr.immediate);
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 3, 0x8B, 0x4B, reg1);        // mov ecx, [rbx+reg1]
+    emit(jit, 4, 0x41, 0x89, 0x0C, 0x04);  // mov [r12+rax], ecx
+    break;
+
+  case movl_imm_reg:
+    emit(jit, 3, 0xC7, 0x43, reg1);  // mov dword [rbx+reg1], imm32
+    emit32(jit, instr.immediate);
+    break;
+
+  case cmpl:
+    emit(jit, 3, 0x8B, 0x43, reg2);                  // mov eax, [rbx+reg2]
+    emit(jit, 3, 0x89, 0x43, REG(CMP_LEFT));         // mov [rbx+left], eax
+    emit(jit, 3, 0x8B, 0x43, reg1);                  // mov eax, [rbx+reg1]
+    emit(jit, 3, 0x89, 0x43, REG(CMP_RIGHT));        // mov [rbx+right], eax
+    emit(jit, 3, 0xC7, 0x43, REG(FLAGS_PENDING));    // mov dword [rbx+pending], 1
+    emit32(jit, 1);
+    *flags = FLAGS_LAZY;
+    break;
+
+  case je:
+  case jl:
+  case jle:
+  case jge:
+  case jbe:{
+    unsigned int taken_jumps[2];
+    int num_taken_jumps = 0;
+    unsigned int eflags_jump = 0;
+
+    if (*flags == FLAGS_UNKNOWN){
+      emit(jit, 4, 0x83, 0x7B, REG(FLAGS_PENDING), 0);  // cmp dword [rbx+pending], 0
+      emit(jit, 2, 0x0F, 0x84);                         // je eflags test
+      eflags_jump = jit->used;
+      emit32(jit, 0);
+    }
+    if (*flags != FLAGS_CURRENT)
+      taken_jumps[num_taken_jumps++] = emit_lazy_test(jit, instr.opcode);
+    if (*flags == FLAGS_UNKNOWN){
+      emit(jit, 1, 0xE9);                               // jmp not taken
+      unsigned int not_taken_jump = jit->used;
+      emit32(jit, 0);
+      patch_rel32(jit, eflags_jump, jit->used);
+      taken_jumps[num_taken_jumps++] = emit_eflags_test(jit, instr.opcode);
+      patch_rel32(jit, not_taken_jump, jit->used);
+    }
+    else if (*flags == FLAGS_CURRENT)
+      taken_jumps[num_taken_jumps++] = emit_eflags_test(jit, instr.opcode);
+
+    emit_exit(jit, program_counter + 4);
+    for (int i = 0; i < num_taken_jumps; i++)
+      patch_rel32(jit, taken_jumps[i], jit->used);
+    emit_exit(jit, target);
+    break;
+  }
+
+  case jmp:
+    emit_exit(jit, target);
+    break;
+
+  case call:
+    emit(jit, 4, 0x83, 0x6B, REG(ESP_REG), 4);     // sub dword [rbx+esp], 4
+    emit(jit, 3, 0x8B, 0x43, REG(ESP_REG));        // mov eax, [rbx+esp]
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 4, 0x41, 0xC7, 0x04, 0x04);          // mov dword [r12+rax], return address
+    emit32(jit, program_counter + 4);
+    emit_exit(jit, target);
+    break;
+
+  case ret:{
+    emit(jit, 3, 0x8B, 0x43, REG(ESP_REG));  // mov eax, [rbx+esp]
+    emit(jit, 1, 0x3D);                      // cmp eax, memory_size
+    emit32(jit, memory_size);
+    emit(jit, 2, 0x75, 10);                  // jne over the halt
+    emit(jit, 1, 0xB8);                      // mov eax, HALT_PC
+    emit32(jit, HALT_PC);
+    emit(jit, 1, 0xE9);                      // jmp exit_stub
+    emit_rel32(jit, jit->exit_stub);
+
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 4, 0x41, 0x8B, 0x04, 0x04);          // mov eax, [r12+rax]
+    emit(jit, 4, 0x83, 0x43, REG(ESP_REG), 4);     // add dword [rbx+esp], 4
+
+    // Jump straight to the return address if it is compiled, otherwise exit with it
+    emit(jit, 2, 0x89, 0xC1);              // mov ecx, eax
+    emit(jit, 3, 0xF6, 0xC1, 3);           // test cl, 3
+    emit(jit, 2, 0x0F, 0x85);              // jnz exit_stub
+    emit_rel32(jit, jit->exit_stub);
+    emit(jit, 3, 0xC1, 0xE9, 2);           // shr ecx, 2
+    emit(jit, 2, 0x81, 0xF9);              // cmp ecx, num_instructions
+    emit32(jit, jit->num_instructions);
+    emit(jit, 2, 0x0F, 0x83);              // jae exit_stub
+    emit_rel32(jit, jit->exit_stub);
+    emit(jit, 4, 0x49, 0x8B, 0x14, 0xCE);  // mov rdx, [r14+rcx*8]
+    emit(jit, 3, 0x48, 0x85, 0xD2);        // test rdx, rdx
+    emit(jit, 2, 0x0F, 0x84);              // jz exit_stub
+    emit_rel32(jit, jit->exit_stub);
+    emit(jit, 2, 0xFF, 0xE2);              // jmp rdx
+    break;
+  }
+
+  case pushl:
+    emit(jit, 4, 0x83, 0x6B, REG(ESP_REG), 4);     // sub dword [rbx+esp], 4
+    emit(jit, 3, 0x8B, 0x43, REG(ESP_REG));        // mov eax, [rbx+esp]
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 3, 0x8B, 0x4B, reg1);                // mov ecx, [rbx+reg1]
+    emit(jit, 4, 0x41, 0x89, 0x0C, 0x04);          // mov [r12+rax], ecx
+    break;
+
+  case popl:
+    emit(jit, 3, 0x8B, 0x43, REG(ESP_REG));        // mov eax, [rbx+esp]
+    if (!covered)
+      emit_bounds_check(jit, end - index);
+    emit(jit, 4, 0x41, 0x8B, 0x0C, 0x04);          // mov ecx, [r12+rax]
+    emit(jit, 3, 0x89, 0x4B, reg1);                // mov [rbx+reg1], ecx
+    emit(jit, 4, 0x83, 0x43, REG(ESP_REG), 4);     // add dword [rbx+esp], 4
+    break;
+
+  case printr:
+    emit(jit, 3, 0x4C, 0x89, 0xFF);  // mov rdi, r15
+    emit(jit, 3, 0x8B, 0x73, reg1);  // mov esi, [rbx+reg1]
+    emit_call(jit, (void*)jit_printr);
+    break;
+
+  case readr:
+    emit(jit, 3, 0x4C, 0x89, 0xFF);        // mov rdi, r15
+    emit(jit, 4, 0x48, 0x8D, 0x73, reg1);  // lea rsi, [rbx+reg1]
+    emit_call(jit, (void*)jit_readr);
+    break;
+  }
+}
+
+/*
+ * Compiles the block starting at index. Returns 0 if it cannot be compiled.
+*/
+static int compile_block(jit_t* jit, unsigned int index)
+{
+  // Find the end of the block, giving up before emitting anything
+  unsigned int end = index;
+  do {
+    if (!can_translate(jit->instructions[end]))
+      return 0;
+  } while (!ends_block(jit->instructions[end++].opcode) && end < jit->num_instructions &&
+	   end - index < JIT_MAX_BLOCK);
+
+  if (jit->used + (end - index + 1) * JIT_MAX_INSTR_BYTES > JIT_BUFFER_SIZE){
+    jit->full = 1;
+    return 0;
+  }
+
+  // Registered before emitting so a block that loops to itself chains directly
+  unsigned int start = jit->used;
+  jit->blocks[index] = jit->buffer + start;
+
+  // Range checks first, so a block that fails one has not run any of its instructions
+  range_check_t checks[MAX_RANGE_CHECKS];
+  unsigned char covered[JIT_MAX_BLOCK];
+  unsigned int check_jumps[MAX_RANGE_CHECKS];
+  int num_checks = hoist_range_checks(jit->instructions, index, end, checks, covered);
+  for (int c = 0; c < num_checks; c++){
+    emit(jit, 3, 0x8B, 0x43, REG(checks[c].reg));  // mov eax, [rbx+reg]
+    emit(jit, 1, 0x05);                            // add eax, low
+    emit32(jit, checks[c].low);
+    emit(jit, 1, 0x3D);                            // cmp eax, memory_size - 4 - (high - low)
+    emit32(jit, memory_size - 4 - (checks[c].high - checks[c].low));
+    emit(jit, 2, 0x0F, 0x87);                      // ja recheck
+    check_jumps[c] = jit->used;
+    emit32(jit, 0);
+  }
+
+  emit(jit, 5, 0x49, 0x83, 0x45, 0x00, end - index);  // add qword [r13], block length
+  int flags = FLAGS_UNKNOWN;
+  for (unsigned int i = index; i < end; i++)
+    emit_instruction(jit, i, end, &flags, covered[i - index]);
+  if (!ends_block(jit->instructions[end - 1].opcode))
+    emit_exit(jit, end * 4);
+
+  // Every path through the block ends in a jump, the recheck exit goes after it
+  if (num_checks > 0){
+    for (int c = 0; c < num_checks; c++)
+      patch_rel32(jit, check_jumps[c], jit->used);
+    emit(jit, 1, 0xB8);  // mov eax, block PC + RECHECK
+    emit32(jit, index * 4 + RECHECK);
+    emit(jit, 1, 0xE9);  // jmp exit_stub
+    emit_rel32(jit, jit->exit_stub);
+  }
+
+  // Exits that were waiting for this block now jump to it directly
+  for (int e = jit->first_exit[index]; e != -1; e = jit->exits[e].next){
+    jit->buffer[jit->exits[e].offset] = 0xE9;
+    patch_rel32(jit, jit->exits[e].offset + 1, start);
+  }
+  jit->first_exit[index] = -1;
+
+  return 1;
+}
+
+/*
+ * Frees the code buffer and tables of a jit_t
+*/
+static void jit_free(void* data)
+{
+  jit_t* jit = data;
+  if (jit->buffer != NULL)
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+  free(jit->blocks);
+  free(jit->entry_counts);
+  free(jit->not_compilable);
+  free(jit->first_exit);
+  free(jit->exits);
+}
+
+/*
+ * Runs the program from program_counter, interpreting cold blocks and running hot ones as
+ * native code. Returns the number of instructions executed.
+*/
+unsigned long long run_jit(instruction_t* instructions, unsigned int num_instructions,
+			   int* registers, unsigned char* memory, io_t* io,
+			   unsigned int program_counter)
+{
+  jit_t jit;
+  memset(&jit, 0, sizeof(jit));
+  jit.instructions = instructions;
+  jit.num_instructions = num_instructions;
+  jit.blocks = calloc(num_instructions + 1, sizeof(void*));
+  jit.entry_counts = calloc(num_instructions + 1, sizeof(unsigned int));
+  jit.not_compilable = calloc(num_instructions + 1, 1);
+  jit.first_exit = malloc(sizeof(int) * (num_instructions + 1));
+  if (jit.blocks == NULL || jit.entry_counts == NULL || jit.not_compilable == NULL ||
+      jit.first_exit == NULL)
+    error_exit("unable to allocate memory for the JIT");
+  release_on_error(jit_free, &jit);
+  for (unsigned int i = 0; i <= num_instructions; i++)
+    jit.first_exit[i] = -1;
+
+  // Without an executable buffer everything is interpreted
+  jit.buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit.buffer == MAP_FAILED){
+    jit.buffer = NULL;
+    jit.full = 1;
+  }
+  else
+    emit_trampoline(&jit);
+  jit_entry_t enter = (jit_entry_t)(void*)jit.buffer;
+
+  unsigned int end_pc = num_instructions * 4;
+
+  while (program_counter != end_pc && program_counter != HALT_PC)
+  {
+    if (program_counter % 4 != 0 || program_counter > end_pc)
+      error_exit("program counter out of range");
+    unsigned int index = program_counter / 4;
+
+    if (jit.blocks[index] == NULL && !jit.not_compilable[index] && !jit.full &&
+	++jit.entry_counts[index] >= JIT_HOT_THRESHOLD){
+      if (!compile_block(&jit, index))
+	jit.not_compilable[index] = 1;
+    }
+
+    if (jit.blocks[index] != NULL){
+      program_counter = enter(jit.blocks[index], registers, memory, &jit.executed, jit.blocks,
+				      io);
+      if (program_counter == FAULT_PC)
+	break;
+      if (program_counter % 4 != RECHECK)
+	continue;
+
+      // An access in the block would fault, or its ret returns from main: interpret it
+      program_counter -= RECHECK;
+    }
+
+    // Cold path: interpret to the end of the block
+    unsigned char opcode;
+    do {
+      opcode = instructions[program_counter / 4].opcode;
+      program_counter = execute_instruction(program_counter, instructions, registers, memory, io);
+      jit.executed++;
+    } while (!ends_block(opcode) && program_counter != end_pc);
+  }
+
+  release_on_error(NULL, NULL);
+  jit_free(&jit);
+
+  // Native code stopped at an access outside guest memory
+  if (program_counter == FAULT_PC)
+    memory_fault();
+  return jit.executed;
+}
@@ -0,0 +1,13 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Basic-block JIT compiler from decoded instructions to native x86-64.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_jit(instruction_t* instructions, unsigned int num_instructions,
+			   int* registers, unsigned char* memory, io_t* io,
+			   unsigned int program_counter);
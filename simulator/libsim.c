@@ -0,0 +1,564 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * libsim, the simulator as a library.
+ *
+ * A sim_program_t is a decoded program, shared read-only by every context that runs it. A
+ * sim_ctx_t is one machine: registers, guest memory, the program counter, and an
+ * io_t that printr and readr go through. sim_run runs up to a budget of instructions and
+ * can be called again to go on. Budgeted runs and sim_step go through execute_instruction
+ * one instruction at a time; a run without a budget is handed to the context's engine
+ * from wherever the context is. A context can be saved to a checkpoint file and restored
+ * from one, see checkpoint.c.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "simulator.h"
+#include "batch.h"
+#include "loader.h"
+#include "profile.h"
+#include "pipeline.h"
+#include "predictor.h"
+#include "dcache.h"
+#include "callgraph.h"
+#include "memoize.h"
+#include "translate.h"
+#include "checkpoint.h"
+#include "memory.h"
+#include "program_cache.h"
+#include "decode.h"
+#include "compact.h"
+
+struct sim_program
+{
+  instruction_t* instructions;
+  unsigned int num_instructions;
+  int lazy;   // decoded page by page from a mapped file
+  int fused;  // rewritten by sim_fuse, only the threaded engine can run it
+  size_t cache_mapping;  // size of the cache file mapping holding the instructions, or 0
+  compact_program_t compact;  // for the compact engine, operands is NULL until it is built
+};
+
+// Taken to build the compact form of a program that was not loaded with one
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct sim_ctx
+{
+  sim_program_t* program;
+  int engine;
+  int registers[REGISTER_FILE_SIZE];
+  unsigned char* memory;
+  unsigned int program_counter;
+  unsigned long long executed;
+  io_t io;
+};
+
+/*
+ * Decodes a program from its raw bytes, which the caller keeps. Returns NULL if the
+ * length is not a whole number of 4-byte instructions, or one of them has an unknown
+ * opcode or register.
+*/
+sim_program_t* sim_load(const void* bytes, size_t length)
+{
+  program_fields_t fields;
+  if (length % 4 != 0 || !decode_fields(bytes, length / 4, COMPACT_EXTRA_SLOTS, &fields))
+    return NULL;
+
+  sim_program_t* program = malloc(sizeof(sim_program_t));
+  if (program == NULL)
+    error_exit("unable to allocate memory for the program");
+  program->num_instructions = length / 4;
+  program->instructions = fields_instructions(&fields, program->num_instructions);
+  compact_build(&program->compact, &fields, program->num_instructions);
+  program->lazy = 0;
+  program->fused = 0;
+  program->cache_mapping = 0;
+  return program;
+}
+
+/*
+ * Opens a binary and stores its size, which must be a whole number of instructions
+*/
+static int open_binary(const char* file_name, unsigned int* file_size)
+{
+  int file_descriptor = open(file_name, O_RDONLY);
+  if (file_descriptor == -1)
+    error_exit("unable to open input file");
+
+  // Make sure the file size is a multiple of 4 bytes
+  // since machine code instructions are 4 bytes each
+  *file_size = get_file_size(file_descriptor);
+  if (*file_size % 4 != 0)
+    error_exit("invalid input file");
+  return file_descriptor;
+}
+
+/*
+ * Loads and decodes a program from a file. By default the file is mapped and decoded page
+ * by page on first use, see loader.c; eager reads and decodes it all up front.
+*/
+sim_program_t* sim_load_file(const char* file_name, int eager)
+{
+  unsigned int file_size;
+  int file_descriptor = open_binary(file_name, &file_size);
+
+  sim_program_t* program;
+  if (eager){
+    unsigned int* bytes = load_file(file_descriptor, file_size);
+    program = sim_load(bytes, file_size);
+    free(bytes);
+    if (program == NULL)
+      error_exit("invalid instruction in input file");
+  }
+  else {
+    // Each page of instructions is checked when it is first decoded
+    unsigned int* bytes = map_file(file_descriptor, file_size);
+    program = malloc(sizeof(sim_program_t));
+    if (program == NULL)
+      error_exit("unable to allocate memory for the program");
+    program->num_instructions = file_size / 4;
+    program->instructions = decode_lazily(bytes, program->num_instructions);
+    program->lazy = 1;
+    program->fused = 0;
+    program->cache_mapping = 0;
+    program->compact.operands = NULL;
+  }
+  close(file_descriptor);
+  return program;
+}
+
+/*
+ * Loads a program from a file through the decoded-program cache in cache_dir, see
+ * program_cache.c: the decoded, and with fuse fused, instructions are mapped from the
+ * cache if an earlier run stored them, and stored for later runs otherwise.
+*/
+sim_program_t* sim_load_cached(const char* file_name, const char* cache_dir, int fuse)
+{
+  unsigned int file_size;
+  int file_descriptor = open_binary(file_name, &file_size);
+  unsigned int* bytes = map_file(file_descriptor, file_size);
+  close(file_descriptor);
+
+  sim_program_t* program = malloc(sizeof(sim_program_t));
+  if (program == NULL)
+    error_exit("unable to allocate memory for the program");
+  program->num_instructions = file_size / 4;
+  program->lazy = 0;
+  program->fused = fuse;
+  program->cache_mapping = 0;
+  program->compact.operands = NULL;
+  program->instructions = NULL;
+  if (program->num_instructions > 0)
+    program->instructions = load_cached_program(cache_dir, bytes, program->num_instructions,
+						fuse, &program->cache_mapping);
+
+  // Only what passed decode_fields is ever stored, so a hit needs no checking
+  if (program->instructions == NULL){
+    program_fields_t fields;
+    if (!decode_fields(bytes, program->num_instructions, COMPACT_EXTRA_SLOTS, &fields))
+      error_exit("invalid instruction in input file");
+    program->instructions = fields_instructions(&fields, program->num_instructions);
+    compact_build(&program->compact, &fields, program->num_instructions);
+    unsigned int sites[NUM_FUSIONS];
+    memcpy(sites, fusion_sites, sizeof(sites));
+    if (fuse)
+      fuse_instructions(program->instructions, program->num_instructions);
+    for (int i = 0; i < NUM_FUSIONS; i++)
+      sites[i] = fusion_sites[i] - sites[i];
+    if (program->num_instructions > 0)
+      store_cached_program(cache_dir, bytes, program->num_instructions, fuse,
+			   program->instructions, sites);
+  }
+  if (bytes != NULL)
+    munmap(bytes, file_size);
+  return program;
+}
+
+/*
+ * Returns whether sim_load_cached found the program in the cache
+*/
+int sim_program_cached(sim_program_t* program)
+{
+  return program->cache_mapping != 0;
+}
+
+/*
+ * Frees a program from any of the loaders, with its mappings
+*/
+void sim_program_free(sim_program_t* program)
+{
+  if (program->cache_mapping != 0)
+    free_cached_program(program->instructions, program->cache_mapping);
+  else if (program->lazy)
+    release_lazily(program->instructions);
+  else
+    free(program->instructions);
+  free(program->compact.operands);
+  free(program);
+}
+
+/*
+ * Returns the program's compact form, building it on first use for a program that was
+ * decoded lazily or mapped from the cache
+*/
+static const compact_program_t* compact_form(sim_program_t* program)
+{
+  pthread_mutex_lock(&compact_lock);
+  if (program->compact.operands == NULL)
+    compact_from_instructions(&program->compact, program->instructions,
+			      program->num_instructions);
+  pthread_mutex_unlock(&compact_lock);
+  return &program->compact;
+}
+
+/*
+ * Rewrites common instruction sequences into superinstructions for the threaded engine
+*/
+void sim_fuse(sim_program_t* program)
+{
+  fuse_instructions(program->instructions, program->num_instructions);
+  program->fused = 1;
+}
+
+/*
+ * Prints to stderr how often each superinstruction ran, over every context so far
+*/
+void sim_fusion_report()
+{
+  print_fusion_report();
+}
+
+/*
+ * Writes the program as a standalone C program, see translate.c
+*/
+void sim_translate(sim_program_t* program, const char* binary_name, FILE* out)
+{
+  translate_program(program->instructions, program->num_instructions, binary_name, out);
+}
+
+/*
+ * Copies the context's machine state into a checkpoint, which shares the context's memory
+ * rather than copying it
+*/
+static void save_state(sim_ctx_t* ctx, checkpoint_t* checkpoint)
+{
+  memcpy(checkpoint->registers, ctx->registers, sizeof(ctx->registers));
+  checkpoint->memory = ctx->memory;
+  checkpoint->program_counter = ctx->program_counter;
+  checkpoint->executed = ctx->executed;
+  checkpoint->input_offset = ctx->io.in_offset + ctx->io.in_position;
+}
+
+/*
+ * Runs the program once per input file on a pool of threads, writing the outputs to stdout
+ * in input order, see batch.c. Every run starts from a copy of the from context, which
+ * has typically been restored from a checkpoint, or from a fresh machine if it is NULL.
+ * An input whose run fails ends its output with the error, and the others go on; the
+ * number of them is stored in failed. Returns the total number of instructions executed.
+*/
+unsigned long long sim_run_batch(sim_program_t* program, int engine, sim_ctx_t* from,
+				 char** input_files, int num_inputs, int num_threads, int* failed)
+{
+  checkpoint_t start;
+  if (from != NULL)
+    save_state(from, &start);
+  const compact_program_t* compact = engine == ENGINE_COMPACT ? compact_form(program) : NULL;
+  return run_batch(engine, program->instructions, compact, program->num_instructions,
+		   from != NULL ? &start : NULL, input_files, num_inputs, num_threads, failed);
+}
+
+/*
+ * Sets the size in bytes of guest memory, STACK_SIZE by default. %esp starts at the top of
+ * it. Pages are only allocated when the program touches them, so a large memory costs what
+ * the program uses. Every context shares the size, so it can only be set while none exists.
+*/
+void sim_set_memory_size(unsigned int bytes)
+{
+  if (bytes < 4 || bytes > MAX_MEMORY_SIZE || bytes % 4 != 0)
+    error_exit("memory size must be a multiple of 4 up to 1G");
+  if (memory_in_use())
+    error_exit("memory size cannot change while a context exists");
+  memory_size = bytes;
+}
+
+/*
+ * Returns a new context for the program, reading stdin and writing stdout
+*/
+sim_ctx_t* sim_ctx_new(sim_program_t* program, int engine)
+{
+  if (program->fused && engine != ENGINE_THREADED)
+    error_exit("a fused program needs the threaded engine");
+
+  sim_ctx_t* ctx = malloc(sizeof(sim_ctx_t));
+  if (ctx == NULL)
+    error_exit("unable to allocate memory for a context");
+  ctx->program = program;
+  ctx->engine = engine;
+  ctx->memory = memory_new();
+  io_open(&ctx->io, stdin, stdout);
+  sim_reset(ctx);
+  return ctx;
+}
+
+/*
+ * Flushes the context's output and frees it. Files passed to sim_set_files stay open.
+*/
+void sim_ctx_free(sim_ctx_t* ctx)
+{
+  io_close(&ctx->io);
+  memory_free(ctx->memory);
+  free(ctx);
+}
+
+/*
+ * Makes readr read from in and printr write to out
+*/
+void sim_set_files(sim_ctx_t* ctx, FILE* in, FILE* out)
+{
+  io_close(&ctx->io);
+  io_open(&ctx->io, in, out);
+}
+
+/*
+ * Makes printr and readr call back into the embedding program instead of using files
+*/
+void sim_set_io(sim_ctx_t* ctx, sim_print_t print, sim_read_t read, void* user)
+{
+  io_flush(&ctx->io);
+  ctx->io.print = print;
+  ctx->io.read = read;
+  ctx->io.user = user;
+}
+
+/*
+ * Returns whether the context has nothing left to run
+*/
+static int halted(sim_ctx_t* ctx)
+{
+  return ctx->program_counter == ctx->program->num_instructions * 4 ||
+    ctx->program_counter == HALT_PC;
+}
+
+/*
+ * Runs the instruction at the context's program counter, which a jump or ret may have
+ * sent outside the program
+*/
+static void execute_next(sim_ctx_t* ctx)
+{
+  unsigned int program_counter = ctx->program_counter;
+  if (program_counter % 4 != 0 || program_counter > ctx->program->num_instructions * 4)
+    error_exit("program counter out of range");
+  ctx->program_counter = execute_instruction(program_counter, ctx->program->instructions,
+					     ctx->registers, ctx->memory, &ctx->io);
+  ctx->executed++;
+}
+
+/*
+ * Runs at most budget instructions, or to the end with SIM_NO_BUDGET, and flushes the
+ * output. Returns SIM_HALTED once the program has finished, SIM_RUNNING otherwise.
+*/
+int sim_run(sim_ctx_t* ctx, unsigned long long budget)
+{
+  sim_program_t* program = ctx->program;
+
+  if (budget == SIM_NO_BUDGET && !halted(ctx)){
+    // The lane engine cannot take over a machine that has already run
+    int engine = ctx->engine == ENGINE_SIMD && ctx->executed != 0 ? ENGINE_SWITCH : ctx->engine;
+    const compact_program_t* compact = engine == ENGINE_COMPACT ? compact_form(program) : NULL;
+    ctx->executed += run_program(engine, program->instructions, compact,
+				 program->num_instructions, ctx->registers, ctx->memory, &ctx->io,
+				 ctx->program_counter);
+    ctx->program_counter = HALT_PC;
+    collect_fusion_hits();
+  }
+  else {
+    if (program->fused)
+      error_exit("a fused program can only run to the end");
+    unsigned long long limit = budget == SIM_NO_BUDGET ? ~0ULL : budget;
+    for (unsigned long long i = 0; i < limit && !halted(ctx); i++)
+      execute_next(ctx);
+  }
+
+  io_flush(&ctx->io);
+  return halted(ctx) ? SIM_HALTED : SIM_RUNNING;
+}
+
+/*
+ * Runs one instruction. Returns SIM_HALTED once the program has finished.
+*/
+int sim_step(sim_ctx_t* ctx)
+{
+  if (ctx->program->fused)
+    error_exit("a fused program can only run to the end");
+  if (!halted(ctx))
+    execute_next(ctx);
+  return halted(ctx) ? SIM_HALTED : SIM_RUNNING;
+}
+
+/*
+ * Puts the context back at the start of the program with a fresh machine. Its I/O stays.
+*/
+void sim_reset(sim_ctx_t* ctx)
+{
+  reset_machine(ctx->registers, ctx->memory);
+  ctx->program_counter = 0;
+  ctx->executed = 0;
+}
+
+/*
+ * Runs the program to the end with the profiler and writes its report to stderr, see
+ * profile.c. Returns the number of instructions executed.
+*/
+unsigned long long sim_profile(sim_ctx_t* ctx, const char* source_name)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("the profiler runs an unfused program from the start");
+  ctx->executed = run_profiled(ctx->program->instructions, ctx->program->num_instructions,
+			       ctx->registers, ctx->memory, &ctx->io, source_name);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Runs the program to the end through the pipeline timing model, with the given branch
+ * predictor, and writes its cycle report to stderr, see pipeline.c. Returns the number of
+ * instructions executed.
+*/
+unsigned long long sim_pipeline(sim_ctx_t* ctx, int imull_latency, int mispredict_penalty,
+			       int predictor)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("the timing model runs an unfused program from the start");
+  if (imull_latency < 1 || mispredict_penalty < 0)
+    error_exit("invalid pipeline latency");
+  ctx->executed = run_pipeline(ctx->program->instructions, ctx->program->num_instructions,
+			       ctx->registers, ctx->memory, &ctx->io, imull_latency,
+			       mispredict_penalty, predictor);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Runs the program to the end feeding every conditional jump to the given branch
+ * predictor, and writes its misprediction report to stderr, see predictor.c. Returns the
+ * number of instructions executed.
+*/
+unsigned long long sim_predict(sim_ctx_t* ctx, int predictor)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("the branch predictor runs an unfused program from the start");
+  ctx->executed = run_predicted(ctx->program->instructions, ctx->program->num_instructions,
+				ctx->registers, ctx->memory, &ctx->io, predictor);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Runs the program to the end feeding its memory accesses to a data cache model of an L1
+ * and, unless l2 is NULL, an L2, and writes the hit and miss report to stderr, see
+ * dcache.c. Returns the number of instructions executed.
+*/
+unsigned long long sim_dcache(sim_ctx_t* ctx, const sim_cache_config_t* l1,
+			     const sim_cache_config_t* l2)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("the cache model runs an unfused program from the start");
+  ctx->executed = run_dcache(ctx->program->instructions, ctx->program->num_instructions,
+			     ctx->registers, ctx->memory, &ctx->io, l1, l2);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Runs the program to the end with the call-graph profiler and writes its per-function
+ * report to stderr, and the folded stacks to folded unless it is NULL, see callgraph.c.
+ * Returns the number of instructions executed.
+*/
+unsigned long long sim_callgraph(sim_ctx_t* ctx, const char* source_name, FILE* folded)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("the call-graph profiler runs an unfused program from the start");
+  ctx->executed = run_callgraph(ctx->program->instructions, ctx->program->num_instructions,
+				ctx->registers, ctx->memory, &ctx->io, source_name, folded);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Runs the program to the end, skipping calls to pure leaf functions whose result for the
+ * same arguments is already known, and writes the hit rates to stderr, see memoize.c.
+ * Returns the number of instructions executed, the skipped ones included.
+*/
+unsigned long long sim_memoize(sim_ctx_t* ctx)
+{
+  if (ctx->executed != 0 || ctx->program->fused)
+    error_exit("memoization runs an unfused program from the start");
+  ctx->executed = run_memoized(ctx->program->instructions, ctx->program->num_instructions,
+			       ctx->registers, ctx->memory, &ctx->io);
+  ctx->program_counter = HALT_PC;
+  io_flush(&ctx->io);
+  return ctx->executed;
+}
+
+/*
+ * Returns the number of instructions the context has executed since its last reset
+*/
+unsigned long long sim_executed(sim_ctx_t* ctx)
+{
+  return ctx->executed;
+}
+
+/*
+ * Returns the address of the next instruction, HALT_PC after returning from main
+*/
+unsigned int sim_pc(sim_ctx_t* ctx)
+{
+  return ctx->program_counter;
+}
+
+/*
+ * Returns a guest register; %eflags is brought up to date first
+*/
+int sim_register(sim_ctx_t* ctx, int reg)
+{
+  if (reg < 0 || reg >= NUM_REGS)
+    error_exit("invalid register");
+  if (reg == EFLAGS_REG)
+    materialize_flags(ctx->registers);
+  return ctx->registers[reg];
+}
+
+/*
+ * Writes the context's machine state, the position of its input included, to out
+*/
+void sim_checkpoint(sim_ctx_t* ctx, FILE* out)
+{
+  checkpoint_t checkpoint;
+  save_state(ctx, &checkpoint);
+  write_checkpoint(out, &checkpoint, ctx->program->instructions, ctx->program->num_instructions);
+}
+
+/*
+ * Puts the context in the state read from a checkpoint of the same program, and skips
+ * the input the checkpointed run had consumed
+*/
+void sim_restore(sim_ctx_t* ctx, FILE* in)
+{
+  checkpoint_t checkpoint;
+  checkpoint.memory = ctx->memory;
+  read_checkpoint(in, &checkpoint, ctx->program->instructions, ctx->program->num_instructions);
+  memcpy(ctx->registers, checkpoint.registers, sizeof(ctx->registers));
+  ctx->program_counter = checkpoint.program_counter;
+  ctx->executed = checkpoint.executed;
+  io_skip(&ctx->io, checkpoint.input_offset);
+}
@@ -0,0 +1,106 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * libsim: the simulator as a library.
+ *
+ * A program is loaded and decoded once with sim_load or sim_load_file, then any number of
+ * contexts, each a machine with its own registers, memory and I/O, run it in-process. The
+ * simulator executable is a thin wrapper around this interface, see main.c.
+ *
+ * Unrecoverable errors (a bad instruction, running out of memory) print "Error: ..." and
+ * exit with status 1, as the simulator always has.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Execution engines selectable with --engine=
+enum engines{
+  ENGINE_SWITCH,   // execute_instruction, one call and one switch per instruction
+  ENGINE_THREADED, // pre-decoded handler stream dispatched with computed goto
+  ENGINE_JIT,      // hot basic blocks compiled to x86-64, see jit.c
+  ENGINE_SIMD,     // several machines stepped together in vector lanes, see simd.c
+  ENGINE_COMPACT   // switch over parallel field arrays with resolved targets, see compact.c
+};
+
+// Branch predictors selectable with --predictor=, see predictor.c
+enum predictors{
+  PREDICTOR_STATIC,  // backward jumps taken, forward ones not
+  PREDICTOR_BIMODAL, // 2-bit counter per branch
+  PREDICTOR_GSHARE,  // 2-bit counters indexed by branch and global history
+  PREDICTOR_TAGE     // base counters and tables tagged with longer histories
+};
+
+// Replacement policies of the data cache model, see dcache.c
+enum replacement_policies{
+  REPLACE_LRU,
+  REPLACE_FIFO,
+  REPLACE_RANDOM
+};
+
+// Geometry of one level of the data cache model
+typedef struct
+{
+  unsigned int size;  // bytes, a power-of-two number of sets of ways lines
+  unsigned int ways;
+  unsigned int line;  // bytes, a power of two
+  int policy;
+} sim_cache_config_t;
+
+// What sim_run and sim_step stopped on
+enum sim_status{
+  SIM_HALTED,      // the program returned from main or ran off its end
+  SIM_RUNNING      // the instruction budget ran out first, the context can go on
+};
+
+// Budget for sim_run that runs the program to the end
+#define SIM_NO_BUDGET 0
+
+// Default latencies of the pipeline timing model, in cycles
+#define SIM_IMULL_LATENCY 3
+#define SIM_MISPREDICT_PENALTY 2
+
+typedef struct sim_program sim_program_t;
+typedef struct sim_ctx sim_ctx_t;
+
+// I/O callbacks replacing the context's files: print gets every printr value, read
+// returns 1 and sets *value for readr, or returns 0 at the end of the input
+typedef void (*sim_print_t)(void* user, int value);
+typedef int (*sim_read_t)(void* user, int* value);
+
+sim_program_t* sim_load(const void* bytes, size_t length);
+sim_program_t* sim_load_file(const char* file_name, int eager);
+sim_program_t* sim_load_cached(const char* file_name, const char* cache_dir, int fuse);
+int sim_program_cached(sim_program_t* program);
+void sim_program_free(sim_program_t* program);
+void sim_fuse(sim_program_t* program);
+void sim_fusion_report();
+void sim_translate(sim_program_t* program, const char* binary_name, FILE* out);
+unsigned long long sim_run_batch(sim_program_t* program, int engine, sim_ctx_t* from,
+				 char** input_files, int num_inputs, int num_threads, int* failed);
+
+void sim_set_memory_size(unsigned int bytes);
+sim_ctx_t* sim_ctx_new(sim_program_t* program, int engine);
+void sim_ctx_free(sim_ctx_t* ctx);
+void sim_set_files(sim_ctx_t* ctx, FILE* in, FILE* out);
+void sim_set_io(sim_ctx_t* ctx, sim_print_t print, sim_read_t read, void* user);
+int sim_run(sim_ctx_t* ctx, unsigned long long budget);
+int sim_step(sim_ctx_t* ctx);
+void sim_reset(sim_ctx_t* ctx);
+unsigned long long sim_profile(sim_ctx_t* ctx, const char* source_name);
+unsigned long long sim_pipeline(sim_ctx_t* ctx, int imull_latency, int mispredict_penalty,
+			       int predictor);
+unsigned long long sim_predict(sim_ctx_t* ctx, int predictor);
+unsigned long long sim_callgraph(sim_ctx_t* ctx, const char* source_name, FILE* folded);
+unsigned long long sim_memoize(sim_ctx_t* ctx);
+unsigned long long sim_dcache(sim_ctx_t* ctx, const sim_cache_config_t* l1,
+			     const sim_cache_config_t* l2);
+unsigned long long sim_executed(sim_ctx_t* ctx);
+unsigned int sim_pc(sim_ctx_t* ctx);
+int sim_register(sim_ctx_t* ctx, int reg);
+void sim_checkpoint(sim_ctx_t* ctx, FILE* out);
+void sim_restore(sim_ctx_t* ctx, FILE* in);
+
+void error_exit(const char* message);
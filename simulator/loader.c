@@ -0,0 +1,207 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Zero-copy program loading for the simulator.
+ *
+ * map_file maps the binary read-only, so the kernel only pages in the parts of it that get
+ * decoded. decode_lazily reserves address space for the decoded instruction array without
+ * any access rights. The first access to a page of it, from any engine or thread, faults
+ * into decode_fault, which decodes the instructions overlapping that page into a fresh page
+ * and moves it into place with mremap. The replacement is atomic, so another thread never
+ * sees a half-decoded page, and two threads faulting on the same page both install the same
+ * contents. Each page is checked for invalid instructions as it is decoded, so startup cost
+ * is proportional to the code that runs, not to the file size.
+ *
+ * Each lazily decoded program has a slot in a fixed table, which the handler searches for
+ * the faulting address. A fault outside every program goes to the handler that was
+ * installed before this one, so a host application embedding the simulator keeps its own.
+ * The handler only makes system calls: if a page cannot be decoded it writes the error
+ * with write and leaves with _exit.
+*/
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "loader.h"
+
+// Lazily decoded programs that can be loaded at the same time
+#define MAX_LAZY_PROGRAMS 64
+
+// A lazily decoded program, free while base is NULL
+typedef struct
+{
+  char* base;                  // the reserved decoded array, published last
+  size_t size;                 // of the reservation, whole pages
+  unsigned int* bytes;         // the mapped binary
+  unsigned int num_instructions;
+} lazy_program_t;
+
+static lazy_program_t lazy_programs[MAX_LAZY_PROGRAMS];
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;  // taken to add and remove
+static struct sigaction previous_action;  // what SIGSEGV did before decode_fault
+static int handler_installed;
+static size_t page_size;
+
+/*
+ * Maps a file of the given size read-only and returns its contents as 4-byte units
+*/
+unsigned int* map_file(int file_descriptor, unsigned int size)
+{
+  // mmap refuses empty mappings, and there is nothing to decode anyway
+  if (size == 0)
+    return NULL;
+
+  void* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+  if (bytes == MAP_FAILED)
+    error_exit("unable to map input file");
+  return bytes;
+}
+
+/*
+ * Writes "Error: message" and exits, with nothing but system calls so it can run in the
+ * signal handler
+*/
+static void fault_exit(const char* message)
+{
+  static const char prefix[] = "Error: ";
+  ssize_t ignored = write(STDOUT_FILENO, prefix, sizeof(prefix) - 1);
+  ignored = write(STDOUT_FILENO, message, strlen(message));
+  ignored = write(STDOUT_FILENO, "\n", 1);
+  (void)ignored;
+  _exit(1);
+}
+
+/*
+ * Fills page, which holds the decoded array of program from byte offset on, with the
+ * instructions that overlap it. An instruction_t can straddle two pages, each side gets
+ * its part. The instructions are checked here rather than when the file is mapped, so a
+ * page that is never used is never read; an invalid one ends the program.
+*/
+static void decode_page(lazy_program_t* program, char* page, size_t offset)
+{
+  size_t first = offset / sizeof(instruction_t);
+  size_t last = (offset + page_size + sizeof(instruction_t) - 1) / sizeof(instruction_t);
+  if (last > program->num_instructions)
+    last = program->num_instructions;
+
+  for (size_t i = first; i < last; i++){
+    instruction_t instr = decode_instruction(program->bytes[i]);
+    if (!valid_instruction(instr))
+      fault_exit("invalid instruction in input file");
+    long start = (long)(i * sizeof(instruction_t)) - (long)offset;
+    for (long b = 0; b < sizeof(instruction_t); b++){
+      if (start + b >= 0 && start + b < page_size)
+	page[start + b] = ((char*)&instr)[b];
+    }
+  }
+}
+
+/*
+ * SIGSEGV handler that decodes a page of a lazily decoded program on first access.
+ * Faults anywhere else go to the handler installed before it. If that was the default
+ * action, it is restored and returning re-runs the faulting access, so the process dies
+ * as it would have without this handler.
+*/
+static void decode_fault(int signal_number, siginfo_t* info, void* context)
+{
+  char* address = info->si_addr;
+  lazy_program_t* program = NULL;
+  for (int p = 0; p < MAX_LAZY_PROGRAMS && program == NULL; p++){
+    char* base = __atomic_load_n(&lazy_programs[p].base, __ATOMIC_ACQUIRE);
+    if (base != NULL && address >= base && address < base + lazy_programs[p].size)
+      program = &lazy_programs[p];
+  }
+
+  if (program == NULL){
+    if (previous_action.sa_flags & SA_SIGINFO)
+      previous_action.sa_sigaction(signal_number, info, context);
+    else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+      previous_action.sa_handler(signal_number);
+    else
+      sigaction(SIGSEGV, &previous_action, NULL);
+    return;
+  }
+
+  size_t offset = (address - program->base) / page_size * page_size;
+  char* page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED)
+    fault_exit("unable to allocate memory for decoded instructions");
+  decode_page(program, page, offset);
+  if (mremap(page, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+	     program->base + offset) == MAP_FAILED)
+    fault_exit("unable to install decoded instructions");
+}
+
+/*
+ * Returns an array of num_instructions instruction_t that decodes itself from bytes as it
+ * is accessed. The array stays writable, so passes such as fuse_instructions can rewrite it.
+ * release_lazily gives it and bytes back.
+*/
+instruction_t* decode_lazily(unsigned int* bytes, unsigned int num_instructions)
+{
+  if (num_instructions == 0)
+    return NULL;
+
+  pthread_mutex_lock(&lazy_lock);
+  if (!handler_installed){
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = decode_fault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) != 0){
+      pthread_mutex_unlock(&lazy_lock);
+      error_exit("unable to install the decode handler");
+    }
+    handler_installed = 1;
+  }
+
+  lazy_program_t* program = NULL;
+  for (int p = 0; p < MAX_LAZY_PROGRAMS && program == NULL; p++){
+    if (lazy_programs[p].base == NULL)
+      program = &lazy_programs[p];
+  }
+  if (program == NULL){
+    pthread_mutex_unlock(&lazy_lock);
+    error_exit("too many programs decoded lazily");
+  }
+
+  size_t size = ((size_t)num_instructions * sizeof(instruction_t) + page_size - 1) /
+    page_size * page_size;
+  char* base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED){
+    pthread_mutex_unlock(&lazy_lock);
+    error_exit("unable to reserve memory for decoded instructions");
+  }
+  program->size = size;
+  program->bytes = bytes;
+  program->num_instructions = num_instructions;
+  __atomic_store_n(&program->base, base, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lazy_lock);
+
+  return (instruction_t*)base;
+}
+
+/*
+ * Unmaps an array returned by decode_lazily and the binary it decoded from
+*/
+void release_lazily(instruction_t* instructions)
+{
+  if (instructions == NULL)
+    return;
+
+  pthread_mutex_lock(&lazy_lock);
+  for (int p = 0; p < MAX_LAZY_PROGRAMS; p++){
+    lazy_program_t* program = &lazy_programs[p];
+    if (program->base != (char*)instructions)
+      continue;
+    __atomic_store_n(&program->base, NULL, __ATOMIC_RELEASE);
+    munmap(instructions, program->size);
+    munmap(program->bytes, (size_t)program->num_instructions * 4);
+  }
+  pthread_mutex_unlock(&lazy_lock);
+}
@@ -0,0 +1,14 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Zero-copy program loading: the binary is mapped instead of read, and its decoded
+ * instructions are produced one page at a time on first use.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned int* map_file(int file_descriptor, unsigned int size);
+instruction_t* decode_lazily(unsigned int* bytes, unsigned int num_instructions);
+void release_lazily(instruction_t* instructions);
@@ -0,0 +1,412 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Command line front end for the simulator. Parses the options and drives the simulator
+ * through libsim.h, the same interface an embedding program uses, or runs the server and
+ * its client in server.c.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "libsim.h"
+#include "server.h"
+
+/*
+ * Returns a monotonic timestamp in seconds
+*/
+static double get_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the byte count in text, a number with an optional K, M or G suffix
+*/
+static unsigned long long parse_size(const char* text)
+{
+  char* suffix;
+  unsigned long long size = strtoull(text, &suffix, 10);
+  if (suffix == text)
+    error_exit("invalid size");
+  if (strcmp(suffix, "K") == 0)
+    size <<= 10;
+  else if (strcmp(suffix, "M") == 0)
+    size <<= 20;
+  else if (strcmp(suffix, "G") == 0)
+    size <<= 30;
+  else if (*suffix != '\0')
+    error_exit("invalid size");
+  return size;
+}
+
+/*
+ * Reads the geometry of a cache level from text, SIZE,WAYS,LINE with an optional
+ * ,lru / ,fifo / ,random policy, LRU by default. SIZE takes a K, M or G suffix.
+*/
+static void parse_cache(const char* text, sim_cache_config_t* config)
+{
+  char fields[4][32] = { "", "", "", "lru" };
+  int num_fields = 0;
+  for (const char* field = text; num_fields < 4; num_fields++){
+    size_t length = strcspn(field, ",");
+    if (length == 0 || length >= sizeof(fields[0]))
+      error_exit("invalid cache geometry");
+    memcpy(fields[num_fields], field, length);
+    fields[num_fields][length] = '\0';
+    field += length;
+    if (*field++ == '\0')
+      break;
+  }
+  if (num_fields < 2)
+    error_exit("invalid cache geometry");
+
+  // A size that does not fit or a count below 1 becomes 0, which sim_dcache rejects
+  unsigned long long size = parse_size(fields[0]);
+  int ways = atoi(fields[1]);
+  int line = atoi(fields[2]);
+  config->size = size > 0xFFFFFFFFull ? 0 : (unsigned int)size;
+  config->ways = ways < 1 ? 0 : ways;
+  config->line = line < 1 ? 0 : line;
+  if (strcmp(fields[3], "lru") == 0)
+    config->policy = REPLACE_LRU;
+  else if (strcmp(fields[3], "fifo") == 0)
+    config->policy = REPLACE_FIFO;
+  else if (strcmp(fields[3], "random") == 0)
+    config->policy = REPLACE_RANDOM;
+  else
+    error_exit("invalid cache geometry");
+}
+
+/*
+ * Prints the options to stdout
+*/
+static void print_usage()
+{
+  printf("usage: simulator [options] binary [input files with --batch]\n"
+	 "       simulator --serve=SOCKET [--threads=N] [--memory=SIZE]\n"
+	 "       simulator --connect=SOCKET binary | --connect=SOCKET --stats\n"
+	 "\n"
+	 "  --engine=E            switch (default), threaded, jit, simd or compact\n"
+	 "  --mips                report instructions per second on stderr\n"
+	 "  --fuse                fuse instruction sequences, threaded engine only\n"
+	 "  --eager-load          read and decode the whole binary before running\n"
+	 "  --cache=DIR           keep the decoded program in DIR for later runs\n"
+	 "  --stats               with --cache, report whether the program came from it\n"
+	 "  --memory=SIZE         guest memory size, with an optional K, M or G suffix\n"
+	 "  --batch               run the binary once per input file\n"
+	 "  --threads=N           threads for --batch and --serve\n"
+	 "  --checkpoint=FILE     with --checkpoint-after=N, stop after N instructions and\n"
+	 "                        save the machine to FILE\n"
+	 "  --restore=FILE        resume from a checkpoint\n"
+	 "  --fork-from=FILE      run every --batch input from a checkpoint\n"
+	 "  --translate=FILE      write the program out as C instead of running it\n"
+	 "\n"
+	 "Analysis modes, one per run, report on stderr:\n"
+	 "  --profile             per-opcode counts, hot blocks, branch and memory sites\n"
+	 "  --pipeline            cycles on a 5-stage pipeline, see --imull-latency=N,\n"
+	 "                        --mispredict-penalty=N and --predictor=\n"
+	 "  --predictor=P         mispredictions of static, bimodal, gshare or tage\n"
+	 "  --dcache              hits and misses of a data cache, see\n"
+	 "                        --l1=SIZE,WAYS,LINE[,lru|fifo|random] and --l2=...|none\n"
+	 "  --callgraph[=FILE]    per-function counts, folded stacks to FILE\n"
+	 "  --memoize             skip calls to pure leaf functions seen with the same\n"
+	 "                        inputs. A skipped call still leaves registers, flags,\n"
+	 "                        the return address and its frame below %%esp as running\n"
+	 "                        it would have, so the program cannot tell the difference.\n"
+	 "  --source=FILE         the assembly source, to name instructions in reports\n");
+}
+
+int main(int argc, char** argv)
+{
+  int engine = ENGINE_SWITCH;
+  int report_mips = 0;
+  int fuse = 0;
+  int batch = 0;
+  int eager_load = 0;
+  int profile = 0;
+  int pipeline = 0;
+  int pipeline_options = 0;
+  int imull_latency = SIM_IMULL_LATENCY;
+  int mispredict_penalty = SIM_MISPREDICT_PENALTY;
+  int predictor = -1;
+  int callgraph = 0;
+  const char* folded_name = NULL;
+  int memoize = 0;
+  int dcache = 0;
+  int dcache_options = 0;
+  sim_cache_config_t l1 = { 32 << 10, 8, 64, REPLACE_LRU };
+  sim_cache_config_t l2 = { 256 << 10, 8, 64, REPLACE_LRU };
+  int use_l2 = 1;
+  const char* source_name = NULL;
+  const char* translation_name = NULL;
+  const char* serve_name = NULL;
+  const char* connect_name = NULL;
+  int stats = 0;
+  const char* checkpoint_name = NULL;
+  unsigned long long checkpoint_after = 0;
+  const char* restore_name = NULL;
+  const char* cache_dir = NULL;
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* binary_name = NULL;
+  char** input_files = malloc(sizeof(char*) * argc);
+  int num_inputs = 0;
+
+  // Options start with "--", the first other argument is the binary.
+  // In batch mode the arguments after it are input files.
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--help") == 0){
+      print_usage();
+      return 0;
+    }
+    else if (strcmp(argv[i], "--engine=switch") == 0)
+      engine = ENGINE_SWITCH;
+    else if (strcmp(argv[i], "--engine=threaded") == 0)
+      engine = ENGINE_THREADED;
+    else if (strcmp(argv[i], "--engine=jit") == 0)
+      engine = ENGINE_JIT;
+    else if (strcmp(argv[i], "--engine=simd") == 0)
+      engine = ENGINE_SIMD;
+    else if (strcmp(argv[i], "--engine=compact") == 0)
+      engine = ENGINE_COMPACT;
+    else if (strcmp(argv[i], "--mips") == 0)
+      report_mips = 1;
+    else if (strcmp(argv[i], "--fuse") == 0)
+      fuse = 1;
+    else if (strcmp(argv[i], "--batch") == 0)
+      batch = 1;
+    else if (strcmp(argv[i], "--eager-load") == 0)
+      eager_load = 1;
+    else if (strcmp(argv[i], "--profile") == 0)
+      profile = 1;
+    else if (strcmp(argv[i], "--pipeline") == 0)
+      pipeline = 1;
+    else if (strncmp(argv[i], "--imull-latency=", 16) == 0){
+      imull_latency = atoi(argv[i] + 16);
+      pipeline_options = 1;
+    }
+    else if (strncmp(argv[i], "--mispredict-penalty=", 21) == 0){
+      mispredict_penalty = atoi(argv[i] + 21);
+      pipeline_options = 1;
+    }
+    else if (strcmp(argv[i], "--predictor=static") == 0)
+      predictor = PREDICTOR_STATIC;
+    else if (strcmp(argv[i], "--predictor=bimodal") == 0)
+      predictor = PREDICTOR_BIMODAL;
+    else if (strcmp(argv[i], "--predictor=gshare") == 0)
+      predictor = PREDICTOR_GSHARE;
+    else if (strcmp(argv[i], "--predictor=tage") == 0)
+      predictor = PREDICTOR_TAGE;
+    else if (strcmp(argv[i], "--callgraph") == 0)
+      callgraph = 1;
+    else if (strncmp(argv[i], "--callgraph=", 12) == 0){
+      callgraph = 1;
+      folded_name = argv[i] + 12;
+    }
+    else if (strcmp(argv[i], "--memoize") == 0)
+      memoize = 1;
+    else if (strcmp(argv[i], "--dcache") == 0)
+      dcache = 1;
+    else if (strncmp(argv[i], "--l1=", 5) == 0){
+      parse_cache(argv[i] + 5, &l1);
+      dcache_options = 1;
+    }
+    else if (strcmp(argv[i], "--l2=none") == 0){
+      use_l2 = 0;
+      dcache_options = 1;
+    }
+    else if (strncmp(argv[i], "--l2=", 5) == 0){
+      parse_cache(argv[i] + 5, &l2);
+      use_l2 = 1;
+      dcache_options = 1;
+    }
+    else if (strncmp(argv[i], "--source=", 9) == 0)
+      source_name = argv[i] + 9;
+    else if (strncmp(argv[i], "--translate=", 12) == 0)
+      translation_name = argv[i] + 12;
+    else if (strncmp(argv[i], "--serve=", 8) == 0)
+      serve_name = argv[i] + 8;
+    else if (strncmp(argv[i], "--connect=", 10) == 0)
+      connect_name = argv[i] + 10;
+    else if (strcmp(argv[i], "--stats") == 0)
+      stats = 1;
+    else if (strncmp(argv[i], "--checkpoint=", 13) == 0)
+      checkpoint_name = argv[i] + 13;
+    else if (strncmp(argv[i], "--checkpoint-after=", 19) == 0)
+      checkpoint_after = strtoull(argv[i] + 19, NULL, 10);
+    else if (strncmp(argv[i], "--restore=", 10) == 0)
+      restore_name = argv[i] + 10;
+    else if (strncmp(argv[i], "--fork-from=", 12) == 0){
+      restore_name = argv[i] + 12;
+      batch = 1;
+    }
+    else if (strncmp(argv[i], "--cache=", 8) == 0)
+      cache_dir = argv[i] + 8;
+    else if (strncmp(argv[i], "--threads=", 10) == 0)
+      num_threads = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--memory=", 9) == 0){
+      unsigned long long size = parse_size(argv[i] + 9);
+      sim_set_memory_size(size > 0xFFFFFFFFull ? 0 : (unsigned int)size);
+    }
+    else if (strncmp(argv[i], "--", 2) == 0)
+      error_exit("unknown option");
+    else if (binary_name == NULL)
+      binary_name = argv[i];
+    else
+      input_files[num_inputs++] = argv[i];
+  }
+
+  // The analysis modes run the program once through run_hooked, the switch loop with hooks
+  int analysis = profile || pipeline || predictor != -1 || dcache || callgraph || memoize;
+
+  // A server runs until it is killed, a client exits with the status of the remote run
+  if (serve_name != NULL){
+    if (binary_name != NULL || connect_name != NULL || fuse || batch || analysis ||
+	translation_name != NULL || engine != ENGINE_SWITCH)
+      error_exit("--serve takes no binary and only --threads and --memory");
+    run_server(serve_name, num_threads);
+  }
+  if (stats && connect_name == NULL && cache_dir == NULL)
+    error_exit("--stats requires --connect or --cache");
+  if (connect_name != NULL){
+    if ((binary_name == NULL) != stats || num_inputs > 0 || fuse || batch || analysis ||
+	translation_name != NULL)
+      error_exit("--connect takes a binary to run, or --stats");
+    return run_client(connect_name, binary_name);
+  }
+
+  // Make sure we have enough arguments
+  if(binary_name == NULL)
+    error_exit("must provide an argument specifying a binary file to execute");
+  if (fuse && engine != ENGINE_THREADED)
+    error_exit("--fuse requires --engine=threaded");
+  if (batch && num_inputs == 0)
+    error_exit("--batch requires at least one input file");
+  if (analysis && (batch || engine != ENGINE_SWITCH))
+    error_exit("--profile, --pipeline, --predictor, --dcache, --callgraph and --memoize run a "
+	       "single program on the switch engine");
+  // --predictor picks the predictor of --pipeline, otherwise the modes are exclusive
+  if (profile + pipeline + (predictor != -1 && !pipeline) + dcache + callgraph + memoize > 1)
+    error_exit("only one of --profile, --pipeline, --predictor, --dcache, --callgraph and "
+	       "--memoize");
+  if (source_name != NULL && !profile && !callgraph)
+    error_exit("--source requires --profile or --callgraph");
+  if (pipeline_options && !pipeline)
+    error_exit("--imull-latency and --mispredict-penalty require --pipeline");
+  if (dcache_options && !dcache)
+    error_exit("--l1 and --l2 require --dcache");
+  if (translation_name != NULL && (batch || analysis || fuse))
+    error_exit("--translate only writes the translated program");
+  if ((checkpoint_name != NULL) != (checkpoint_after != 0))
+    error_exit("--checkpoint and --checkpoint-after go together");
+  if ((checkpoint_name != NULL || restore_name != NULL) &&
+      (fuse || analysis || translation_name != NULL))
+    error_exit("checkpoints cannot be combined with --fuse, --translate or an analysis mode");
+  if (checkpoint_name != NULL && batch)
+    error_exit("--checkpoint runs a single program");
+
+  // By default the file is mapped rather than read, and each page of instructions is
+  // decoded on first use, so only the pages that run are touched. With --cache the
+  // decoded and fused program comes from the cache directory when an earlier run left it.
+  sim_program_t* program = cache_dir != NULL ? sim_load_cached(binary_name, cache_dir, fuse) :
+    sim_load_file(binary_name, eager_load);
+  if (stats)
+    fprintf(stderr, "program cache: %s\n", sim_program_cached(program) ? "hit" : "miss");
+
+  // Write the program out as C instead of running it
+  if (translation_name != NULL){
+    FILE* translation = fopen(translation_name, "w");
+    if (translation == NULL)
+      error_exit("unable to open translation output file");
+    sim_translate(program, binary_name, translation);
+    fclose(translation);
+    return 0;
+  }
+
+  // Fused opcodes are only understood by the threaded engine
+  if (fuse && cache_dir == NULL)
+    sim_fuse(program);
+
+  // Run the simulation
+  double start = get_seconds();
+  unsigned long long executed;
+  int failed = 0;
+  if (batch){
+    // With --fork-from every input runs from a copy of the checkpoint
+    sim_ctx_t* from = NULL;
+    if (restore_name != NULL){
+      FILE* checkpoint = fopen(restore_name, "rb");
+      FILE* no_input = fopen("/dev/null", "r");
+      if (checkpoint == NULL || no_input == NULL)
+	error_exit("unable to open checkpoint file");
+      from = sim_ctx_new(program, engine);
+      sim_set_files(from, no_input, stdout);
+      sim_restore(from, checkpoint);
+      fclose(checkpoint);
+    }
+    executed = sim_run_batch(program, engine, from, input_files, num_inputs, num_threads,
+			     &failed);
+  }
+  else {
+    sim_ctx_t* ctx = sim_ctx_new(program, engine);
+    if (restore_name != NULL){
+      FILE* checkpoint = fopen(restore_name, "rb");
+      if (checkpoint == NULL)
+	error_exit("unable to open checkpoint file");
+      sim_restore(ctx, checkpoint);
+      fclose(checkpoint);
+    }
+    unsigned long long resumed = sim_executed(ctx);
+
+    if (profile)
+      sim_profile(ctx, source_name);
+    else if (pipeline)
+      sim_pipeline(ctx, imull_latency, mispredict_penalty,
+		   predictor != -1 ? predictor : PREDICTOR_STATIC);
+    else if (predictor != -1)
+      sim_predict(ctx, predictor);
+    else if (dcache)
+      sim_dcache(ctx, &l1, use_l2 ? &l2 : NULL);
+    else if (callgraph){
+      FILE* folded = NULL;
+      if (folded_name != NULL && (folded = fopen(folded_name, "w")) == NULL)
+	error_exit("unable to open folded stack output file");
+      sim_callgraph(ctx, source_name, folded);
+      if (folded != NULL)
+	fclose(folded);
+    }
+    else if (memoize)
+      sim_memoize(ctx);
+    else if (checkpoint_name != NULL){
+      // Run up to the checkpoint and stop there
+      sim_run(ctx, checkpoint_after);
+      FILE* checkpoint = fopen(checkpoint_name, "wb");
+      if (checkpoint == NULL)
+	error_exit("unable to open checkpoint file");
+      sim_checkpoint(ctx, checkpoint);
+      fclose(checkpoint);
+    }
+    else
+      sim_run(ctx, SIM_NO_BUDGET);
+    executed = sim_executed(ctx) - resumed;
+    sim_ctx_free(ctx);
+  }
+  double elapsed = get_seconds() - start;
+
+  // Reported on stderr so the program output stays comparable with the .expected files
+  if (report_mips){
+    const char* engine_names[] = { "switch", "threaded", "jit", "simd", "compact" };
+    fprintf(stderr, "%s engine: %llu instructions in %.6f s (%.2f MIPS)\n",
+	    engine_names[engine], executed, elapsed,
+	    elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+    if (fuse)
+      sim_fusion_report();
+  }
+
+  // A batch exits with status 1 if any of its inputs failed, as a single run would
+  return failed > 0;
+}
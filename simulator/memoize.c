@@ -0,0 +1,623 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Memoization of pure leaf functions.
+ *
+ * run_memoized sees every call before it runs. The first time a call target comes up, the
+ * code reachable from it is checked for a function whose result can only depend on its
+ * register arguments:
+ *  - it is a leaf: no call, and nothing but ret leaves it.
+ *  - it does no I/O, readr or printr.
+ *  - it only reaches memory through %esp, with movl, pushl and popl, and only moves %esp
+ *    itself with subl and addl.
+ *  - it never names %eflags, and no conditional jump can see the flags of its caller.
+ * A liveness pass over its instructions then gives its inputs, the registers it may read
+ * before writing them.
+ *
+ * Which frame addresses are touched is only known while it runs, so the first call with
+ * each set of inputs runs normally under a runtime check: every access must stay below
+ * the return address, within STACK_SIZE bytes of it, every byte read must have been
+ * written earlier in the same call, and ret must find %esp back where the call left it.
+ * A call that passes leaves an entry behind in a bounded hash table: the inputs, the
+ * registers and cmpl operands it wrote, and the number of instructions from the call to
+ * the ret. A call that fails marks the function impure and is not memoized again.
+ *
+ * A later call with the same inputs is not run at all: the registers are set to what the
+ * call would have left, and the instructions it would have run are counted, so the count
+ * matches every other engine. The entry also keeps the frame bytes the recorded call
+ * wrote, which only depend on its inputs, and a hit writes them and the return address
+ * below %esp, so memory is left exactly as the call would have left it. When the program
+ * finishes, the hit rates and the instructions saved go to stderr.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "memoize.h"
+#include "analysis.h"
+#include "memory.h"
+
+// Entries of the hash table, a power of two
+#define MEMO_ENTRIES 4096
+// Instructions a function may have before it is not considered
+#define MEMO_MAX_BODY 256
+// Bit standing for the cmpl operands among the register bits, %eflags itself is ruled out
+#define FLAGS_BIT (1u << EFLAGS_REG)
+
+enum memo_states{
+  MEMO_PURE,
+  MEMO_IMPURE
+};
+
+// A call target of the program
+typedef struct
+{
+  unsigned int entry;         // instruction index
+  unsigned char state;
+  const char* reason;         // why it is impure
+  unsigned int inputs;        // bit per register it may read before writing
+  unsigned long long calls;
+  unsigned long long hits;
+  unsigned long long saved;   // instructions skipped by its hits
+} memo_function_t;
+
+// The outcome of one call with the given inputs
+typedef struct
+{
+  unsigned int function;      // index + 1 into the functions, 0 while empty
+  unsigned int written;       // bit per register the call wrote, FLAGS_BIT after a cmpl
+  int inputs[NUM_REGS];       // values of the input registers, in register order
+  int outputs[NUM_REGS];      // by register
+  int cmp_left;
+  int cmp_right;
+  unsigned long long count;   // instructions from the call to the ret
+  // The bytes below the return address down to the lowest one the call wrote, by distance
+  // below it: frame_size bytes as the ret left them, then a flag per byte, 1 if written
+  unsigned int frame_size;
+  unsigned char* frame;
+} memo_entry_t;
+
+typedef struct
+{
+  memo_function_t* functions;
+  unsigned int num_functions;
+  unsigned int capacity;
+  unsigned int* function_of;  // by instruction index, function index + 1, 0 before a call
+  memo_entry_t* entries;
+  unsigned int used;
+  unsigned long long evictions;
+} memo_table_t;
+
+// A call running under the runtime check
+typedef struct
+{
+  memo_function_t* function;  // NULL when no call is being recorded
+  memo_entry_t* entry;        // where its outcome goes
+  unsigned int frame;         // %esp just after the call, where the return address is
+  unsigned int return_pc;
+  unsigned int written;
+  unsigned long long start;
+  int inputs[NUM_REGS];       // registers at the call
+  unsigned char stored[STACK_SIZE];  // frame bytes written so far, by distance below frame
+} recording_t;
+
+// Memoization while the program runs
+typedef struct
+{
+  instruction_t* instructions;
+  unsigned int num_instructions;
+  unsigned char* memory;
+  memo_table_t table;
+  recording_t* recording;
+} memoizer_t;
+
+/*
+ * Sets the registers an instruction reads and writes, FLAGS_BIT standing for the cmpl
+ * operands. A %esp that only serves as the stack pointer is left out. Returns NULL, or
+ * why the instruction keeps its function from being pure.
+*/
+static const char* instruction_effects(instruction_t instr, unsigned int* uses,
+				       unsigned int* defs)
+{
+  *uses = 0;
+  *defs = 0;
+  if (instr.first_register >= NUM_REGS || instr.second_register >= NUM_REGS)
+    return "unknown register";
+  unsigned int first = 1u << instr.first_register;
+  unsigned int second = 1u << instr.second_register;
+
+  switch (instr.opcode)
+  {
+  case subl:
+  case addl_imm_reg:
+    // Growing and shrinking the frame
+    if (instr.first_register == ESP_REG)
+      return NULL;
+    *uses = first;
+    *defs = first;
+    break;
+  case shrl:
+    *uses = first;
+    *defs = first;
+    break;
+  case addl_reg_reg:
+  case imull:
+    *uses = first | second;
+    *defs = second;
+    break;
+  case movl_reg_reg:
+    *uses = first;
+    *defs = second;
+    break;
+  case movl_imm_reg:
+    *defs = first;
+    break;
+  case movl_deref_reg:
+    if (instr.first_register != ESP_REG)
+      return "memory not through %esp";
+    *defs = second;
+    break;
+  case movl_reg_deref:
+    if (instr.second_register != ESP_REG)
+      return "memory not through %esp";
+    *uses = first;
+    break;
+  case cmpl:
+    *uses = first | second;
+    break;
+  case je:
+  case jl:
+  case jle:
+  case jge:
+  case jbe:
+  case jmp:
+  case ret:
+    break;
+  case pushl:
+    *uses = first;
+    break;
+  case popl:
+    *defs = first;
+    break;
+  case call:
+    return "calls";
+  case printr:
+  case readr:
+    return "does I/O";
+  default:
+    return "unknown opcode";
+  }
+
+  if ((*uses | *defs) & (1u << ESP_REG))
+    return "uses the value of %esp";
+  if ((*uses | *defs) & (1u << EFLAGS_REG))
+    return "names %eflags";
+  if (instr.opcode == cmpl)
+    *defs = FLAGS_BIT;
+  else if (instr.opcode >= je && instr.opcode <= jbe)
+    *uses = FLAGS_BIT;
+  return NULL;
+}
+
+/*
+ * Returns the position of an instruction index in the body, or num_body when it is not
+ * there yet
+*/
+static unsigned int body_position(unsigned int* body, unsigned int num_body, unsigned int index)
+{
+  unsigned int k = 0;
+  while (k < num_body && body[k] != index)
+    k++;
+  return k;
+}
+
+/*
+ * Works out whether the function at the given instruction index can be pure, and its
+ * inputs if so. Returns NULL, or why it cannot.
+*/
+static const char* analyze_function(instruction_t* instructions, unsigned int num_instructions,
+				    unsigned int entry, unsigned int* inputs)
+{
+  unsigned int body[MEMO_MAX_BODY];
+  unsigned int successors[MEMO_MAX_BODY][2];  // positions in the body, or MEMO_MAX_BODY
+  unsigned int uses[MEMO_MAX_BODY], defs[MEMO_MAX_BODY], live[MEMO_MAX_BODY];
+  unsigned int num_body = 1;
+  body[0] = entry;
+
+  // The body grows as successors turn up, so every position is visited once
+  for (unsigned int k = 0; k < num_body; k++){
+    instruction_t instr = instructions[body[k]];
+    const char* reason = instruction_effects(instr, &uses[k], &defs[k]);
+    if (reason != NULL)
+      return reason;
+
+    long long next[2] = { -1, -1 };
+    long long target = (long long)body[k] + 1 + instr.immediate / 4;
+    if (instr.opcode >= je && instr.opcode <= jbe){
+      next[0] = body[k] + 1;
+      next[1] = target;
+    }
+    else if (instr.opcode == jmp)
+      next[0] = target;
+    else if (instr.opcode != ret)
+      next[0] = body[k] + 1;
+    if ((instr.opcode >= je && instr.opcode <= jmp) && instr.immediate % 4 != 0)
+      return "leaves the program";
+
+    for (int s = 0; s < 2; s++){
+      successors[k][s] = MEMO_MAX_BODY;
+      if (next[s] < 0)
+	continue;
+      if (next[s] >= num_instructions)
+	return "leaves the program";
+      unsigned int position = body_position(body, num_body, (unsigned int)next[s]);
+      if (position == num_body){
+	if (num_body == MEMO_MAX_BODY)
+	  return "too large";
+	body[num_body++] = (unsigned int)next[s];
+      }
+      successors[k][s] = position;
+    }
+  }
+
+  // Live registers, until nothing changes
+  memset(live, 0, sizeof(live));
+  int changed = 1;
+  while (changed){
+    changed = 0;
+    for (unsigned int k = num_body; k-- > 0;){
+      unsigned int out = 0;
+      for (int s = 0; s < 2; s++){
+	if (successors[k][s] != MEMO_MAX_BODY)
+	  out |= live[successors[k][s]];
+      }
+      unsigned int in = uses[k] | (out & ~defs[k]);
+      if (in != live[k]){
+	live[k] = in;
+	changed = 1;
+      }
+    }
+  }
+  if (live[0] & FLAGS_BIT)
+    return "reads the caller's flags";
+  *inputs = live[0];
+  return NULL;
+}
+
+/*
+ * Returns the function at a call target, analyzing it on its first call, or NULL for a
+ * target outside the program
+*/
+static memo_function_t* memo_function(memo_table_t* table, instruction_t* instructions,
+				      unsigned int num_instructions, unsigned int target)
+{
+  if (target % 4 != 0 || target / 4 >= num_instructions)
+    return NULL;
+  unsigned int index = target / 4;
+  if (table->function_of[index] != 0)
+    return &table->functions[table->function_of[index] - 1];
+
+  if (table->num_functions == table->capacity){
+    table->capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+    table->functions = realloc(table->functions, sizeof(memo_function_t) * table->capacity);
+    if (table->functions == NULL)
+      error_exit("unable to allocate memory for memoization");
+  }
+  memo_function_t* function = &table->functions[table->num_functions++];
+  table->function_of[index] = table->num_functions;
+  memset(function, 0, sizeof(memo_function_t));
+  function->entry = index;
+  function->reason = analyze_function(instructions, num_instructions, index, &function->inputs);
+  function->state = function->reason == NULL ? MEMO_PURE : MEMO_IMPURE;
+  return function;
+}
+
+/*
+ * Looks up the current inputs of a function. Returns the entry holding them, or NULL
+ * after pointing *slot at the entry a recorded call should replace.
+*/
+static memo_entry_t* memo_lookup(memo_table_t* table, memo_function_t* function,
+				 int* registers, memo_entry_t** slot)
+{
+  unsigned int id = function - table->functions + 1;
+  unsigned int hash = id * 0x9E3779B1u;
+  int inputs[NUM_REGS];
+  int num_inputs = 0;
+  for (int r = 0; r < NUM_REGS; r++){
+    if (function->inputs & (1u << r)){
+      inputs[num_inputs++] = registers[r];
+      hash = (hash ^ (unsigned int)registers[r]) * 0x9E3779B1u;
+    }
+  }
+  memo_entry_t* entry = &table->entries[(hash ^ (hash >> 16)) & (MEMO_ENTRIES - 1)];
+  if (entry->function == id &&
+      memcmp(entry->inputs, inputs, sizeof(int) * num_inputs) == 0)
+    return entry;
+
+  *slot = entry;
+  return NULL;
+}
+
+/*
+ * Marks the function being recorded impure and stops recording
+*/
+static void record_fail(recording_t* recording, const char* reason)
+{
+  recording->function->state = MEMO_IMPURE;
+  recording->function->reason = reason;
+  recording->function = NULL;
+}
+
+/*
+ * Checks a 4-byte frame access of the recorded call, and notes the bytes a store writes.
+ * Returns whether the access is allowed.
+*/
+static int frame_access(recording_t* recording, int address, int store)
+{
+  unsigned int depth = recording->frame - (unsigned int)address;
+  if (depth < 4 || depth > STACK_SIZE){
+    record_fail(recording, "touches memory outside its frame");
+    return 0;
+  }
+  unsigned char* bytes = &recording->stored[depth - 4];
+  if (store){
+    memset(bytes, 1, 4);
+    return 1;
+  }
+  if (!bytes[0] || !bytes[1] || !bytes[2] || !bytes[3]){
+    record_fail(recording, "reads memory it did not write");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Runs the runtime check on an instruction of the recorded call before it executes
+*/
+static void record_step(recording_t* recording, instruction_t instr, int* registers)
+{
+  int esp = registers[ESP_REG];
+  unsigned int uses, defs;
+  instruction_effects(instr, &uses, &defs);
+  recording->written |= defs;
+
+  switch (instr.opcode)
+  {
+  case movl_deref_reg:
+    frame_access(recording, esp + instr.immediate, 0);
+    break;
+  case movl_reg_deref:
+    frame_access(recording, esp + instr.immediate, 1);
+    break;
+  case pushl:
+    frame_access(recording, esp - 4, 1);
+    break;
+  case popl:
+    frame_access(recording, esp, 0);
+    break;
+  case ret:
+    if ((unsigned int)esp != recording->frame)
+      record_fail(recording, "leaves the stack unbalanced");
+    break;
+  }
+}
+
+/*
+ * Stores the outcome of the recorded call, which has just returned
+*/
+static void record_finish(recording_t* recording, memo_table_t* table, int* registers,
+			  unsigned char* memory, unsigned long long executed)
+{
+  memo_function_t* function = recording->function;
+  memo_entry_t* entry = recording->entry;
+  unsigned int id = function - table->functions + 1;
+
+  if (entry->function == 0)
+    table->used++;
+  else if (entry->function != id)
+    table->evictions++;
+  entry->function = id;
+  entry->written = recording->written;
+  int num_inputs = 0;
+  for (int r = 0; r < NUM_REGS; r++){
+    if (function->inputs & (1u << r))
+      entry->inputs[num_inputs++] = recording->inputs[r];
+    if (recording->written & ~FLAGS_BIT & (1u << r))
+      entry->outputs[r] = registers[r];
+  }
+  entry->cmp_left = registers[CMP_LEFT];
+  entry->cmp_right = registers[CMP_RIGHT];
+  entry->count = executed - recording->start;
+
+  // stored[i] stands for the byte at frame - 1 - i, which the ret left as it is
+  unsigned int frame_size = STACK_SIZE;
+  while (frame_size > 0 && !recording->stored[frame_size - 1])
+    frame_size--;
+  entry->frame_size = frame_size;
+  entry->frame = realloc(entry->frame, frame_size * 2);
+  if (frame_size > 0 && entry->frame == NULL)
+    error_exit("unable to allocate memory for memoization");
+  for (unsigned int i = 0; i < frame_size; i++){
+    entry->frame[i] = recording->stored[i] ? memory[recording->frame - 1 - i] : 0;
+    entry->frame[frame_size + i] = recording->stored[i];
+  }
+  recording->function = NULL;
+}
+
+/*
+ * Writes what a call to the entry's function leaves in memory when %esp is at esp before
+ * it: the return address and the frame bytes the call writes below it. Faults where the
+ * call itself would have.
+*/
+static void write_frame(memo_entry_t* entry, unsigned char* memory, unsigned int esp,
+			unsigned int return_pc)
+{
+  unsigned int frame = esp - 4;
+  *guest_word(memory, memory_size - 4, frame) = return_pc;
+  for (unsigned int i = 0; i < entry->frame_size; i++){
+    if (!entry->frame[entry->frame_size + i])
+      continue;
+    if (frame - 1 - i >= memory_size)
+      memory_fault();
+    memory[frame - 1 - i] = entry->frame[i];
+  }
+}
+
+/*
+ * Orders functions by instructions saved, then calls, most first
+*/
+static int compare_functions(const void* a, const void* b)
+{
+  const memo_function_t* left = a;
+  const memo_function_t* right = b;
+  if (left->saved != right->saved)
+    return left->saved < right->saved ? 1 : -1;
+  if (left->calls != right->calls)
+    return left->calls < right->calls ? 1 : -1;
+  return left->entry < right->entry ? -1 : 1;
+}
+
+/*
+ * Writes the memoization report to stderr
+*/
+static void print_memoized(memo_table_t* table, unsigned long long executed)
+{
+  unsigned long long calls = 0, hits = 0, saved = 0;
+  for (unsigned int f = 0; f < table->num_functions; f++){
+    if (table->functions[f].state == MEMO_PURE || table->functions[f].hits > 0){
+      calls += table->functions[f].calls;
+      hits += table->functions[f].hits;
+      saved += table->functions[f].saved;
+    }
+  }
+
+  fprintf(stderr, "memoize: %d-entry table, %u used, %llu evictions\n", MEMO_ENTRIES,
+	  table->used, table->evictions);
+  fprintf(stderr, "%-20s %14llu\n", "instructions", executed);
+  fprintf(stderr, "%-20s %14llu %6.2f%%\n", "saved", saved,
+	  executed > 0 ? 100.0 * saved / executed : 0.0);
+  fprintf(stderr, "%-20s %14llu\n", "memoized calls", calls);
+  fprintf(stderr, "%-20s %14llu %6.2f%%\n", "hits", hits, calls > 0 ? 100.0 * hits / calls : 0.0);
+
+  qsort(table->functions, table->num_functions, sizeof(memo_function_t), compare_functions);
+  fprintf(stderr, "\n%-10s %12s %12s %9s %14s %7s   %s\n", "function", "calls", "hits",
+	  "hit rate", "saved", "inputs", "status");
+  for (unsigned int f = 0; f < table->num_functions; f++){
+    memo_function_t* function = &table->functions[f];
+    fprintf(stderr, "  0x%06x %12llu %12llu %8.2f%% %14llu ", function->entry * 4,
+	    function->calls, function->hits,
+	    function->calls > 0 ? 100.0 * function->hits / function->calls : 0.0,
+	    function->saved);
+    if (function->reason == NULL || function->hits > 0)
+      fprintf(stderr, "%7d   ", __builtin_popcount(function->inputs));
+    else
+      fprintf(stderr, "%7s   ", "-");
+    fprintf(stderr, "%s\n", function->reason == NULL ? "pure" : function->reason);
+  }
+  fprintf(stderr, "\n");
+}
+
+/*
+ * Before a call, returns the number of instructions from the call to its ret when the
+ * outcome for the same inputs is known, and leaves the registers as the call would have.
+ * Otherwise starts recording a call to a pure function, or checks the next step of the
+ * call being recorded, and returns 0.
+*/
+static inline unsigned long long memoize_call(void* state, unsigned int index, instruction_t instr,
+					      int* registers, unsigned long long executed)
+{
+  memoizer_t* memoizer = state;
+  recording_t* recording = memoizer->recording;
+  if (recording->function != NULL){
+    record_step(recording, instr, registers);
+    return 0;
+  }
+  if (instr.opcode != call)
+    return 0;
+
+  memo_function_t* function = memo_function(&memoizer->table, memoizer->instructions,
+					     memoizer->num_instructions,
+					     index * 4 + instr.immediate + 4);
+  if (function == NULL)
+    return 0;
+  function->calls++;
+  memo_entry_t* slot;
+  memo_entry_t* entry = function->state == MEMO_PURE ?
+    memo_lookup(&memoizer->table, function, registers, &slot) : NULL;
+  if (entry != NULL){
+    // The call and everything up to its ret
+    write_frame(entry, memoizer->memory, registers[ESP_REG], index * 4 + 4);
+    for (int r = 0; r < NUM_REGS; r++){
+      if (entry->written & ~FLAGS_BIT & (1u << r))
+	registers[r] = entry->outputs[r];
+    }
+    if (entry->written & FLAGS_BIT){
+      registers[CMP_LEFT] = entry->cmp_left;
+      registers[CMP_RIGHT] = entry->cmp_right;
+      registers[FLAGS_PENDING] = 1;
+    }
+    function->hits++;
+    function->saved += entry->count;
+    return entry->count;
+  }
+  if (function->state == MEMO_PURE){
+    recording->function = function;
+    recording->entry = slot;
+    recording->frame = registers[ESP_REG] - 4;
+    recording->return_pc = index * 4 + 4;
+    recording->written = 0;
+    recording->start = executed;
+    memcpy(recording->inputs, registers, sizeof(recording->inputs));
+    memset(recording->stored, 0, sizeof(recording->stored));
+  }
+  return 0;
+}
+
+/*
+ * Ends the call being recorded at its ret
+*/
+static inline void memoize_return(void* state, instruction_t instr, unsigned int program_counter,
+				  int* registers, unsigned long long executed)
+{
+  memoizer_t* memoizer = state;
+  recording_t* recording = memoizer->recording;
+  if (recording->function == NULL || instr.opcode != ret)
+    return;
+  if (program_counter == recording->return_pc)
+    record_finish(recording, &memoizer->table, registers, memoizer->memory, executed);
+  else
+    record_fail(recording, "returns elsewhere");
+}
+
+/*
+ * Runs the program through run_hooked, skipping calls to pure leaf functions whose
+ * outcome for the same inputs is already known, then prints the report. Returns the
+ * number of instructions executed, the skipped ones included.
+*/
+unsigned long long run_memoized(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io)
+{
+  memoizer_t memoizer;
+  memset(&memoizer, 0, sizeof(memoizer));
+  memoizer.instructions = instructions;
+  memoizer.num_instructions = num_instructions;
+  memoizer.memory = memory;
+  memo_table_t* table = &memoizer.table;
+  table->function_of = calloc(num_instructions, sizeof(unsigned int));
+  table->entries = calloc(MEMO_ENTRIES, sizeof(memo_entry_t));
+  memoizer.recording = calloc(1, sizeof(recording_t));
+  if ((num_instructions > 0 && table->function_of == NULL) || table->entries == NULL ||
+      memoizer.recording == NULL)
+    error_exit("unable to allocate memory for memoization");
+
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, memoize_call, memoize_return, &memoizer);
+  print_memoized(table, executed);
+
+  free(memoizer.recording);
+  for (unsigned int e = 0; e < MEMO_ENTRIES; e++)
+    free(table->entries[e].frame);
+  free(table->entries);
+  free(table->function_of);
+  free(table->functions);
+  return executed;
+}
@@ -0,0 +1,12 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Memoization of pure leaf functions, checked statically and at run time.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_memoized(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io);
@@ -0,0 +1,121 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Guest memory for the simulator.
+ *
+ * The guest used to have exactly the 1024-byte stack. Now its memory can be as large as
+ * MAX_MEMORY_SIZE: the whole range is reserved as one anonymous mapping without swap
+ * reservation, so the kernel's page table is the sparse table, and each 4 KB page gets a
+ * frame on first touch. A program that only uses the top of its stack costs a page or
+ * two however large its memory is. Engines keep indexing the mapping directly; an access
+ * is checked against the size with one unsigned compare, and one outside the memory stops
+ * the run with an error instead of reaching host memory.
+ *
+ * Clearing and copying look at which pages are resident with mincore, so they also cost
+ * only what the guest has touched.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "memory.h"
+
+unsigned int memory_size = STACK_SIZE;
+
+// Guest memories allocated and not yet freed: memory_size is read by every engine as it
+// runs and by memory_free, so it only changes while this is 0
+static unsigned int live_memories;
+
+// Small memories are cleared with memset, larger ones handed back to the kernel
+#define CLEAR_WITH_MEMSET (64 * 1024)
+
+/*
+ * Returns the size of the mapping behind a guest memory, whole pages
+*/
+static size_t mapping_size()
+{
+  return ((size_t)memory_size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE * MEMORY_PAGE_SIZE;
+}
+
+/*
+ * Returns a new zeroed guest memory of memory_size bytes
+*/
+unsigned char* memory_new()
+{
+  void* memory = mmap(NULL, mapping_size(), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED)
+    error_exit("unable to allocate guest memory");
+  __atomic_fetch_add(&live_memories, 1, __ATOMIC_RELAXED);
+  return memory;
+}
+
+void memory_free(unsigned char* memory)
+{
+  munmap(memory, mapping_size());
+  __atomic_fetch_sub(&live_memories, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns whether any guest memory is allocated
+*/
+int memory_in_use()
+{
+  return __atomic_load_n(&live_memories, __ATOMIC_RELAXED) != 0;
+}
+
+/*
+ * Zeroes a guest memory, giving its pages back to the kernel when it is large
+*/
+void memory_clear(unsigned char* memory)
+{
+  if (memory_size <= CLEAR_WITH_MEMSET)
+    memset(memory, 0, memory_size);
+  else if (madvise(memory, mapping_size(), MADV_DONTNEED) != 0)
+    error_exit("unable to clear guest memory");
+}
+
+/*
+ * Returns one byte per page of the guest memory, nonzero where the page has been touched.
+ * The caller frees it.
+*/
+unsigned char* memory_resident(unsigned char* memory)
+{
+  size_t num_pages = mapping_size() / MEMORY_PAGE_SIZE;
+  unsigned char* resident = malloc(num_pages);
+  if (resident == NULL)
+    error_exit("unable to allocate memory for the page map");
+  if (mincore(memory, mapping_size(), resident) != 0)
+    memset(resident, 1, num_pages);
+  for (size_t page = 0; page < num_pages; page++)
+    resident[page] &= 1;
+  return resident;
+}
+
+/*
+ * Makes destination a copy of source, touching only the pages source has touched
+*/
+void memory_copy(unsigned char* destination, unsigned char* source)
+{
+  if (memory_size <= CLEAR_WITH_MEMSET){
+    memcpy(destination, source, memory_size);
+    return;
+  }
+  memory_clear(destination);
+  unsigned char* resident = memory_resident(source);
+  size_t num_pages = mapping_size() / MEMORY_PAGE_SIZE;
+  for (size_t page = 0; page < num_pages; page++){
+    if (resident[page])
+      memcpy(destination + page * MEMORY_PAGE_SIZE, source + page * MEMORY_PAGE_SIZE,
+	     MEMORY_PAGE_SIZE);
+  }
+  free(resident);
+}
+
+/*
+ * Stops the run on an access outside guest memory
+*/
+void memory_fault()
+{
+  error_exit("memory access out of range");
+}
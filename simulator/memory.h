@@ -0,0 +1,37 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Guest memory of a configurable size, allocated page by page as it is touched.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+// Largest guest memory, so every address and %esp stay positive ints
+#define MAX_MEMORY_SIZE (1u << 30)
+#define MEMORY_PAGE_SIZE 4096
+
+// Size of every guest memory in bytes, STACK_SIZE unless set with --memory.
+// %esp starts here, and ret with %esp here returns from main. Fixed while any memory
+// is allocated, see memory_in_use.
+extern unsigned int memory_size;
+
+unsigned char* memory_new();
+void memory_free(unsigned char* memory);
+int memory_in_use();
+void memory_clear(unsigned char* memory);
+void memory_copy(unsigned char* destination, unsigned char* source);
+unsigned char* memory_resident(unsigned char* memory);
+void memory_fault();
+
+/*
+ * Returns the 4-byte word at address, faulting unless all of it lies in guest memory.
+ * last is the highest valid word address, memory_size - 4, which callers keep at hand.
+*/
+static inline int* guest_word(unsigned char* memory, unsigned int last, int address)
+{
+  if ((unsigned int)address > last)
+    memory_fault();
+  return (int*)&memory[(unsigned int)address];
+}
@@ -0,0 +1,222 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Pipeline timing model for the simulator.
+ *
+ * run_pipeline estimates the cycles the program would take on a classic in-order,
+ * single-issue 5-stage pipeline (IF, ID, EX, MEM, WB) with full forwarding, charging each
+ * instruction just before it executes. Every instruction takes one cycle, plus:
+ *  - 4 cycles at the start to fill the pipeline.
+ *  - A load-use stall of one cycle when movl_deref_reg or popl is followed by an
+ *    instruction that reads the loaded register. The value only leaves MEM after the next
+ *    instruction needed it in EX.
+ *  - imull_latency - 1 cycles per imull, which holds EX for imull_latency cycles.
+ *  - mispredict_penalty cycles for every conditional jump the branch predictor got wrong.
+ *    It is resolved in EX, after the wrong path has been fetched. The predictor is one of
+ *    those in predictor.c, static backward-taken unless --predictor= picks another.
+ *  - One bubble after jmp and call, whose target is computed in ID.
+ *  - Three bubbles after ret, whose target is only known after it is loaded in MEM.
+ *
+ * Everything the model needs of an instruction is worked out once per program, so charging
+ * one is a mask test and a small switch. When the program finishes the cycles, the CPI,
+ * the stall breakdown and the predictor's report go to stderr.
+*/
+
+#include <stdlib.h>
+#include "pipeline.h"
+#include "analysis.h"
+#include "predictor.h"
+#include "memory.h"
+
+#define PIPELINE_FILL 4
+#define JUMP_BUBBLES 1
+#define RET_BUBBLES 3
+
+// How an instruction affects the pipeline besides its one cycle
+enum timing_kinds{
+  TIMING_PLAIN,
+  TIMING_IMULL,
+  TIMING_BRANCH,   // conditional jump
+  TIMING_JUMP,     // jmp or call
+  TIMING_RET
+};
+
+// What the model needs to know of one instruction of the program
+typedef struct
+{
+  unsigned int sources;        // bit per register the instruction reads
+  unsigned int load;           // bit of the register it loads from memory, or 0
+  unsigned char kind;
+  unsigned char backward;      // conditional jump to itself or an earlier instruction
+} timing_t;
+
+// The model while the program runs
+typedef struct
+{
+  timing_t* timings;
+  predictor_t* predictor;
+  unsigned int loaded;         // register the previous instruction loaded
+  unsigned long long load_use;
+  unsigned long long imulls;
+  unsigned long long mispredicts;
+  unsigned long long jumps;
+  unsigned long long returns;
+} pipeline_t;
+
+/*
+ * Returns the timing information of one instruction
+*/
+static timing_t instruction_timing(instruction_t instr)
+{
+  unsigned int first = 1u << instr.first_register;
+  unsigned int second = 1u << instr.second_register;
+  unsigned int esp = 1u << ESP_REG;
+  timing_t timing = { 0, 0, TIMING_PLAIN, 0 };
+
+  switch (instr.opcode)
+  {
+  case subl:
+  case addl_imm_reg:
+  case shrl:
+  case movl_reg_reg:
+  case printr:
+    timing.sources = first;
+    break;
+  case addl_reg_reg:
+  case movl_reg_deref:
+  case cmpl:
+    timing.sources = first | second;
+    break;
+  case imull:
+    timing.sources = first | second;
+    timing.kind = TIMING_IMULL;
+    break;
+  case movl_deref_reg:
+    timing.sources = first;
+    timing.load = second;
+    break;
+  case je:
+  case jl:
+  case jle:
+  case jge:
+  case jbe:
+    // Only a load into %eflags can hold up a conditional jump
+    timing.sources = 1u << EFLAGS_REG;
+    timing.kind = TIMING_BRANCH;
+    timing.backward = instr.immediate < 0;
+    break;
+  case jmp:
+    timing.kind = TIMING_JUMP;
+    break;
+  case call:
+    timing.sources = esp;
+    timing.kind = TIMING_JUMP;
+    break;
+  case ret:
+    timing.sources = esp;
+    timing.kind = TIMING_RET;
+    break;
+  case pushl:
+    timing.sources = first | esp;
+    break;
+  case popl:
+    timing.sources = esp;
+    timing.load = first;
+    break;
+  }
+  return timing;
+}
+
+/*
+ * Writes the timing report to stderr
+*/
+static void print_timing(unsigned long long executed, int imull_latency, int mispredict_penalty,
+			 unsigned long long load_use, unsigned long long imulls,
+			 unsigned long long mispredicts, unsigned long long jumps,
+			 unsigned long long returns)
+{
+  const char* names[] = { "pipeline fill", "load-use", "imull", "branch mispredict",
+			  "jmp/call", "ret" };
+  unsigned long long stalls[] = {
+    PIPELINE_FILL, load_use, imulls * (imull_latency - 1), mispredicts * mispredict_penalty,
+    jumps * JUMP_BUBBLES, returns * RET_BUBBLES
+  };
+  int num_causes = sizeof(stalls) / sizeof(stalls[0]);
+
+  unsigned long long cycles = executed;
+  for (int i = 0; i < num_causes; i++)
+    cycles += stalls[i];
+
+  fprintf(stderr, "pipeline: 5-stage in-order, imull latency %d, mispredict penalty %d\n",
+	  imull_latency, mispredict_penalty);
+  fprintf(stderr, "%-20s %14llu\n", "instructions", executed);
+  fprintf(stderr, "%-20s %14llu\n", "cycles", cycles);
+  fprintf(stderr, "%-20s %14.3f\n", "CPI", executed > 0 ? (double)cycles / executed : 0.0);
+
+  fprintf(stderr, "\n%-20s %14s %7s\n", "stall", "cycles", "share");
+  for (int i = 0; i < num_causes; i++)
+    fprintf(stderr, "%-20s %14llu %6.2f%%\n", names[i], stalls[i],
+	    100.0 * stalls[i] / cycles);
+  fprintf(stderr, "\n");
+}
+
+/*
+ * Counts the stalls the instruction at index causes before it runs
+*/
+static inline unsigned long long time_instruction(void* state, unsigned int index,
+						  instruction_t instr, int* registers,
+						  unsigned long long executed)
+{
+  pipeline_t* pipeline = state;
+  timing_t* timing = &pipeline->timings[index];
+
+  if (timing->sources & pipeline->loaded)
+    pipeline->load_use++;
+  pipeline->loaded = timing->load;
+  switch (timing->kind)
+  {
+  case TIMING_IMULL:
+    pipeline->imulls++;
+    break;
+  case TIMING_BRANCH:
+    pipeline->mispredicts += predictor_branch(pipeline->predictor, index, timing->backward,
+					      branch_taken(instr.opcode, registers));
+    break;
+  case TIMING_JUMP:
+    pipeline->jumps++;
+    break;
+  case TIMING_RET:
+    // Returning from main ends the program, nothing is fetched after it
+    if ((unsigned int)registers[ESP_REG] != memory_size)
+      pipeline->returns++;
+    break;
+  }
+  return 0;
+}
+
+/*
+ * Runs the program through run_hooked, counting pipeline stalls, then prints the
+ * report. Returns the number of instructions executed.
+*/
+unsigned long long run_pipeline(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				int imull_latency, int mispredict_penalty, int predictor_kind)
+{
+  pipeline_t pipeline = { 0 };
+  pipeline.timings = malloc(sizeof(timing_t) * num_instructions);
+  if (num_instructions > 0 && pipeline.timings == NULL)
+    error_exit("unable to allocate memory for the timing model");
+  for (unsigned int i = 0; i < num_instructions; i++)
+    pipeline.timings[i] = instruction_timing(instructions[i]);
+  pipeline.predictor = predictor_new(predictor_kind, num_instructions);
+
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, time_instruction, NULL, &pipeline);
+  print_timing(executed, imull_latency, mispredict_penalty, pipeline.load_use,
+	       pipeline.imulls, pipeline.mispredicts, pipeline.jumps, pipeline.returns);
+  print_predictions(pipeline.predictor, instructions);
+
+  predictor_free(pipeline.predictor);
+  free(pipeline.timings);
+  return executed;
+}
@@ -0,0 +1,13 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Cycle estimate of the program on a classic in-order 5-stage pipeline.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_pipeline(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				int imull_latency, int mispredict_penalty, int predictor);
@@ -0,0 +1,319 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Branch predictor models for the simulator.
+ *
+ * Every conditional jump outcome is fed to one of these predictors, chosen with
+ * --predictor=:
+ *  static   backward jumps are taken, forward ones are not
+ *  bimodal  a 2-bit saturating counter per branch, in a table indexed by its address
+ *  gshare   the same counters indexed by the address xor the global branch history
+ *  tage     a bimodal base table and TAGE_TABLES tables tagged with geometrically longer
+ *           histories; the longest history that matches predicts, and a mispredicted
+ *           branch gets an entry in a longer table
+ * The predictor counts executions, taken jumps and mispredictions per branch. Nothing here
+ * runs unless a predictor is asked for. On its own, run_predicted feeds it every
+ * conditional jump ahead of the jump itself, and the pipeline model in pipeline.c
+ * charges its mispredictions as stall cycles.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "predictor.h"
+#include "analysis.h"
+#include "memory.h"
+
+// Entries of the bimodal and gshare tables, and of the TAGE base table
+#define PREDICTOR_BITS 12
+#define PREDICTOR_ENTRIES (1 << PREDICTOR_BITS)
+
+#define TAGE_TABLES 4
+#define TAGE_BITS 10
+#define TAGE_ENTRIES (1 << TAGE_BITS)
+#define TAGE_TAG_BITS 8
+// Branches between two halvings of the TAGE useful counters
+#define TAGE_AGING (1 << 18)
+
+static const int tage_history[TAGE_TABLES] = { 4, 8, 16, 32 };
+
+static const char* predictor_names[] = { "static", "bimodal", "gshare", "tage" };
+
+// An entry of a tagged TAGE table
+typedef struct
+{
+  unsigned short tag;   // 0 while the entry is unused
+  signed char counter;  // -4 to 3, taken when not negative
+  unsigned char useful; // 0 to 3, an entry is only replaced at 0
+} tage_entry_t;
+
+// Counters for one conditional jump of the program
+typedef struct
+{
+  unsigned long long executed;
+  unsigned long long taken;
+  unsigned long long mispredicted;
+} branch_site_t;
+
+struct predictor
+{
+  int kind;
+  unsigned char counters[PREDICTOR_ENTRIES]; // 2-bit, taken from 2 up
+  unsigned long long history;                // last outcomes, the latest in bit 0
+  tage_entry_t tage[TAGE_TABLES][TAGE_ENTRIES];
+  unsigned long long branches;
+  branch_site_t* sites;  // indexed by instruction
+  unsigned int num_instructions;
+};
+
+/*
+ * Returns a new predictor of the given kind for a program of num_instructions
+*/
+predictor_t* predictor_new(int kind, unsigned int num_instructions)
+{
+  if (kind < PREDICTOR_STATIC || kind > PREDICTOR_TAGE)
+    error_exit("unknown branch predictor");
+  predictor_t* predictor = calloc(1, sizeof(predictor_t));
+  if (predictor == NULL)
+    error_exit("unable to allocate memory for the branch predictor");
+  predictor->kind = kind;
+  predictor->num_instructions = num_instructions;
+  // Weakly not taken
+  memset(predictor->counters, 1, sizeof(predictor->counters));
+  predictor->sites = calloc(num_instructions, sizeof(branch_site_t));
+  if (num_instructions > 0 && predictor->sites == NULL)
+    error_exit("unable to allocate memory for the branch predictor");
+  return predictor;
+}
+
+/*
+ * Frees the predictor
+*/
+void predictor_free(predictor_t* predictor)
+{
+  free(predictor->sites);
+  free(predictor);
+}
+
+/*
+ * Moves a 2-bit counter one step towards the outcome
+*/
+static void train_counter(unsigned char* counter, int taken)
+{
+  if (taken && *counter < 3)
+    (*counter)++;
+  else if (!taken && *counter > 0)
+    (*counter)--;
+}
+
+/*
+ * Returns the low length bits of the history folded into bits bits by xor
+*/
+static unsigned int fold_history(unsigned long long history, int length, int bits)
+{
+  unsigned long long remaining = history & ((1ull << length) - 1);
+  unsigned int folded = 0;
+  for (; remaining != 0; remaining >>= bits)
+    folded ^= remaining & ((1u << bits) - 1);
+  return folded;
+}
+
+/*
+ * Predicts the branch at index with TAGE, then trains it with the outcome.
+ * Returns the prediction.
+*/
+static int tage_branch(predictor_t* predictor, unsigned int index, int taken)
+{
+  tage_entry_t* entries[TAGE_TABLES];
+  unsigned short tags[TAGE_TABLES];
+  int provider = -1;
+  int alternate = -1;
+  for (int t = 0; t < TAGE_TABLES; t++){
+    int length = tage_history[t];
+    unsigned int slot = (index ^ (index >> TAGE_BITS) ^
+			 fold_history(predictor->history, length, TAGE_BITS)) & (TAGE_ENTRIES - 1);
+    entries[t] = &predictor->tage[t][slot];
+    tags[t] = ((index ^ fold_history(predictor->history, length, TAGE_TAG_BITS) ^
+		(fold_history(predictor->history, length, TAGE_TAG_BITS - 1) << 1)) &
+	       ((1 << TAGE_TAG_BITS) - 1)) + 1;
+  }
+  for (int t = TAGE_TABLES - 1; t >= 0 && alternate == -1; t--){
+    if (entries[t]->tag != tags[t])
+      continue;
+    if (provider == -1)
+      provider = t;
+    else
+      alternate = t;
+  }
+
+  unsigned char* base = &predictor->counters[index & (PREDICTOR_ENTRIES - 1)];
+  int alternate_prediction = alternate != -1 ? entries[alternate]->counter >= 0 : *base >= 2;
+  int prediction = provider != -1 ? entries[provider]->counter >= 0 : *base >= 2;
+
+  if (provider != -1){
+    tage_entry_t* entry = entries[provider];
+    if (prediction != alternate_prediction){
+      if (prediction == taken && entry->useful < 3)
+	entry->useful++;
+      else if (prediction != taken && entry->useful > 0)
+	entry->useful--;
+    }
+    if (taken && entry->counter < 3)
+      entry->counter++;
+    else if (!taken && entry->counter > -4)
+      entry->counter--;
+  }
+  else
+    train_counter(base, taken);
+
+  // A mispredicted branch gets an entry with a longer history, if one is free
+  if (prediction != taken){
+    int allocated = 0;
+    for (int t = provider + 1; t < TAGE_TABLES && !allocated; t++){
+      if (entries[t]->useful == 0){
+	entries[t]->tag = tags[t];
+	entries[t]->counter = taken ? 0 : -1;
+	allocated = 1;
+      }
+    }
+    for (int t = provider + 1; t < TAGE_TABLES && !allocated; t++)
+      entries[t]->useful--;
+  }
+
+  if (predictor->branches % TAGE_AGING == 0){
+    for (int t = 0; t < TAGE_TABLES; t++){
+      for (int e = 0; e < TAGE_ENTRIES; e++)
+	predictor->tage[t][e].useful >>= 1;
+    }
+  }
+  return prediction;
+}
+
+/*
+ * Predicts the conditional jump at instruction index, backward if it jumps to itself or
+ * an earlier instruction, trains the predictor with the outcome and counts it.
+ * Returns whether the prediction was wrong.
+*/
+int predictor_branch(predictor_t* predictor, unsigned int index, int backward, int taken)
+{
+  int prediction = 0;
+  unsigned char* counter;
+
+  predictor->branches++;
+  switch (predictor->kind)
+  {
+  case PREDICTOR_STATIC:
+    prediction = backward;
+    break;
+  case PREDICTOR_BIMODAL:
+    counter = &predictor->counters[index & (PREDICTOR_ENTRIES - 1)];
+    prediction = *counter >= 2;
+    train_counter(counter, taken);
+    break;
+  case PREDICTOR_GSHARE:
+    counter = &predictor->counters[(index ^ predictor->history) & (PREDICTOR_ENTRIES - 1)];
+    prediction = *counter >= 2;
+    train_counter(counter, taken);
+    break;
+  case PREDICTOR_TAGE:
+    prediction = tage_branch(predictor, index, taken);
+    break;
+  }
+  predictor->history = predictor->history << 1 | taken;
+
+  branch_site_t* site = &predictor->sites[index];
+  site->executed++;
+  site->taken += taken;
+  site->mispredicted += prediction != taken;
+  return prediction != taken;
+}
+
+// A branch site with the index of its instruction, for sorting
+typedef struct
+{
+  branch_site_t site;
+  unsigned int index;
+} ranked_branch_t;
+
+/*
+ * Orders ranked branch sites by mispredictions, then executions, most first
+*/
+static int compare_branches(const void* a, const void* b)
+{
+  const ranked_branch_t* left = a;
+  const ranked_branch_t* right = b;
+  if (left->site.mispredicted != right->site.mispredicted)
+    return left->site.mispredicted < right->site.mispredicted ? 1 : -1;
+  if (left->site.executed != right->site.executed)
+    return left->site.executed < right->site.executed ? 1 : -1;
+  return left->index < right->index ? -1 : 1;
+}
+
+/*
+ * Writes the misprediction rate overall and for every branch that ran to stderr, the
+ * most mispredicted first
+*/
+void print_predictions(predictor_t* predictor, instruction_t* instructions)
+{
+  const char* jump_names[] = { "je", "jl", "jle", "jge", "jbe" };
+  ranked_branch_t* order = malloc(sizeof(ranked_branch_t) * predictor->num_instructions);
+  if (predictor->num_instructions > 0 && order == NULL)
+    error_exit("unable to allocate memory for the branch report");
+
+  unsigned long long mispredicted = 0;
+  unsigned int num_sites = 0;
+  for (unsigned int i = 0; i < predictor->num_instructions; i++){
+    if (predictor->sites[i].executed == 0)
+      continue;
+    mispredicted += predictor->sites[i].mispredicted;
+    order[num_sites].site = predictor->sites[i];
+    order[num_sites++].index = i;
+  }
+  qsort(order, num_sites, sizeof(ranked_branch_t), compare_branches);
+
+  fprintf(stderr, "predictor: %s\n", predictor_names[predictor->kind]);
+  fprintf(stderr, "%-20s %14llu\n", "branches", predictor->branches);
+  fprintf(stderr, "%-20s %14llu\n", "mispredicted", mispredicted);
+  fprintf(stderr, "%-20s %13.2f%%\n", "mispredict rate",
+	  predictor->branches > 0 ? 100.0 * mispredicted / predictor->branches : 0.0);
+
+  fprintf(stderr, "\n%-10s %14s %14s %14s %8s   %s\n", "branch", "executed", "taken",
+	  "mispredicted", "rate", "instruction");
+  for (unsigned int n = 0; n < num_sites; n++){
+    unsigned int i = order[n].index;
+    branch_site_t* site = &order[n].site;
+    instruction_t instr = instructions[i];
+    fprintf(stderr, "  0x%06x %14llu %14llu %14llu %7.2f%%   %s 0x%06x\n", i * 4,
+	    site->executed, site->taken, site->mispredicted,
+	    100.0 * site->mispredicted / site->executed, jump_names[instr.opcode - je],
+	    i * 4 + instr.immediate + 4);
+  }
+  free(order);
+}
+
+/*
+ * Feeds the instruction at index to the predictor before it runs, if it is a conditional
+ * jump
+*/
+static inline unsigned long long predict_branch(void* state, unsigned int index,
+						instruction_t instr, int* registers,
+						unsigned long long executed)
+{
+  if (instr.opcode >= je && instr.opcode <= jbe)
+    predictor_branch(state, index, instr.immediate < 0, branch_taken(instr.opcode, registers));
+  return 0;
+}
+
+/*
+ * Runs the program through run_hooked, feeding every conditional jump to a predictor of
+ * the given kind, then prints its report. Returns the number of instructions executed.
+*/
+unsigned long long run_predicted(instruction_t* instructions, unsigned int num_instructions,
+				 int* registers, unsigned char* memory, io_t* io, int kind)
+{
+  predictor_t* predictor = predictor_new(kind, num_instructions);
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, predict_branch, NULL, predictor);
+  print_predictions(predictor, instructions);
+  predictor_free(predictor);
+  return executed;
+}
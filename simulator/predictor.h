@@ -0,0 +1,18 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Branch predictor models fed with the outcome of every conditional jump.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+typedef struct predictor predictor_t;
+
+predictor_t* predictor_new(int kind, unsigned int num_instructions);
+void predictor_free(predictor_t* predictor);
+int predictor_branch(predictor_t* predictor, unsigned int index, int backward, int taken);
+void print_predictions(predictor_t* predictor, instruction_t* instructions);
+unsigned long long run_predicted(instruction_t* instructions, unsigned int num_instructions,
+				 int* registers, unsigned char* memory, io_t* io, int kind);
@@ -0,0 +1,281 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Guest execution profiler for the simulator.
+ *
+ * run_profiled counts, per instruction, executions, taken and not-taken conditional jumps,
+ * and memory loads and stores. When the program finishes it writes a report to stderr
+ * with per-opcode totals, the hottest basic blocks, and the branch and memory sites. If
+ * the assembly source is given with --source=, each instruction is shown with its source
+ * line.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "analysis.h"
+#include "memory.h"
+
+#define HOT_BLOCKS 10
+#define HOT_SITES 10
+
+// Counters for one instruction of the program
+typedef struct
+{
+  unsigned long long executed;
+  unsigned long long taken;      // conditional jumps only
+  unsigned long long loads;
+  unsigned long long stores;
+} site_t;
+
+// An instruction with the count it is ranked by
+typedef struct
+{
+  unsigned long long key;
+  unsigned int index;
+} ranked_site_t;
+
+// A basic block, from first up to but not including end
+typedef struct
+{
+  unsigned int first;
+  unsigned int end;
+  unsigned long long entries;
+  unsigned long long executed;
+} block_t;
+
+static const char* opcode_names[] = {
+  "subl", "addl_reg_reg", "addl_imm_reg", "imull", "shrl", "movl_reg_reg",
+  "movl_deref_reg", "movl_reg_deref", "movl_imm_reg", "cmpl", "je", "jl", "jle",
+  "jge", "jbe", "jmp", "call", "ret", "pushl", "popl", "printr", "readr"
+};
+
+/*
+ * Returns the name of an opcode, or "unknown" for opcodes that execute as no-ops
+*/
+static const char* opcode_name(unsigned char opcode)
+{
+  return opcode <= readr ? opcode_names[opcode] : "unknown";
+}
+
+/*
+ * Returns whether the opcode is a conditional jump
+*/
+static int is_conditional(unsigned char opcode)
+{
+  return opcode >= je && opcode <= jbe;
+}
+
+/*
+ * Returns whether the opcode transfers control, ending a basic block
+*/
+static int ends_block(unsigned char opcode)
+{
+  return opcode >= je && opcode <= ret;
+}
+
+/*
+ * Returns the source line of one instruction, or its opcode name without one
+*/
+static const char* site_text(unsigned int index, instruction_t* instructions,
+			     source_line_t* source)
+{
+  if (source != NULL && source[index].text != NULL)
+    return source[index].text;
+  return opcode_name(instructions[index].opcode);
+}
+
+/*
+ * Prints one instruction: its address, execution count and source line or opcode name
+*/
+static void print_site(unsigned int index, instruction_t* instructions, site_t* sites,
+		       source_line_t* source)
+{
+  fprintf(stderr, "  0x%06x %14llu   %s\n", index * 4, sites[index].executed,
+	  site_text(index, instructions, source));
+}
+
+/*
+ * Orders blocks by instructions executed, most first
+*/
+static int compare_blocks(const void* a, const void* b)
+{
+  const block_t* left = a;
+  const block_t* right = b;
+  if (left->executed != right->executed)
+    return left->executed < right->executed ? 1 : -1;
+  return left->first < right->first ? -1 : 1;
+}
+
+/*
+ * Orders ranked instructions by key, most first
+*/
+static int compare_sites(const void* a, const void* b)
+{
+  const ranked_site_t* left = a;
+  const ranked_site_t* right = b;
+  if (left->key != right->key)
+    return left->key < right->key ? 1 : -1;
+  return left->index < right->index ? -1 : 1;
+}
+
+/*
+ * Splits the program into basic blocks and adds up their counts. A block starts at the
+ * program entry, at every jump or call target and after every control transfer.
+*/
+static block_t* find_blocks(instruction_t* instructions, unsigned int num_instructions,
+			    site_t* sites, unsigned int* num_blocks)
+{
+  char* leader = calloc(num_instructions + 1, 1);
+  if (leader == NULL)
+    error_exit("unable to allocate memory for the profile");
+  leader[0] = 1;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    instruction_t instr = instructions[i];
+    if (!ends_block(instr.opcode))
+      continue;
+    leader[i + 1] = 1;
+    long long target = (long long)i * 4 + instr.immediate + 4;
+    if (instr.opcode != ret && target >= 0 && target % 4 == 0 &&
+	target < (long long)num_instructions * 4)
+      leader[target / 4] = 1;
+  }
+
+  block_t* blocks = malloc(sizeof(block_t) * num_instructions);
+  if (blocks == NULL)
+    error_exit("unable to allocate memory for the profile");
+  *num_blocks = 0;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (leader[i]){
+      blocks[*num_blocks].first = i;
+      blocks[*num_blocks].entries = sites[i].executed;
+      blocks[*num_blocks].executed = 0;
+      (*num_blocks)++;
+    }
+    blocks[*num_blocks - 1].end = i + 1;
+    blocks[*num_blocks - 1].executed += sites[i].executed;
+  }
+
+  free(leader);
+  return blocks;
+}
+
+/*
+ * Writes the profile report to stderr
+*/
+static void print_profile(instruction_t* instructions, unsigned int num_instructions,
+			  site_t* sites, unsigned long long executed,
+			  source_line_t* source)
+{
+  unsigned long long opcode_totals[256] = { 0 };
+  for (unsigned int i = 0; i < num_instructions; i++)
+    opcode_totals[instructions[i].opcode] += sites[i].executed;
+
+  fprintf(stderr, "profile: %llu instructions executed\n\n", executed);
+  fprintf(stderr, "%-16s %14s %7s\n", "opcode", "executed", "share");
+  for (int opcode = 0; opcode < 256; opcode++){
+    if (opcode_totals[opcode] == 0)
+      continue;
+    fprintf(stderr, "%-16s %14llu %6.2f%%\n", opcode_name(opcode), opcode_totals[opcode],
+	    100.0 * opcode_totals[opcode] / executed);
+  }
+
+  unsigned int num_blocks;
+  block_t* blocks = find_blocks(instructions, num_instructions, sites, &num_blocks);
+  qsort(blocks, num_blocks, sizeof(block_t), compare_blocks);
+  fprintf(stderr, "\nhot blocks\n");
+  for (unsigned int b = 0; b < num_blocks && b < HOT_BLOCKS && blocks[b].executed > 0; b++){
+    fprintf(stderr, "block 0x%06x-0x%06x: %llu entries, %llu instructions (%.2f%%)\n",
+	    blocks[b].first * 4, blocks[b].end * 4 - 4, blocks[b].entries, blocks[b].executed,
+	    100.0 * blocks[b].executed / executed);
+    for (unsigned int i = blocks[b].first; i < blocks[b].end; i++)
+      print_site(i, instructions, sites, source);
+  }
+  free(blocks);
+
+  // Branch sites by executions, memory sites by accesses
+  ranked_site_t* order = malloc(sizeof(ranked_site_t) * num_instructions);
+  if (num_instructions > 0 && order == NULL)
+    error_exit("unable to allocate memory for the profile");
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    order[i].index = i;
+    order[i].key = is_conditional(instructions[i].opcode) ? sites[i].executed : 0;
+  }
+  qsort(order, num_instructions, sizeof(ranked_site_t), compare_sites);
+  fprintf(stderr, "\n%-10s %14s %14s %14s   %s\n", "branch", "executed", "taken", "not taken",
+	  "instruction");
+  for (unsigned int n = 0; n < num_instructions && n < HOT_SITES && order[n].key > 0; n++){
+    unsigned int i = order[n].index;
+    fprintf(stderr, "  0x%06x %14llu %14llu %14llu   %s\n", i * 4, sites[i].executed,
+	    sites[i].taken, sites[i].executed - sites[i].taken,
+	    site_text(i, instructions, source));
+  }
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    order[i].index = i;
+    order[i].key = sites[i].loads + sites[i].stores;
+  }
+  qsort(order, num_instructions, sizeof(ranked_site_t), compare_sites);
+  fprintf(stderr, "\n%-10s %14s %14s   %s\n", "memory", "loads", "stores", "instruction");
+  for (unsigned int n = 0; n < num_instructions && n < HOT_SITES && order[n].key > 0; n++){
+    unsigned int i = order[n].index;
+    fprintf(stderr, "  0x%06x %14llu %14llu   %s\n", i * 4, sites[i].loads, sites[i].stores,
+	    site_text(i, instructions, source));
+  }
+
+  free(order);
+}
+
+/*
+ * Counts the instruction at index before it runs
+*/
+static inline unsigned long long count_site(void* state, unsigned int index, instruction_t instr,
+					    int* registers, unsigned long long executed)
+{
+  site_t* site = (site_t*)state + index;
+
+  // Decided before the instruction runs, so a jump to the next instruction still counts
+  if (is_conditional(instr.opcode) && branch_taken(instr.opcode, registers))
+    site->taken++;
+  switch (instr.opcode)
+  {
+  case movl_deref_reg:
+  case popl:
+    site->loads++;
+    break;
+  case ret:
+    if ((unsigned int)registers[ESP_REG] != memory_size)
+      site->loads++;
+    break;
+  case movl_reg_deref:
+  case pushl:
+  case call:
+    site->stores++;
+    break;
+  }
+  site->executed++;
+  return 0;
+}
+
+/*
+ * Runs the program through run_hooked, counting per instruction, then prints the
+ * report. Returns the number of instructions executed.
+*/
+unsigned long long run_profiled(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				const char* source_name)
+{
+  source_line_t* source = read_source(source_name, num_instructions);
+  site_t* sites = calloc(num_instructions, sizeof(site_t));
+  if (num_instructions > 0 && sites == NULL)
+    error_exit("unable to allocate memory for the profile");
+
+  unsigned long long executed = run_hooked(instructions, num_instructions, registers, memory,
+					   io, count_site, NULL, sites);
+  print_profile(instructions, num_instructions, sites, executed, source);
+
+  free_source(source, num_instructions);
+  free(sites);
+  return executed;
+}
@@ -0,0 +1,13 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Per-PC execution profiler with hot blocks, branch sites and memory sites.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+unsigned long long run_profiled(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				const char* source_name);
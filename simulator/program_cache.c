@@ -0,0 +1,205 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Decoded-program cache for the simulator.
+ *
+ * Every run decodes its binary, and fuses it for the threaded engine with --fuse. With
+ * --cache=DIR the result is kept in DIR, one file per binary and pass set, named by a hash
+ * of the binary's bytes. A later run of the same binary maps that file and runs the
+ * instructions in it in place, skipping decode_instructions and fuse_instructions.
+ *
+ * File layout, native byte order:
+ *   cache_header_t   magic, checksum, version, what the file holds, fusion site counts
+ *   instructions     num_instructions instruction_t, exactly as they are in memory
+ *   binary           the num_instructions * 4 bytes they were decoded from
+ * The checksum covers everything after it, so a truncated or damaged file, or one written
+ * by a different version, is rebuilt instead of run. The hash in the name is not
+ * collision resistant, so a file is only used for a binary whose bytes are the ones it
+ * holds, compared in full. Files are written under a temporary name and renamed into
+ * place, so a concurrent run never maps a partial file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "program_cache.h"
+
+#define CACHE_MAGIC "SIMCACHE"
+
+typedef struct
+{
+  char magic[8];
+  unsigned long long checksum;             // hash of the file from version on
+  unsigned int version;                    // PROGRAM_CACHE_VERSION
+  unsigned int instruction_size;           // sizeof(instruction_t) of the writer
+  unsigned int num_instructions;
+  unsigned int fused;                      // rewritten by fuse_instructions
+  unsigned long long key;                  // hash of the binary
+  unsigned int fusion_sites[NUM_FUSIONS];  // sequences fuse_instructions rewrote
+} cache_header_t;
+
+#define CHECKED_FROM offsetof(cache_header_t, version)
+
+// Multipliers of xxHash64
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static unsigned long long rotate(unsigned long long value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/*
+ * Returns a 64-bit hash of the bytes. Four independent lanes in the style of xxHash64
+ * take 32 bytes per step, so hashing a binary costs far less than decoding it.
+*/
+static unsigned long long hash_bytes(const void* bytes, size_t length)
+{
+  const unsigned char* data = bytes;
+  unsigned long long lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32){
+    for (int lane = 0; lane < 4; lane++){
+      unsigned long long word;
+      memcpy(&word, data + i + lane * 8, 8);
+      lanes[lane] = rotate(lanes[lane] + word * PRIME2, 31) * PRIME1;
+    }
+  }
+
+  unsigned long long hash = length;
+  for (int lane = 0; lane < 4; lane++)
+    hash = rotate(hash ^ lanes[lane], 27) * PRIME1 + PRIME2;
+  for (; i < length; i++)
+    hash = rotate(hash ^ (data[i] * PRIME1), 11) * PRIME2;
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+/*
+ * Returns the size of the cache file of a binary of num_instructions instructions
+*/
+static size_t cache_size(unsigned int num_instructions)
+{
+  return sizeof(cache_header_t) + (size_t)num_instructions * (sizeof(instruction_t) + 4);
+}
+
+/*
+ * Writes the name of the cache file for a binary with the given key to path
+*/
+static void cache_path(char* path, size_t size, const char* cache_dir, unsigned long long key,
+		       int fused)
+{
+  snprintf(path, size, "%s/%016llx-%s.simc", cache_dir, key, fused ? "fused" : "plain");
+}
+
+/*
+ * Returns the instructions cached for the binary, fused or not, mapped from the cache file
+ * with the size of the mapping in mapping_size. Returns NULL if there is no valid file.
+ * The fusion site counts of a fused program are added up as fusing it would have.
+*/
+instruction_t* load_cached_program(const char* cache_dir, const unsigned int* bytes,
+				   unsigned int num_instructions, int fused, size_t* mapping_size)
+{
+  unsigned long long key = hash_bytes(bytes, (size_t)num_instructions * 4);
+  char path[4096];
+  cache_path(path, sizeof(path), cache_dir, key, fused);
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1)
+    return NULL;
+
+  size_t size = cache_size(num_instructions);
+  struct stat info;
+  if (fstat(file_descriptor, &info) != 0 || info.st_size != size){
+    close(file_descriptor);
+    return NULL;
+  }
+
+  // Private and writable, so the program can still be changed in memory like a decoded one
+  unsigned char* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				file_descriptor, 0);
+  close(file_descriptor);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  cache_header_t* header = (cache_header_t*)mapping;
+  if (memcmp(header->magic, CACHE_MAGIC, 8) != 0 || header->version != PROGRAM_CACHE_VERSION ||
+      header->instruction_size != sizeof(instruction_t) ||
+      header->num_instructions != num_instructions || header->fused != fused ||
+      header->key != key || header->checksum != hash_bytes(mapping + CHECKED_FROM,
+							    size - CHECKED_FROM) ||
+      memcmp(mapping + size - (size_t)num_instructions * 4, bytes,
+	     (size_t)num_instructions * 4) != 0){
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  for (int i = 0; i < NUM_FUSIONS; i++)
+    fusion_sites[i] += header->fusion_sites[i];
+  *mapping_size = size;
+  return (instruction_t*)(mapping + sizeof(cache_header_t));
+}
+
+/*
+ * Unmaps instructions returned by load_cached_program
+*/
+void free_cached_program(instruction_t* instructions, size_t mapping_size)
+{
+  munmap((unsigned char*)instructions - sizeof(cache_header_t), mapping_size);
+}
+
+/*
+ * Writes the decoded, and maybe fused, instructions of the binary to the cache, with the
+ * fusion site counts of fusing it. The cache only saves time, so a directory that cannot
+ * be written leaves the run as it is.
+*/
+void store_cached_program(const char* cache_dir, const unsigned int* bytes,
+			  unsigned int num_instructions, int fused, instruction_t* instructions,
+			  const unsigned int* sites)
+{
+  size_t size = cache_size(num_instructions);
+  size_t binary_size = (size_t)num_instructions * 4;
+  unsigned char* file = calloc(size, 1);
+  if (file == NULL)
+    return;
+
+  cache_header_t* header = (cache_header_t*)file;
+  memcpy(header->magic, CACHE_MAGIC, 8);
+  header->version = PROGRAM_CACHE_VERSION;
+  header->instruction_size = sizeof(instruction_t);
+  header->num_instructions = num_instructions;
+  header->fused = fused;
+  header->key = hash_bytes(bytes, binary_size);
+  memcpy(header->fusion_sites, sites, sizeof(header->fusion_sites));
+  memcpy(file + sizeof(cache_header_t), instructions,
+	 (size_t)num_instructions * sizeof(instruction_t));
+  memcpy(file + size - binary_size, bytes, binary_size);
+  header->checksum = hash_bytes(file + CHECKED_FROM, size - CHECKED_FROM);
+
+  char path[4096];
+  char temporary[4096 + 32];
+  cache_path(path, sizeof(path), cache_dir, header->key, fused);
+  snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, (int)getpid());
+  mkdir(cache_dir, 0777);
+
+  int file_descriptor = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file_descriptor != -1){
+    size_t written = 0;
+    while (written < size){
+      ssize_t count = write(file_descriptor, file + written, size - written);
+      if (count <= 0)
+	break;
+      written += count;
+    }
+    close(file_descriptor);
+    if (written != size || rename(temporary, path) != 0)
+      unlink(temporary);
+  }
+  free(file);
+}
@@ -0,0 +1,22 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * On-disk cache of decoded programs, keyed by a hash of the binary and checked against
+ * its bytes.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include "simulator.h"
+
+// Bump whenever instruction_t, decode_instruction, fuse_instructions or the file layout
+// changes
+#define PROGRAM_CACHE_VERSION 2
+
+instruction_t* load_cached_program(const char* cache_dir, const unsigned int* bytes,
+				   unsigned int num_instructions, int fused, size_t* mapping_size);
+void free_cached_program(instruction_t* instructions, size_t mapping_size);
+void store_cached_program(const char* cache_dir, const unsigned int* bytes,
+			  unsigned int num_instructions, int fused, instruction_t* instructions,
+			  const unsigned int* sites);
@@ -7,6 +7,7 @@
 # This script runs a simulator on the provided tests
 
 NUM_PASSED=0
+NUM_TESTS=0
 
 if [ ! -f simulator ]
 then
@@ -19,25 +20,62 @@ fi
 
 BINARIES="tests/simple/subl.o tests/simple/addl_imm_reg.o tests/simple/movl_imm.o tests/simple/movl_reg_reg.o tests/simple/addl_reg_reg.o tests/simple/imull.o tests/simple/simple_return.o tests/simple/jmp.o tests/simple/shrl.o tests/moderate/movl_deref.o tests/moderate/movl_deref2.o tests/moderate/unaligned1.o tests/moderate/unaligned2.o tests/moderate/pushpop.o tests/moderate/callret.o tests/moderate/callret2.o tests/moderate/stack_multibyte.o tests/moderate/cmpl.o tests/moderate/je.o tests/moderate/jl.o tests/moderate/jle.o tests/moderate/jge.o tests/moderate/jbe.o tests/complex/factorial.o tests/complex/log2.o tests/complex/sort.o"
 
+# the tests in tests/modes exercise the simulator's options: X.args holds the options
+# X.o runs with, and X.status the exit status it must have if that is not 0. The analysis
+# modes report on stderr, so these tests compare both streams. They run in name order,
+# which the checkpoint and cache tests rely on: restore resumes from the checkpoint
+# checkpoint leaves behind, and cache_hit must find the program cache put in the cache
+BINARIES="$BINARIES $(ls tests/modes/*.o)"
+rm -rf temp_checkpoint.bin temp_cache
+
+# the server tests send their programs to a server started here
+if [ -f tests/modes/server.o ]
+then
+    ./simulator --serve=temp_server.sock &
+    SERVER=$!
+    for i in $(seq 50)
+    do
+	[ -S temp_server.sock ] && break
+	sleep 0.1
+    done
+fi
+
 for BINARY in $BINARIES
 do
     pathname=${BINARY%.*}
     testname=${BINARY##*/}
     testname=${testname%.*}
+    let NUM_TESTS=NUM_TESTS+1
     echo
     echo "Testing $testname"
 
+    ARGS=""
+    if [ -f $pathname.args ]
+    then
+	ARGS=$(cat $pathname.args)
+    fi
+    STATUS=0
+    if [ -f $pathname.status ]
+    then
+	STATUS=$(cat $pathname.status)
+    fi
+
+    INPUT=/dev/null
     if [ -f $pathname.in ]
     then
-	./simulator $BINARY < $pathname.in > temp_output.txt
+	INPUT=$pathname.in
+    fi
+    if [ -f $pathname.args ]
+    then
+	./simulator $ARGS $BINARY < $INPUT > temp_output.txt 2>&1
     else
-	./simulator $BINARY > temp_output.txt
+	./simulator $ARGS $BINARY < $INPUT > temp_output.txt
     fi
 
-    if [ $? -ne 0 ]
+    if [ $? -ne $STATUS ]
     then
 	echo "FAIL"
-	echo "simulator returned non-zero exit status"
+	echo "simulator returned exit status other than $STATUS"
 	continue
     fi
 
@@ -65,9 +103,11 @@ do
     fi
 done
 
-if [ -f temp_output.txt ]
+if [ -n "$SERVER" ]
 then
-    rm temp_output.txt
+    kill $SERVER
+    wait $SERVER 2> /dev/null
 fi
+rm -rf temp_output.txt temp_checkpoint.bin temp_cache temp_server.sock
 
-echo "Passed $NUM_PASSED / 26 tests"
+echo "Passed $NUM_PASSED / $NUM_TESTS tests"
@@ -0,0 +1,533 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Server mode for the simulator.
+ *
+ * Starting a process and decoding the binary cost more than running a small test program,
+ * so a farm submitting many of them can keep one server running instead. It listens on a
+ * Unix-domain socket and takes one request per connection: a program and the bytes readr
+ * should read. The main thread accepts connections into a queue, and a pool of worker
+ * threads takes them from it. Decoded programs are cached by a hash of their bytes, so a
+ * program sent again runs without being decoded again. The printr output is streamed
+ * back in frames as the run produces it, followed by the exit status.
+ *
+ * A program that fails (its program counter leaves the program, say) fails only its own
+ * request: error_exit jumps back into the worker, which sends the "Error: ..." line and
+ * exit status 1, as the simulator itself would print and exit with. Nothing a request
+ * does ends the server: a request longer than MAX_PROGRAM_LENGTH or MAX_INPUT_LENGTH, or
+ * one the server has no memory for, gets the same kind of answer.
+ *
+ * Nor can a request hold a worker forever: a program still running after
+ * MAX_REQUEST_INSTRUCTIONS instructions fails. Requests therefore run with a budget, which
+ * only the switch engine's execute_instruction loop can keep to, so the server has no
+ * engine option.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "simulator.h"
+#include "server.h"
+
+// Decoded programs kept, each in the slot its hash selects
+#define CACHE_SLOTS 1024
+// Accepted connections waiting for a worker
+#define QUEUE_SIZE 256
+
+typedef struct
+{
+  unsigned long long hash;
+  unsigned char* bytes;        // to tell programs with the same hash apart
+  unsigned int length;
+  sim_program_t* program;
+  int users;                   // requests running it, plus one while it is in the cache
+} cached_program_t;
+
+typedef struct
+{
+  int queue[QUEUE_SIZE];       // accepted connections, a ring
+  int queue_head;
+  int queue_length;
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_not_empty;
+  pthread_cond_t queue_not_full;
+
+  cached_program_t* cache[CACHE_SLOTS];
+  pthread_mutex_t cache_lock;  // protects cache and every users count
+
+  // Counters for REQUEST_STATS, updated with atomic adds
+  unsigned long long requests;
+  unsigned long long failed;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+  unsigned long long executed;
+  int num_threads;
+  double start;
+  double last_stats;           // when REQUEST_STATS was last answered
+  unsigned long long last_requests;
+} server_t;
+
+/*
+ * Returns a monotonic timestamp in seconds
+*/
+static double now_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Writes all length bytes to the socket. Returns 0, or -1 if the peer has gone away.
+*/
+static int send_all(int socket, const void* buffer, size_t length)
+{
+  const char* bytes = buffer;
+  while (length > 0){
+    ssize_t sent = send(socket, bytes, length, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return -1;
+    bytes += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+/*
+ * Reads exactly length bytes from the socket. Returns 0, or -1 if it closes first.
+*/
+static int receive_all(int socket, void* buffer, size_t length)
+{
+  char* bytes = buffer;
+  while (length > 0){
+    ssize_t received = recv(socket, bytes, length, 0);
+    if (received <= 0)
+      return -1;
+    bytes += received;
+    length -= received;
+  }
+  return 0;
+}
+
+/*
+ * Sends one response frame followed by length bytes of data
+*/
+static int send_frame(int socket, unsigned int kind, const void* data, unsigned int length)
+{
+  response_frame_t frame = { kind, length };
+  if (send_all(socket, &frame, sizeof(frame)) != 0)
+    return -1;
+  return data == NULL ? 0 : send_all(socket, data, length);
+}
+
+/*
+ * Write function of the stream a run prints to: every write goes to the client as a frame
+*/
+static ssize_t write_output(void* cookie, const char* buffer, size_t length)
+{
+  if (send_frame(*(int*)cookie, RESPONSE_OUTPUT, buffer, length) != 0)
+    return -1;
+  return length;
+}
+
+/*
+ * Returns the 64-bit FNV-1a hash of the bytes
+*/
+static unsigned long long hash_bytes(const unsigned char* bytes, unsigned int length)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (unsigned int i = 0; i < length; i++){
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/*
+ * Drops one user of a cached program, freeing it with the last one.
+ * Called with the cache lock held.
+*/
+static void release_program(cached_program_t* cached)
+{
+  if (--cached->users > 0)
+    return;
+  sim_program_free(cached->program);
+  free(cached->bytes);
+  free(cached);
+}
+
+/*
+ * Returns the decoded program for the bytes, from the cache or decoded and added to it,
+ * or NULL if they are not a valid program. The caller releases it when the run is over.
+ * Runs under the request's error handler.
+*/
+static cached_program_t* find_program(server_t* server, unsigned char* bytes, unsigned int length)
+{
+  unsigned long long hash = hash_bytes(bytes, length);
+  unsigned int slot = hash % CACHE_SLOTS;
+
+  pthread_mutex_lock(&server->cache_lock);
+  cached_program_t* cached = server->cache[slot];
+  if (cached != NULL && cached->hash == hash && cached->length == length &&
+      memcmp(cached->bytes, bytes, length) == 0){
+    cached->users++;
+    pthread_mutex_unlock(&server->cache_lock);
+    __atomic_fetch_add(&server->cache_hits, 1, __ATOMIC_RELAXED);
+    return cached;
+  }
+  pthread_mutex_unlock(&server->cache_lock);
+  __atomic_fetch_add(&server->cache_misses, 1, __ATOMIC_RELAXED);
+
+  // Decode without the lock, other workers keep going meanwhile
+  sim_program_t* program = sim_load(bytes, length);
+  if (program == NULL)
+    return NULL;
+  cached = malloc(sizeof(cached_program_t));
+  if (cached == NULL){
+    sim_program_free(program);
+    error_exit("unable to allocate memory for the program cache");
+  }
+  cached->hash = hash;
+  cached->bytes = bytes;
+  cached->length = length;
+  cached->program = program;
+  cached->users = 2;
+
+  // The program takes over the slot, the one there before goes once its runs are over
+  pthread_mutex_lock(&server->cache_lock);
+  if (server->cache[slot] != NULL)
+    release_program(server->cache[slot]);
+  server->cache[slot] = cached;
+  pthread_mutex_unlock(&server->cache_lock);
+  return cached;
+}
+
+/*
+ * Answers REQUEST_STATS with the server's counters as text
+*/
+static void send_stats(server_t* server, int socket)
+{
+  double now = now_seconds();
+  unsigned long long requests = __atomic_load_n(&server->requests, __ATOMIC_RELAXED);
+  unsigned long long hits = __atomic_load_n(&server->cache_hits, __ATOMIC_RELAXED);
+  unsigned long long misses = __atomic_load_n(&server->cache_misses, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&server->queue_lock);
+  int queue_depth = server->queue_length;
+  double interval = now - server->last_stats;
+  unsigned long long interval_requests = requests - server->last_requests;
+  server->last_stats = now;
+  server->last_requests = requests;
+  pthread_mutex_unlock(&server->queue_lock);
+
+  char text[1024];
+  int length = snprintf(text, sizeof(text),
+			"uptime %.1f s\n"
+			"requests %llu (%llu failed)\n"
+			"requests/s %.1f overall, %.1f since the last stats request\n"
+			"cache hits %llu, misses %llu (%.1f%% hit rate)\n"
+			"queue depth %d, workers %d\n"
+			"instructions %llu\n",
+			now - server->start,
+			requests, __atomic_load_n(&server->failed, __ATOMIC_RELAXED),
+			requests / (now - server->start),
+			interval > 0 ? interval_requests / interval : 0.0,
+			hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+			queue_depth, server->num_threads,
+			__atomic_load_n(&server->executed, __ATOMIC_RELAXED));
+  send_frame(socket, RESPONSE_OUTPUT, text, length);
+  send_frame(socket, RESPONSE_EXIT, NULL, 0);
+}
+
+/*
+ * Answers a request that cannot run with the "Error: ..." line the simulator would print.
+ * Returns the exit status that goes with it.
+*/
+static int send_error(int socket, const char* message)
+{
+  char text[256];
+  int length = snprintf(text, sizeof(text), "Error: %s\n", message);
+  send_frame(socket, RESPONSE_OUTPUT, text, length);
+  return 1;
+}
+
+/*
+ * Runs one program on its input, streaming the output to the client, and takes over
+ * program_bytes. Returns the exit status the simulator would have.
+*/
+static int serve_run(server_t* server, int socket, unsigned char* program_bytes,
+		     unsigned int program_length, unsigned char* input, unsigned int input_length)
+{
+  cookie_io_functions_t output_functions = { NULL, write_output, NULL, NULL };
+  FILE* out = fopencookie(&socket, "w", output_functions);
+  FILE* in = fmemopen(input, input_length, "r");
+  if (out == NULL || in == NULL){
+    if (out != NULL)
+      fclose(out);
+    if (in != NULL)
+      fclose(in);
+    free(program_bytes);
+    return send_error(socket, "unable to open streams for a request");
+  }
+  setvbuf(out, NULL, _IONBF, 0);
+
+  // Everything from decoding on runs under the handler, a failure anywhere fails the request
+  int status = 0;
+  cached_program_t* volatile cached = NULL;
+  sim_ctx_t* volatile ctx = NULL;
+  jmp_buf handler;
+  if (setjmp(handler) == 0){
+    error_handler = &handler;
+    cached = find_program(server, program_bytes, program_length);
+    if (cached == NULL)
+      error_exit("invalid input file");
+    ctx = sim_ctx_new(cached->program, ENGINE_SWITCH);
+    sim_set_files(ctx, in, out);
+    int state = sim_run(ctx, MAX_REQUEST_INSTRUCTIONS);
+    __atomic_fetch_add(&server->executed, sim_executed(ctx), __ATOMIC_RELAXED);
+    if (state == SIM_RUNNING)
+      error_exit("instruction budget exceeded");
+  }
+  else
+    status = 1;
+  error_handler = NULL;
+
+  // Freeing the context flushes its output, so whatever the program printed so far comes
+  // before the message. The engine has already freed its own allocations, see
+  // release_on_error.
+  if (ctx != NULL)
+    sim_ctx_free(ctx);
+  if (status != 0)
+    fprintf(out, "Error: %s\n", error_message);
+  if (cached == NULL || cached->bytes != program_bytes)
+    free(program_bytes);
+  if (cached != NULL){
+    pthread_mutex_lock(&server->cache_lock);
+    release_program(cached);
+    pthread_mutex_unlock(&server->cache_lock);
+  }
+
+  fclose(in);
+  fclose(out);
+  return status;
+}
+
+/*
+ * Receives the program and input of a REQUEST_RUN and runs them. Returns the exit status
+ * to send, or -1 if the client went away before sending all of it.
+*/
+static int serve_request(server_t* server, int socket, request_header_t* header)
+{
+  // Checked before allocating anything, which also keeps the + 1 below from wrapping
+  if (header->program_length > MAX_PROGRAM_LENGTH || header->input_length > MAX_INPUT_LENGTH)
+    return send_error(socket, "request too large");
+
+  unsigned char* program_bytes = malloc(header->program_length + 1);
+  unsigned char* input = malloc(header->input_length + 1);
+  if (program_bytes == NULL || input == NULL){
+    free(program_bytes);
+    free(input);
+    return send_error(socket, "unable to allocate memory for a request");
+  }
+  if (receive_all(socket, program_bytes, header->program_length) != 0 ||
+      receive_all(socket, input, header->input_length) != 0){
+    free(program_bytes);
+    free(input);
+    return -1;
+  }
+
+  int status = serve_run(server, socket, program_bytes, header->program_length,
+			 input, header->input_length);
+  free(input);
+  return status;
+}
+
+/*
+ * Reads the request on a connection, answers it, and closes the connection
+*/
+static void serve_connection(server_t* server, int socket)
+{
+  request_header_t header;
+  if (receive_all(socket, &header, sizeof(header)) != 0){
+    close(socket);
+    return;
+  }
+
+  if (header.kind == REQUEST_STATS){
+    send_stats(server, socket);
+    close(socket);
+    return;
+  }
+
+  int status = header.kind == REQUEST_RUN ? serve_request(server, socket, &header) : -1;
+  if (status != -1){
+    send_frame(socket, RESPONSE_EXIT, NULL, status);
+    __atomic_fetch_add(&server->requests, 1, __ATOMIC_RELAXED);
+    if (status != 0)
+      __atomic_fetch_add(&server->failed, 1, __ATOMIC_RELAXED);
+  }
+  close(socket);
+}
+
+/*
+ * Worker thread: serves queued connections, forever
+*/
+static void* server_worker(void* arg)
+{
+  server_t* server = arg;
+  for (;;){
+    pthread_mutex_lock(&server->queue_lock);
+    while (server->queue_length == 0)
+      pthread_cond_wait(&server->queue_not_empty, &server->queue_lock);
+    int socket = server->queue[server->queue_head];
+    server->queue_head = (server->queue_head + 1) % QUEUE_SIZE;
+    server->queue_length--;
+    pthread_cond_signal(&server->queue_not_full);
+    pthread_mutex_unlock(&server->queue_lock);
+
+    serve_connection(server, socket);
+  }
+  return NULL;
+}
+
+/*
+ * Listens on the Unix-domain socket socket_name, replacing any socket file already there,
+ * and serves requests on num_threads workers. Does not return.
+*/
+void run_server(const char* socket_name, int num_threads)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(address.sun_path))
+    error_exit("socket path too long");
+  strcpy(address.sun_path, socket_name);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == -1)
+    error_exit("unable to create socket");
+  unlink(socket_name);
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, QUEUE_SIZE) != 0)
+    error_exit("unable to listen on socket");
+
+  server_t* server = calloc(1, sizeof(server_t));
+  if (server == NULL)
+    error_exit("unable to allocate memory for the server");
+  server->num_threads = num_threads < 1 ? 1 : num_threads;
+  server->start = server->last_stats = now_seconds();
+  pthread_mutex_init(&server->queue_lock, NULL);
+  pthread_cond_init(&server->queue_not_empty, NULL);
+  pthread_cond_init(&server->queue_not_full, NULL);
+  pthread_mutex_init(&server->cache_lock, NULL);
+
+  for (int i = 0; i < server->num_threads; i++){
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_worker, server) != 0)
+      error_exit("unable to start server thread");
+    pthread_detach(thread);
+  }
+
+  for (;;){
+    int socket = accept(listener, NULL, NULL);
+    if (socket == -1)
+      continue;
+
+    pthread_mutex_lock(&server->queue_lock);
+    while (server->queue_length == QUEUE_SIZE)
+      pthread_cond_wait(&server->queue_not_full, &server->queue_lock);
+    server->queue[(server->queue_head + server->queue_length) % QUEUE_SIZE] = socket;
+    server->queue_length++;
+    pthread_cond_signal(&server->queue_not_empty);
+    pthread_mutex_unlock(&server->queue_lock);
+  }
+}
+
+/*
+ * Reads everything from file into a new buffer and stores its size in length
+*/
+static unsigned char* read_all(FILE* file, unsigned int* length)
+{
+  size_t capacity = 65536;
+  size_t size = 0;
+  unsigned char* buffer = malloc(capacity);
+  if (buffer == NULL)
+    error_exit("unable to allocate memory for a request");
+  size_t count;
+  while ((count = fread(buffer + size, 1, capacity - size, file)) > 0){
+    size += count;
+    if (size == capacity){
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+      if (buffer == NULL)
+	error_exit("unable to allocate memory for a request");
+    }
+  }
+  *length = size;
+  return buffer;
+}
+
+/*
+ * Sends the binary with stdin as its input to the server at socket_name, or asks for the
+ * server's counters if binary_name is NULL, and copies the output to stdout.
+ * Returns the exit status of the run.
+*/
+int run_client(const char* socket_name, const char* binary_name)
+{
+  request_header_t header = { REQUEST_STATS, 0, 0 };
+  unsigned char* program_bytes = NULL;
+  unsigned char* input = NULL;
+  if (binary_name != NULL){
+    FILE* binary = fopen(binary_name, "rb");
+    if (binary == NULL)
+      error_exit("unable to open input file");
+    header.kind = REQUEST_RUN;
+    program_bytes = read_all(binary, &header.program_length);
+    fclose(binary);
+    input = read_all(stdin, &header.input_length);
+    if (header.program_length > MAX_PROGRAM_LENGTH || header.input_length > MAX_INPUT_LENGTH)
+      error_exit("request too large");
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(address.sun_path))
+    error_exit("socket path too long");
+  strcpy(address.sun_path, socket_name);
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server == -1 || connect(server, (struct sockaddr*)&address, sizeof(address)) != 0)
+    error_exit("unable to connect to server");
+  if (send_all(server, &header, sizeof(header)) != 0 ||
+      send_all(server, program_bytes, header.program_length) != 0 ||
+      send_all(server, input, header.input_length) != 0)
+    error_exit("unable to send request");
+  free(program_bytes);
+  free(input);
+
+  char buffer[65536];
+  response_frame_t frame;
+  for (;;){
+    if (receive_all(server, &frame, sizeof(frame)) != 0)
+      error_exit("server closed the connection");
+    if (frame.kind == RESPONSE_EXIT)
+      break;
+    while (frame.length > 0){
+      unsigned int chunk = frame.length < sizeof(buffer) ? frame.length : sizeof(buffer);
+      if (receive_all(server, buffer, chunk) != 0)
+	error_exit("server closed the connection");
+      fwrite(buffer, 1, chunk, stdout);
+      frame.length -= chunk;
+    }
+    fflush(stdout);
+  }
+  close(server);
+  return frame.length;
+}
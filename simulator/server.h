@@ -0,0 +1,44 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Server mode: a daemon that runs programs sent over a Unix-domain socket, and the client
+ * that sends them.
+*/
+
+#pragma once
+
+// Longest program and input, in bytes, a request can carry
+#define MAX_PROGRAM_LENGTH (64 << 20)
+#define MAX_INPUT_LENGTH (64 << 20)
+// Most instructions a request may run, so a program that never halts cannot hold a worker
+#define MAX_REQUEST_INSTRUCTIONS 1000000000ULL
+
+// What a request asks for
+enum request_kinds{
+  REQUEST_RUN = 1,   // run the program that follows on the input that follows it
+  REQUEST_STATS      // report the server's counters
+};
+
+// What a response frame carries
+enum response_kinds{
+  RESPONSE_OUTPUT = 1, // printr output, length bytes of it
+  RESPONSE_EXIT        // the run is over, length is the exit status
+};
+
+// Sent by the client ahead of the program bytes and the input bytes
+typedef struct
+{
+  unsigned int kind;
+  unsigned int program_length;
+  unsigned int input_length;
+} request_header_t;
+
+// The server answers with any number of output frames and then one exit frame
+typedef struct
+{
+  unsigned int kind;
+  unsigned int length;
+} response_frame_t;
+
+void run_server(const char* socket_name, int num_threads);
+int run_client(const char* socket_name, const char* binary_name);
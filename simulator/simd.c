@@ -0,0 +1,350 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Lane-parallel engine for the simulator.
+ *
+ * Up to SIMD_LANES independent machines run the same program on different inputs. The
+ * register file is kept as structure of arrays, registers[r][lane], using GCC vector types,
+ * so arithmetic, moves and cmpl execute for every lane with one vector operation. Like
+ * decode_bulk, run_simd is built twice, for AVX2 and for plain x86-64, where each vector
+ * is a pair of SSE2 registers, and the loader picks one for the CPU. The helpers it calls
+ * with vectors are always inlined, so each build gets its own copy of them. Memory
+ * accesses and I/O go lane by lane.
+ *
+ * While all live lanes are at the same PC they step together. When a branch or ret sends
+ * them to different PCs, the group of lanes at the lowest PC runs next with the others
+ * masked off, until the lanes meet at a common PC again.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "simulator.h"
+#include "simd.h"
+#include "memory.h"
+
+typedef int lanes_t __attribute__((vector_size(SIMD_LANES * sizeof(int))));
+typedef unsigned int ulanes_t __attribute__((vector_size(SIMD_LANES * sizeof(int))));
+
+// value in the lanes selected by mask (all ones) and old in the others. The helpers never
+// take or return a vector by value, whose ABI differs between the two builds, so this one
+// is a macro.
+#define BLEND(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+
+/*
+ * Stores in taken, per lane, all ones where the conditional jump opcode is taken
+*/
+static inline __attribute__((always_inline))
+void lanes_taken(lanes_t* taken, unsigned char opcode, lanes_t* registers)
+{
+  lanes_t left = registers[CMP_LEFT];
+  lanes_t right = registers[CMP_RIGHT];
+  lanes_t flags = registers[EFLAGS_REG];
+  lanes_t lazy = { 0 };
+  lanes_t current = { 0 };
+
+  lanes_t ZF = (flags & ZF_FLAG) != 0;
+  lanes_t SF_xor_OF = ((flags & SF_FLAG) != 0) ^ ((flags & OF_FLAG) != 0);
+  switch(opcode)
+  {
+  case je:
+    lazy = left == right;
+    current = ZF;
+    break;
+  case jl:
+    lazy = left < right;
+    current = SF_xor_OF;
+    break;
+  case jle:
+    lazy = left <= right;
+    current = SF_xor_OF | ZF;
+    break;
+  case jge:
+    lazy = left >= right;
+    current = ~SF_xor_OF;
+    break;
+  case jbe:
+    lazy = (ulanes_t)left <= (ulanes_t)right;
+    current = ((flags & CF_FLAG) != 0) | ZF;
+    break;
+  }
+  lanes_t pending = registers[FLAGS_PENDING] != 0;
+  *taken = BLEND(pending, lazy, current);
+}
+
+/*
+ * Brings %eflags up to date in the lanes selected by mask
+*/
+static inline __attribute__((always_inline))
+void materialize_lanes(lanes_t* registers, const lanes_t* mask)
+{
+  for (int lane = 0; lane < SIMD_LANES; lane++){
+    if (!(*mask)[lane] || !registers[FLAGS_PENDING][lane])
+      continue;
+    int scalar[REGISTER_FILE_SIZE];
+    for (int r = 0; r < REGISTER_FILE_SIZE; r++)
+      scalar[r] = registers[r][lane];
+    materialize_flags(scalar);
+    registers[EFLAGS_REG][lane] = scalar[EFLAGS_REG];
+    registers[FLAGS_PENDING][lane] = 0;
+  }
+}
+
+/*
+ * Frees the guest memory of every lane, memory is the array of them
+*/
+static void free_lanes(void* memory)
+{
+  for (int lane = 0; lane < SIMD_LANES; lane++)
+    memory_free(((unsigned char**)memory)[lane]);
+}
+
+/*
+ * Runs the program on num_lanes machines at once, with io[lane] as each lane's input and
+ * output. The machines are fresh, or copies of start if it is not NULL.
+ * Returns the number of instructions executed over all lanes.
+*/
+__attribute__((target_clones("avx2", "default")))
+unsigned long long run_simd(instruction_t* instructions, unsigned int num_instructions,
+			    io_t* io, int num_lanes, checkpoint_t* start)
+{
+  unsigned int end_pc = num_instructions * 4;
+  unsigned int start_pc = start != NULL ? start->program_counter : 0;
+  if (start_pc == end_pc || start_pc == HALT_PC)
+    return 0;
+
+  lanes_t registers[REGISTER_FILE_SIZE];
+  unsigned char* memory[SIMD_LANES];
+  for (int lane = 0; lane < SIMD_LANES; lane++)
+    memory[lane] = memory_new();
+  release_on_error(free_lanes, memory);
+  unsigned int last = memory_size - 4;
+  for (int r = 0; r < REGISTER_FILE_SIZE; r++)
+    registers[r] = (lanes_t){ 0 };
+  registers[ESP_REG] += (int)memory_size;
+  if (start != NULL){
+    for (int r = 0; r < REGISTER_FILE_SIZE; r++)
+      registers[r] = (lanes_t){ 0 } + start->registers[r];
+    for (int lane = 0; lane < num_lanes; lane++)
+      memory_copy(memory[lane], start->memory);
+  }
+
+  unsigned int pcs[SIMD_LANES];  // per-lane PC, only kept up to date while diverged
+  lanes_t active = { 0 };
+  for (int lane = 0; lane < num_lanes; lane++){
+    active[lane] = -1;
+    pcs[lane] = start_pc;
+  }
+
+  int converged = 1;
+  unsigned int common_pc = start_pc;
+  int live = num_lanes;
+  unsigned long long executed = 0;
+
+  while (1)
+  {
+    // Pick the PC to run and the lanes that are at it
+    unsigned int program_counter;
+    lanes_t mask;
+    if (converged){
+      program_counter = common_pc;
+      mask = active;
+    }
+    else{
+      program_counter = HALT_PC;
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (active[lane] && pcs[lane] < program_counter)
+	  program_counter = pcs[lane];
+      }
+      for (int lane = 0; lane < SIMD_LANES; lane++)
+	mask[lane] = active[lane] && pcs[lane] == program_counter ? -1 : 0;
+    }
+
+    if (program_counter % 4 != 0 || program_counter >= end_pc)
+      error_exit("program counter out of range");
+
+    instruction_t instr = instructions[program_counter / 4];
+    lanes_t* reg1 = &registers[instr.first_register];
+    lanes_t* reg2 = &registers[instr.second_register];
+    lanes_t* esp = &registers[ESP_REG];
+    if (converged)
+      executed += live;
+    else{
+      for (int lane = 0; lane < SIMD_LANES; lane++)
+	executed += mask[lane] != 0;
+    }
+
+    if (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG)
+      materialize_lanes(registers, &mask);
+
+    // Next PC per lane, for the instructions that do not simply fall through
+    lanes_t next = { 0 };
+    lanes_t taken;   // per lane, for conditional jumps
+    int jumped = 0;
+
+    switch(instr.opcode)
+    {
+    case subl:
+      *reg1 = BLEND(mask, *reg1 - instr.immediate, *reg1);
+      break;
+
+    case addl_reg_reg:
+      *reg2 = BLEND(mask, *reg1 + *reg2, *reg2);
+      break;
+
+    case addl_imm_reg:
+      *reg1 = BLEND(mask, *reg1 + instr.immediate, *reg1);
+      break;
+
+    case imull:
+      *reg2 = BLEND(mask, *reg1 * *reg2, *reg2);
+      break;
+
+    case shrl:
+      *reg1 = BLEND(mask, (lanes_t)((ulanes_t)*reg1 >> 1), *reg1);
+      break;
+
+    case movl_reg_reg:
+      *reg2 = BLEND(mask, *reg1, *reg2);
+      break;
+
+    case movl_deref_reg:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  (*reg2)[lane] = *guest_word(memory[lane], last, (*reg1)[lane] + instr.immediate);
+      }
+      break;
+
+    case movl_reg_deref:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  *guest_word(memory[lane], last, (*reg2)[lane] + instr.immediate) = (*reg1)[lane];
+      }
+      break;
+
+    case movl_imm_reg:
+      *reg1 = BLEND(mask, (lanes_t){ 0 } + instr.immediate, *reg1);
+      break;
+
+    case cmpl:
+      registers[CMP_LEFT] = BLEND(mask, *reg2, registers[CMP_LEFT]);
+      registers[CMP_RIGHT] = BLEND(mask, *reg1, registers[CMP_RIGHT]);
+      registers[FLAGS_PENDING] = BLEND(mask, (lanes_t){ 0 } + 1, registers[FLAGS_PENDING]);
+      break;
+
+    case je:
+    case jl:
+    case jle:
+    case jge:
+    case jbe:
+      lanes_taken(&taken, instr.opcode, registers);
+      next = BLEND(taken, (lanes_t){ 0 } + (int)(program_counter + instr.immediate + 4),
+		   (lanes_t){ 0 } + (int)(program_counter + 4));
+      jumped = 1;
+      break;
+
+    case jmp:
+      next = (lanes_t){ 0 } + (int)(program_counter + instr.immediate + 4);
+      jumped = 1;
+      break;
+
+    case call:
+      *esp = BLEND(mask, *esp - 4, *esp);
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  *guest_word(memory[lane], last, (*esp)[lane]) = program_counter + 4;
+      }
+      next = (lanes_t){ 0 } + (int)(program_counter + instr.immediate + 4);
+      jumped = 1;
+      break;
+
+    case ret:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (!mask[lane])
+	  continue;
+	if ((unsigned int)(*esp)[lane] == memory_size)
+	  next[lane] = HALT_PC;
+	else{
+	  next[lane] = *guest_word(memory[lane], last, (*esp)[lane]);
+	  (*esp)[lane] += 4;
+	}
+      }
+      jumped = 1;
+      break;
+
+    case pushl:
+      *esp = BLEND(mask, *esp - 4, *esp);
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  *guest_word(memory[lane], last, (*esp)[lane]) = (*reg1)[lane];
+      }
+      break;
+
+    case popl:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane]){
+	  (*reg1)[lane] = *guest_word(memory[lane], last, (*esp)[lane]);
+	  (*esp)[lane] += 4;
+	}
+      }
+      break;
+
+    case printr:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  io_print(&io[lane], (*reg1)[lane]);
+      }
+      break;
+
+    case readr:
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	int value = (*reg1)[lane];
+	if (mask[lane] && io_read(&io[lane], &value) == 1)
+	  (*reg1)[lane] = value;
+      }
+      break;
+    }
+
+    // Fast path: every lane stays together on the next instruction
+    if (!jumped && converged){
+      common_pc += 4;
+      if (common_pc == end_pc)
+	break;
+      continue;
+    }
+    if (!jumped)
+      next = (lanes_t){ 0 } + (int)(program_counter + 4);
+
+    // Move the lanes that ran on, retiring the ones that halted or fell off the end
+    if (converged){
+      for (int lane = 0; lane < SIMD_LANES; lane++)
+	pcs[lane] = next[lane];
+    }
+    else{
+      for (int lane = 0; lane < SIMD_LANES; lane++){
+	if (mask[lane])
+	  pcs[lane] = next[lane];
+      }
+    }
+
+    live = 0;
+    converged = 1;
+    for (int lane = 0; lane < SIMD_LANES; lane++){
+      if (!active[lane])
+	continue;
+      if (pcs[lane] == end_pc || pcs[lane] == HALT_PC){
+	active[lane] = 0;
+	continue;
+      }
+      if (live++ == 0)
+	common_pc = pcs[lane];
+      else if (pcs[lane] != common_pc)
+	converged = 0;
+    }
+    if (live == 0)
+      break;
+  }
+
+  release_on_error(NULL, NULL);
+  free_lanes(memory);
+  return executed;
+}
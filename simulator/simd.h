@@ -0,0 +1,15 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Lane-parallel engine that runs up to SIMD_LANES guest machines in lockstep.
+*/
+
+#pragma once
+
+#include "simulator.h"
+#include "checkpoint.h"
+
+#define SIMD_LANES 8
+
+unsigned long long run_simd(instruction_t* instructions, unsigned int num_instructions,
+			    io_t* io, int num_lanes, checkpoint_t* start);
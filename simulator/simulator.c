@@ -12,6 +12,8 @@
  *
  * Some code and pseudo code has been provided as a starting point.
  *
+ * The command line front end is main.c, which drives the simulator through libsim.h.
+ *
 */
 
 #include <stdio.h>
@@ -19,88 +21,99 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include "instruction.h"
+#include <string.h>
+#include "simulator.h"
+#include "jit.h"
+#include "simd.h"
+#include "compact.h"
+#include "memory.h"
 
 // Forward declarations for helper functions
-unsigned int get_file_size(int file_descriptor);
-unsigned int* load_file(int file_descriptor, unsigned int size);
-instruction_t* decode_instructions(unsigned int* bytes, unsigned int num_instructions);
-unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, 
-				 int* registers, unsigned char* memory);
+unsigned long long run_switch(instruction_t* instructions, unsigned int num_instructions,
+			      int* registers, unsigned char* memory, io_t* io,
+			      unsigned int program_counter);
+unsigned long long run_threaded(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				unsigned int program_counter);
 void print_instructions(instruction_t* instructions, unsigned int num_instructions);
-void error_exit(const char* message);
-
-// 17 registers
-#define NUM_REGS 17
-// 1024-byte stack
-#define STACK_SIZE 1024
-
-int main(int argc, char** argv)
-{
-  // Make sure we have enough arguments
-  if(argc < 2)
-    error_exit("must provide an argument specifying a binary file to execute");
-
-  // Open the binary file
-  int file_descriptor = open(argv[1], O_RDONLY);
-  if (file_descriptor == -1) 
-    error_exit("unable to open input file");
-
-  // Get the size of the file
-  unsigned int file_size = get_file_size(file_descriptor);
-  // Make sure the file size is a multiple of 4 bytes
-  // since machine code instructions are 4 bytes each
-  if(file_size % 4 != 0)
-    error_exit("invalid input file");
-
-  // Load the file into memory
-  // We use an unsigned int array to represent the raw bytes
-  // We could use any 4-byte integer type
-  unsigned int* instruction_bytes = load_file(file_descriptor, file_size);
-  close(file_descriptor);
-
-  unsigned int num_instructions = file_size / 4;
-
-  /****************************************/
-  /**** Begin code to modify/implement ****/
-  /****************************************/
 
+// Sequences rewritten by fuse_instructions and times the threaded engine ran them,
+// indexed by fused opcode - FIRST_FUSED. Each thread counts on its own and
+// collect_fusion_hits adds the counts up.
+unsigned int fusion_sites[NUM_FUSIONS];
+__thread unsigned long long fusion_hits[NUM_FUSIONS];
+unsigned long long fusion_totals[NUM_FUSIONS];
 
-  // Allocate and decode instructions (left for you to fill in)
-  instruction_t* instructions = decode_instructions(instruction_bytes, num_instructions);
+// Where error_exit goes on a server worker, see server.c
+__thread jmp_buf* error_handler;
+__thread const char* error_message;
+// What error_exit frees before it jumps to error_handler, see release_on_error
+static __thread void (*error_release)(void*);
+static __thread void* error_release_data;
 
-
-  // Optionally print the decoded instructions for debugging
-  // Will not work until you implement decode_instructions
-  // Do not call this function in your submitted final version
-  // print_instructions(instructions, num_instructions);
-
-
-  // Once you have completed Part 1 (decoding instructions), uncomment the below block
-  
-
-  // Allocate and initialize registers to 0. Register %esp, aka stack point, should be 1024.
-  int* registers = (int*)malloc(sizeof(int) * NUM_REGS);
-  for (int i = 0; i < NUM_REGS; i++){
+/*
+ * Puts a machine in its initial state: registers are 0 except %esp, which points past the
+ * top of guest memory, and the memory is cleared
+*/
+void reset_machine(int* registers, unsigned char* memory)
+{
+  for (int i = 0; i < REGISTER_FILE_SIZE; i++){
     registers[i] = 0;
   }
-  registers[6] = 1024;
+  registers[ESP_REG] = memory_size;
+  memory_clear(memory);
+}
 
-  // Stack memory is byte-addressed, so it must be a 1-byte type, must be a 1024 byte stack
-  // TODO allocate the stack memory. Do not assign to NULL.
-  unsigned char* memory = malloc(sizeof(char) * 1024);
+/*
+ * Runs the program on a fresh or resumed machine state with the given engine, starting at
+ * program_counter. compact is the program's compact form, only needed by that engine.
+ * Returns the number of instructions executed.
+*/
+unsigned long long run_program(int engine, instruction_t* instructions,
+			       const compact_program_t* compact, unsigned int num_instructions,
+			       int* registers, unsigned char* memory, io_t* io,
+			       unsigned int program_counter)
+{
+  if (engine == ENGINE_THREADED)
+    return run_threaded(instructions, num_instructions, registers, memory, io, program_counter);
+  if (engine == ENGINE_JIT)
+    return run_jit(instructions, num_instructions, registers, memory, io, program_counter);
+  if (engine == ENGINE_COMPACT)
+    return run_compact(compact, num_instructions, registers, memory, io, program_counter);
+  // The lane engine keeps its own machine state, it pays off in batch mode.
+  // It only starts fresh machines here, a resumed one goes through the switch engine.
+  if (engine == ENGINE_SIMD && program_counter == 0)
+    return run_simd(instructions, num_instructions, io, 1, NULL);
+  return run_switch(instructions, num_instructions, registers, memory, io, program_counter);
+}
 
-  // Run the simulation
-  unsigned int program_counter = 0;
+/*
+ * Runs the program with execute_instruction from program_counter until it falls off the end
+ * or returns from main.
+ * This is the reference engine. Returns the number of instructions executed.
+*/
+unsigned long long run_switch(instruction_t* instructions, unsigned int num_instructions,
+			      int* registers, unsigned char* memory, io_t* io,
+			      unsigned int program_counter)
+{
+  unsigned long long executed = 0;
 
   // program_counter is a byte address, so we must multiply num_instructions by 4 
-  // to get the address past the last instruction
-  while(program_counter != num_instructions * 4)
+  // to get the address past the last instruction. A jump or ret can land anywhere else
+  // too, one test catches both before the instructions array is read.
+  unsigned int end_pc = num_instructions * 4;
+  for (;;)
   {
-    program_counter = execute_instruction(program_counter, instructions, registers, memory);
+    if (program_counter >= end_pc || program_counter % 4 != 0){
+      if (program_counter == end_pc || program_counter == HALT_PC)
+	break;
+      error_exit("program counter out of range");
+    }
+    program_counter = execute_instruction(program_counter, instructions, registers, memory, io);
+    executed++;
   }
-  
-  return 0;
+
+  return executed;
 }
 
 /*
@@ -112,55 +125,139 @@ instruction_t* decode_instructions(unsigned int* bytes, unsigned int num_instruc
   instruction_t* retval = malloc(sizeof(instruction_t) * num_instructions);
 
   for (int i = 0; i < num_instructions; i++){
-    int instruction = bytes[i];
-    
-    int opcode = (instruction >> 27) & 0x1F;
-    int reg1 = (instruction >> 22) & 0x1F;
-    int reg2 = (instruction >> 17) & 0x1F;
-    int immediate = instruction & 0xFFFF;
-    
-    if (immediate & 0x8000){
-      immediate |= 0xFFFF0000;
-    }
-    
+    retval[i] = decode_instruction(bytes[i]);
+  }
+
+  return retval;
+}
+
+/*
+ * Returns whether an instruction has a known opcode and names only registers that exist.
+ * Engines index the register file with the register fields unchecked, and the lazy flags
+ * live just past %eflags, so a program with any other instruction is not loaded.
+*/
+int valid_instruction(instruction_t instr)
+{
+  return instr.opcode <= readr && instr.first_register < NUM_REGS &&
+    instr.second_register < NUM_REGS;
+}
+
+/*
+ * Decodes one raw 4-byte instruction
+*/
+instruction_t decode_instruction(unsigned int bytes)
+{
+  int instruction = bytes;
+
+  int opcode = (instruction >> 27) & 0x1F;
+  int reg1 = (instruction >> 22) & 0x1F;
+  int reg2 = (instruction >> 17) & 0x1F;
+  int immediate = instruction & 0xFFFF;
+
+  if (immediate & 0x8000){
+    immediate |= 0xFFFF0000;
+  }
+
   instruction_t instruction_struct;
   instruction_struct.opcode = opcode;
   instruction_struct.first_register = reg1;
   instruction_struct.second_register = reg2;
   instruction_struct.immediate = immediate;
-  retval[i] = instruction_struct;
+  return instruction_struct;
+}
+
+
+/*
+ * Returns whether instr has %eflags as one of its register fields
+*/
+static int names_eflags(instruction_t instr)
+{
+  return instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG;
+}
+
+/*
+ * Peephole pass that rewrites common instruction sequences into fused opcodes, which the
+ * threaded engine executes with a single dispatch.
+ * Only the first instruction of a sequence is rewritten. The rest keep their own opcodes,
+ * so a jump into the middle of a sequence still runs the original instructions.
+*/
+void fuse_instructions(instruction_t* instructions, unsigned int num_instructions)
+{
+  for (unsigned int i = 0; i + 1 < num_instructions; i++){
+    instruction_t* first = &instructions[i];
+    unsigned char second = instructions[i + 1].opcode;
+    int fused = -1;
+
+    // Sequences touching %eflags keep the plain handlers that bring it up to date
+    if (names_eflags(*first) || names_eflags(instructions[i + 1]))
+      continue;
+
+    if (first->opcode == cmpl && second >= je && second <= jbe)
+      fused = cmpl_je + (second - je);
+    else if (first->opcode == movl_imm_reg && second == imull){
+      if (i + 2 < num_instructions && instructions[i + 2].opcode == addl_reg_reg &&
+	  !names_eflags(instructions[i + 2]))
+	fused = movl_imm_imull_addl;
+      else
+	fused = movl_imm_imull;
+    }
+    else if (first->opcode == pushl && second == call)
+      fused = pushl_call;
+    else if (first->opcode == popl && second == ret)
+      fused = popl_ret;
+
+    if (fused != -1){
+      first->opcode = fused;
+      fusion_sites[fused - FIRST_FUSED]++;
+    }
   }
+}
 
-  return retval;
+/*
+ * Adds the fusion counts of the calling thread to the totals and resets them
+*/
+void collect_fusion_hits()
+{
+  for (int i = 0; i < NUM_FUSIONS; i++){
+    __atomic_fetch_add(&fusion_totals[i], fusion_hits[i], __ATOMIC_RELAXED);
+    fusion_hits[i] = 0;
+  }
 }
 
+/*
+ * Prints how often each fusion was found and executed to stderr
+*/
+void print_fusion_report()
+{
+  const char* names[NUM_FUSIONS] = {
+    "cmpl+je", "cmpl+jl", "cmpl+jle", "cmpl+jge", "cmpl+jbe",
+    "movl+imull", "movl+imull+addl", "pushl+call", "popl+ret"
+  };
+
+  fprintf(stderr, "%-16s %8s %14s\n", "fusion", "sites", "executed");
+  for (int i = 0; i < NUM_FUSIONS; i++)
+    fprintf(stderr, "%-16s %8u %14llu\n", names[i], fusion_sites[i], fusion_totals[i]);
+}
 
 /*
  * Executes a single instruction and returns the next program counter
 */
-unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, int* registers, unsigned char* memory)
+unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, int* registers, unsigned char* memory, io_t* io)
 {
   // program_counter is a byte address, but instructions are 4 bytes each
   // divide by 4 to get the index into the instructions array
   instruction_t instr = instructions[program_counter / 4];
   
   // Registers constanly used
-  int* eflags = &registers[16]; // Register ID of 16
-  int* esp = &registers[6]; // Stack pointer register
+  int* esp = &registers[ESP_REG]; // Stack pointer register
   int* reg1 = &registers[instr.first_register]; // Register address of first register in the instruction
   int* reg2 = &registers[instr.second_register];// Register address of second register in the instruction
+  unsigned int last = memory_size - 4; // Highest address a 4-byte access may start at
 
-  // Indeces for opflags
-  int CF_bit_index = 0;
-  int ZF_bit_index = 6;
-  int SF_bit_index = 7;
-  int OF_bit_index = 11;
-
-  // Bools for opcodes
-  int CF = (*eflags >> (CF_bit_index)) & 1;
-  int ZF = (*eflags >> (ZF_bit_index)) & 1;
-  int SF = (*eflags >> (SF_bit_index)) & 1;
-  int OF = (*eflags >> (OF_bit_index)) & 1;
+  // %eflags is only brought up to date when an instruction names it
+  if (registers[FLAGS_PENDING] &&
+      (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG))
+    materialize_flags(registers);
 
   switch(instr.opcode)
   {
@@ -193,11 +290,11 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     break;
   
   case movl_deref_reg:
-    *reg2 = *(int *)&memory[*reg1 + instr.immediate]; // WHAT IN THE C IS THIS CAST
+    *reg2 = *guest_word(memory, last, *reg1 + instr.immediate);
     break;
 
   case movl_reg_deref:
-    *(int *)&memory[*reg2 + instr.immediate] = *reg1;
+    *guest_word(memory, last, *reg2 + instr.immediate) = *reg1;
     break;
 
   case movl_imm_reg: 
@@ -205,49 +302,19 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     break;
 
 
-  case cmpl:{
-    unsigned int u_reg2 = *reg2; 
-    unsigned int u_reg1 = *reg1; 
-    unsigned int u_result = u_reg2 - u_reg1;
-
-    // CF: if unsigned borrow happened
-    if (u_reg2 < u_reg1) {
-        *eflags |= (1 << CF_bit_index);
-    } else {
-        *eflags &= ~(1 << CF_bit_index);
-    }
-
-    // ZF: reg2 - reg1 == 0
-    if (u_result == 0) {
-        *eflags |= (1 << ZF_bit_index);
-    } else {
-        *eflags &= ~(1 << ZF_bit_index);
-    }
-
-    // SF: sign bit of reg2 - reg1
-    if (u_result & 0x80000000) {
-        *eflags |= (1 << SF_bit_index);
-    } else {
-        *eflags &= ~(1 << SF_bit_index);
-    }
-
-    // OF: if signed overflow of reg2 - reg1
-    int s_result = *reg2 - *reg1;
-
-    if (((*reg2 ^ *reg1) & (*reg2 ^ s_result)) & 0x80000000) {
-        *eflags |= (1 << OF_bit_index);
-    } else {
-        *eflags &= ~(1 << OF_bit_index);
-    }
+  case cmpl:
+    // Flags are computed later, and only as far as a conditional jump needs them
+    registers[CMP_LEFT] = *reg2;
+    registers[CMP_RIGHT] = *reg1;
+    registers[FLAGS_PENDING] = 1;
     break;
-  }
 
   case printr:
-    printf("%d (0x%x)\n", *reg1, *reg1);
+    io_print(io, *reg1);
     break;
   
   case readr:
-    scanf("%d", &(registers[instr.first_register]));
+    io_read(io, &(registers[instr.first_register]));
     break;
 
   case jmp:
@@ -255,42 +322,14 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     return program_counter + instr.immediate + 4;
   
   case je:
-    if (ZF){ 
-      return program_counter + instr.immediate + 4;
-    } 
-    else {
-      return program_counter + 4;
-    }
-
   case jl:
-    if (SF ^ OF){
-      return program_counter + instr.immediate + 4;
-    }
-    else{
-      return program_counter + 4;
-    }
-
   case jle:
-    if ((SF ^ OF) | ZF){
-      return program_counter + instr.immediate + 4;
-    }
-    else{
-      return program_counter + 4;
-    }
-
   case jge:
-    if (!(SF ^ OF)){ 
-      return program_counter + instr.immediate + 4;
-    }
-    else{
-      return program_counter + 4;
-    }
-
   case jbe:
-    if (CF | ZF){
+    if (branch_taken(instr.opcode, registers)){
       return program_counter + instr.immediate + 4;
     }
-    else{
+    else {
       return program_counter + 4;
     }
 
@@ -298,16 +337,16 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     //printf("Call, program counter at %d, stack pointer at, %d\n", program_counter, *esp);
     *esp -= 4;
     //printf("Reduced SP by 4\n");
-    *(int*)&memory[*esp] = program_counter + 4;
+    *guest_word(memory, last, *esp) = program_counter + 4;
     return program_counter + instr.immediate + 4;
     
   case ret:
-    if (*esp == 1024){
-      exit(0);
+    if ((unsigned int)*esp == memory_size){
+      return HALT_PC;
     }
     else{
       //printf("Returned, program counter at %d, stack pointer at, %d\n", program_counter, *esp);
-      program_counter = *(int*)&memory[*esp];
+      program_counter = *guest_word(memory, last, *esp);
       *esp += 4;
       //printf("Increased SP by 4\n");
       return program_counter;
@@ -317,11 +356,11 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
   
   case pushl:
     *esp -= 4;
-    *(int*)&memory[*esp] = *reg1;
+    *guest_word(memory, last, *esp) = *reg1;
     break;
   
   case popl:
-    *reg1 = *(int*)&memory[*esp];
+    *reg1 = *guest_word(memory, last, *esp);
     *esp += 4;
     break;
   }
@@ -334,6 +373,375 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
 }
 
 
+/*
+ * Computes CF, ZF, SF and OF of %eflags from the operands recorded by the last cmpl
+*/
+void materialize_flags(int* registers)
+{
+  if (!registers[FLAGS_PENDING])
+    return;
+
+  unsigned int u_reg2 = registers[CMP_LEFT];
+  unsigned int u_reg1 = registers[CMP_RIGHT];
+  unsigned int u_result = u_reg2 - u_reg1;
+  int flags = registers[EFLAGS_REG] & ~(CF_FLAG | ZF_FLAG | SF_FLAG | OF_FLAG);
+
+  // CF: if unsigned borrow happened
+  if (u_reg2 < u_reg1)
+    flags |= CF_FLAG;
+  // ZF: reg2 - reg1 == 0
+  if (u_result == 0)
+    flags |= ZF_FLAG;
+  // SF: sign bit of reg2 - reg1
+  if (u_result & 0x80000000)
+    flags |= SF_FLAG;
+  // OF: if signed overflow of reg2 - reg1
+  if ((u_reg2 ^ u_reg1) & (u_reg2 ^ u_result) & 0x80000000)
+    flags |= OF_FLAG;
+
+  registers[EFLAGS_REG] = flags;
+  registers[FLAGS_PENDING] = 0;
+}
+
+/*
+ * One pre-decoded instruction for the threaded engine.
+ * Register operands are resolved to pointers and jump immediates to absolute
+ * instruction indices, so handlers never decode anything.
+*/
+typedef struct
+{
+  const void* handler;  // address of the label that executes this opcode
+  int* reg1;
+  int* reg2;
+  int immediate;
+  unsigned int target;  // index of the jump or call target
+} threaded_op_t;
+
+/*
+ * Runs the program from program_counter with a direct-threaded dispatch loop.
+ * Instructions are first translated into a stream of handler addresses, then every handler
+ * jumps straight to the next one with a computed goto (a GCC extension) instead of returning
+ * to a central switch. Returns the number of instructions executed.
+*/
+unsigned long long run_threaded(instruction_t* instructions, unsigned int num_instructions,
+				int* registers, unsigned char* memory, io_t* io,
+				unsigned int program_counter)
+{
+  static const void* handlers[] = {
+    [subl] = &&op_subl,
+    [addl_reg_reg] = &&op_addl_reg_reg,
+    [addl_imm_reg] = &&op_addl_imm_reg,
+    [imull] = &&op_imull,
+    [shrl] = &&op_shrl,
+    [movl_reg_reg] = &&op_movl_reg_reg,
+    [movl_deref_reg] = &&op_movl_deref_reg,
+    [movl_reg_deref] = &&op_movl_reg_deref,
+    [movl_imm_reg] = &&op_movl_imm_reg,
+    [cmpl] = &&op_cmpl,
+    [je] = &&op_je,
+    [jl] = &&op_jl,
+    [jle] = &&op_jle,
+    [jge] = &&op_jge,
+    [jbe] = &&op_jbe,
+    [jmp] = &&op_jmp,
+    [call] = &&op_call,
+    [ret] = &&op_ret,
+    [pushl] = &&op_pushl,
+    [popl] = &&op_popl,
+    [printr] = &&op_printr,
+    [readr] = &&op_readr,
+    [cmpl_je] = &&op_cmpl_je,
+    [cmpl_jl] = &&op_cmpl_jl,
+    [cmpl_jle] = &&op_cmpl_jle,
+    [cmpl_jge] = &&op_cmpl_jge,
+    [cmpl_jbe] = &&op_cmpl_jbe,
+    [movl_imm_imull] = &&op_movl_imm_imull,
+    [movl_imm_imull_addl] = &&op_movl_imm_imull_addl,
+    [pushl_call] = &&op_pushl_call,
+    [popl_ret] = &&op_popl_ret
+  };
+
+  // Two extra slots: falling off the end of the program, and jumping somewhere invalid
+  unsigned int end_index = num_instructions;
+  unsigned int bad_index = num_instructions + 1;
+  threaded_op_t* code = malloc(sizeof(threaded_op_t) * (num_instructions + 2));
+  if (code == NULL)
+    error_exit("unable to allocate memory for threaded code");
+  release_on_error(free, code);
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    instruction_t instr = instructions[i];
+
+    // Unknown opcodes do nothing in execute_instruction, so they become a no-op here too
+    int known = instr.opcode <= readr || (instr.opcode >= FIRST_FUSED && instr.opcode <= LAST_FUSED);
+    code[i].handler = known ? handlers[instr.opcode] : &&op_nop;
+
+    // Instructions that name %eflags bring it up to date first
+    if (instr.opcode <= readr &&
+	(instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG))
+      code[i].handler = &&op_sync_flags;
+    code[i].reg1 = &registers[instr.first_register];
+    code[i].reg2 = &registers[instr.second_register];
+    code[i].immediate = instr.immediate;
+
+    // Byte target is (i * 4) + immediate + 4, which must land on an instruction boundary
+    long long target = (long long)i * 4 + instr.immediate + 4;
+    if (target < 0 || target % 4 != 0 || target > (long long)num_instructions * 4)
+      code[i].target = bad_index;
+    else
+      code[i].target = (unsigned int)(target / 4);
+  }
+  code[end_index].handler = &&op_end;
+  code[bad_index].handler = &&op_bad;
+
+  int* esp = &registers[ESP_REG];
+  unsigned long long executed = 0;
+  unsigned int top = memory_size;     // %esp when the outermost ret halts
+  unsigned int last = memory_size - 4; // highest address a 4-byte access may start at
+
+  // The lazy flags live in locals here and go back to the register file when observed
+  int cmp_left = registers[CMP_LEFT];
+  int cmp_right = registers[CMP_RIGHT];
+  int flags_pending = registers[FLAGS_PENDING];
+  threaded_op_t* op = program_counter % 4 == 0 && program_counter <= num_instructions * 4 ?
+    &code[program_counter / 4] : &code[bad_index];
+
+#define DISPATCH() do { executed++; goto *op->handler; } while (0)
+#define NEXT() do { op++; DISPATCH(); } while (0)
+#define TAKEN(opcode) (flags_pending ? compare_taken(opcode, cmp_left, cmp_right) \
+		       : eflags_taken(opcode, registers[EFLAGS_REG]))
+// Moves on to the next instruction of a fused sequence without dispatching
+#define CONTINUE_AT(label) do { op++; executed++; goto label; } while (0)
+#define BRANCH(taken) do { op = (taken) ? &code[op->target] : op + 1; DISPATCH(); } while (0)
+
+  DISPATCH();
+
+ op_subl:
+  *op->reg1 -= op->immediate;
+  NEXT();
+
+ op_addl_reg_reg:
+  *op->reg2 += *op->reg1;
+  NEXT();
+
+ op_addl_imm_reg:
+  *op->reg1 += op->immediate;
+  NEXT();
+
+ op_imull:
+  *op->reg2 = *op->reg1 * *op->reg2;
+  NEXT();
+
+ op_shrl:
+  *op->reg1 = (int)((unsigned int)*op->reg1 >> 1);
+  NEXT();
+
+ op_movl_reg_reg:
+  *op->reg2 = *op->reg1;
+  NEXT();
+
+ op_movl_deref_reg:
+  *op->reg2 = *guest_word(memory, last, *op->reg1 + op->immediate);
+  NEXT();
+
+ op_movl_reg_deref:
+  *guest_word(memory, last, *op->reg2 + op->immediate) = *op->reg1;
+  NEXT();
+
+ op_movl_imm_reg:
+  *op->reg1 = op->immediate;
+  NEXT();
+
+ op_cmpl:
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  NEXT();
+
+ op_je:
+  BRANCH(TAKEN(je));
+
+ op_jl:
+  BRANCH(TAKEN(jl));
+
+ op_jle:
+  BRANCH(TAKEN(jle));
+
+ op_jge:
+  BRANCH(TAKEN(jge));
+
+ op_jbe:
+  BRANCH(TAKEN(jbe));
+
+ op_jmp:
+  BRANCH(1);
+
+ op_call:
+  *esp -= 4;
+  *guest_word(memory, last, *esp) = (int)((op - code) * 4 + 4);
+  BRANCH(1);
+
+ op_ret:{
+    if ((unsigned int)*esp == top)
+      goto done;
+    unsigned int return_address = *guest_word(memory, last, *esp);
+    *esp += 4;
+    if (return_address % 4 != 0 || return_address > num_instructions * 4)
+      op = &code[bad_index];
+    else
+      op = &code[return_address / 4];
+    DISPATCH();
+  }
+
+ op_pushl:
+  *esp -= 4;
+  *guest_word(memory, last, *esp) = *op->reg1;
+  NEXT();
+
+ op_popl:
+  *op->reg1 = *guest_word(memory, last, *esp);
+  *esp += 4;
+  NEXT();
+
+ op_printr:
+  io_print(io, *op->reg1);
+  NEXT();
+
+ op_readr:
+  io_read(io, op->reg1);
+  NEXT();
+
+ op_nop:
+  NEXT();
+
+ op_cmpl_je:
+  fusion_hits[cmpl_je - FIRST_FUSED]++;
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  CONTINUE_AT(op_je);
+
+ op_cmpl_jl:
+  fusion_hits[cmpl_jl - FIRST_FUSED]++;
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  CONTINUE_AT(op_jl);
+
+ op_cmpl_jle:
+  fusion_hits[cmpl_jle - FIRST_FUSED]++;
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  CONTINUE_AT(op_jle);
+
+ op_cmpl_jge:
+  fusion_hits[cmpl_jge - FIRST_FUSED]++;
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  CONTINUE_AT(op_jge);
+
+ op_cmpl_jbe:
+  fusion_hits[cmpl_jbe - FIRST_FUSED]++;
+  cmp_left = *op->reg2;
+  cmp_right = *op->reg1;
+  flags_pending = 1;
+  CONTINUE_AT(op_jbe);
+
+ op_movl_imm_imull:
+  fusion_hits[movl_imm_imull - FIRST_FUSED]++;
+  *op->reg1 = op->immediate;
+  CONTINUE_AT(op_imull);
+
+ op_movl_imm_imull_addl:
+  fusion_hits[movl_imm_imull_addl - FIRST_FUSED]++;
+  *op->reg1 = op->immediate;
+  op++;
+  executed++;
+  *op->reg2 = *op->reg1 * *op->reg2;
+  CONTINUE_AT(op_addl_reg_reg);
+
+ op_pushl_call:
+  fusion_hits[pushl_call - FIRST_FUSED]++;
+  *esp -= 4;
+  *guest_word(memory, last, *esp) = *op->reg1;
+  CONTINUE_AT(op_call);
+
+ op_popl_ret:
+  fusion_hits[popl_ret - FIRST_FUSED]++;
+  *op->reg1 = *guest_word(memory, last, *esp);
+  *esp += 4;
+  CONTINUE_AT(op_ret);
+
+ op_sync_flags:
+  if (flags_pending){
+    registers[CMP_LEFT] = cmp_left;
+    registers[CMP_RIGHT] = cmp_right;
+    registers[FLAGS_PENDING] = 1;
+    materialize_flags(registers);
+    flags_pending = 0;
+  }
+  goto *handlers[instructions[op - code].opcode];
+
+ op_bad:
+  error_exit("program counter out of range");
+
+ op_end:
+  // Reaching the end slot was counted as a dispatch but is not an instruction
+  executed--;
+
+ done:
+#undef DISPATCH
+#undef NEXT
+#undef TAKEN
+#undef BRANCH
+#undef CONTINUE_AT
+  registers[CMP_LEFT] = cmp_left;
+  registers[CMP_RIGHT] = cmp_right;
+  registers[FLAGS_PENDING] = flags_pending;
+  release_on_error(NULL, NULL);
+  free(code);
+  return executed;
+}
+
+/*
+ * Has error_exit call release(data) before it jumps to error_handler, so a run that fails
+ * only its request or batch input does not leak what the engine allocated for it.
+ * The engine passes NULL to cancel it before freeing the memory itself.
+*/
+void release_on_error(void (*release)(void*), void* data)
+{
+  error_release = release;
+  error_release_data = data;
+}
+
+void handout_error_exit(const char* message);
+
+/*
+ * Prints an error and then exits the program with status 1, through the handout's
+ * error_exit below. On a server worker or a batch input only that request or input fails:
+ * the message is stored and error_exit jumps back to error_handler.
+*/
+void error_exit(const char* message)
+{
+  if (error_handler != NULL){
+    void (*release)(void*) = error_release;
+    error_release = NULL;
+    if (release != NULL)
+      release(error_release_data);
+    error_message = message;
+    longjmp(*error_handler, 1);
+  }
+
+  // Whatever the program printed so far comes before the message
+  io_flush_stdout();
+  handout_error_exit(message);
+}
+
+// The handout's error_exit is kept below as it was handed out, under a name of its own
+#define error_exit handout_error_exit
+
 /*********************************************/
 /****  DO NOT MODIFY THE FUNCTIONS BELOW  ****/
 /*********************************************/
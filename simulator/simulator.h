@@ -0,0 +1,135 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Definitions shared by the simulator's execution engines.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <setjmp.h>
+#include "instruction.h"
+#include "io.h"
+#include "libsim.h"
+
+// 17 registers
+#define NUM_REGS 17
+#define ESP_REG 6
+#define EFLAGS_REG 16
+
+// Lazy condition flags: cmpl only records its operands in these slots past the
+// architectural registers, and %eflags is computed from them when an instruction names it
+// (the operands are not adjacent, which keeps GCC from packing them into one vector register)
+#define CMP_LEFT 17      // second register of the last cmpl
+#define FLAGS_PENDING 18 // nonzero while %eflags is out of date
+#define CMP_RIGHT 19     // first register of the last cmpl
+#define REGISTER_FILE_SIZE 20
+// 1024-byte stack
+#define STACK_SIZE 1024
+
+// Condition flag bits of %eflags (register 16)
+#define CF_FLAG (1 << 0)
+#define ZF_FLAG (1 << 6)
+#define SF_FLAG (1 << 7)
+#define OF_FLAG (1 << 11)
+
+// Internal opcodes written by fuse_instructions for the threaded engine.
+// They start past the 5-bit opcodes a binary can encode.
+enum fused_opcodes{
+  cmpl_je = 32,         // cmpl; je
+  cmpl_jl,              // cmpl; jl
+  cmpl_jle,             // cmpl; jle
+  cmpl_jge,             // cmpl; jge
+  cmpl_jbe,             // cmpl; jbe
+  movl_imm_imull,       // movl $imm, r; imull s, r
+  movl_imm_imull_addl,  // movl $imm, r; imull s, r; addl t, r (array indexing)
+  pushl_call,           // pushl; call
+  popl_ret              // popl; ret
+};
+#define FIRST_FUSED cmpl_je
+#define LAST_FUSED popl_ret
+#define NUM_FUSIONS (LAST_FUSED - FIRST_FUSED + 1)
+
+// Returned by execute_instruction when the program returns from main
+#define HALT_PC 0xFFFFFFFF
+
+unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, 
+				 int* registers, unsigned char* memory, io_t* io);
+instruction_t decode_instruction(unsigned int bytes);
+int valid_instruction(instruction_t instr);
+instruction_t* decode_instructions(unsigned int* bytes, unsigned int num_instructions);
+unsigned int get_file_size(int file_descriptor);
+unsigned int* load_file(int file_descriptor, unsigned int size);
+void fuse_instructions(instruction_t* instructions, unsigned int num_instructions);
+extern unsigned int fusion_sites[NUM_FUSIONS];
+void print_fusion_report();
+void reset_machine(int* registers, unsigned char* memory);
+struct compact_program;
+unsigned long long run_program(int engine, instruction_t* instructions,
+			       const struct compact_program* compact, unsigned int num_instructions,
+			       int* registers, unsigned char* memory, io_t* io,
+			       unsigned int program_counter);
+void collect_fusion_hits();
+void materialize_flags(int* registers);
+
+// Set by a server worker while it runs a request: error_exit then stores the message and
+// jumps back to the worker instead of exiting
+extern __thread jmp_buf* error_handler;
+extern __thread const char* error_message;
+void release_on_error(void (*release)(void*), void* data);
+
+/*
+ * Returns whether the conditional jump opcode is taken after "cmpl right, left".
+ * Only the predicate the jump needs is computed.
+*/
+static inline int compare_taken(unsigned char opcode, int left, int right)
+{
+  switch(opcode)
+  {
+  case je:
+    return left == right;
+  case jl:
+    return left < right;
+  case jle:
+    return left <= right;
+  case jge:
+    return left >= right;
+  case jbe:
+    return (unsigned int)left <= (unsigned int)right;
+  }
+  return 0;
+}
+
+/*
+ * Returns whether the conditional jump opcode is taken according to the bits of %eflags
+*/
+static inline int eflags_taken(unsigned char opcode, int flags)
+{
+  int ZF = (flags & ZF_FLAG) != 0;
+  int SF_xor_OF = ((flags & SF_FLAG) != 0) != ((flags & OF_FLAG) != 0);
+  switch(opcode)
+  {
+  case je:
+    return ZF;
+  case jl:
+    return SF_xor_OF;
+  case jle:
+    return SF_xor_OF | ZF;
+  case jge:
+    return !SF_xor_OF;
+  case jbe:
+    return (flags & CF_FLAG) || ZF;
+  }
+  return 0;
+}
+
+/*
+ * Returns whether the conditional jump opcode is taken, straight from the cmpl operands
+ * while %eflags is out of date
+*/
+static inline int branch_taken(unsigned char opcode, int* registers)
+{
+  if (registers[FLAGS_PENDING])
+    return compare_taken(opcode, registers[CMP_LEFT], registers[CMP_RIGHT]);
+  return eflags_taken(opcode, registers[EFLAGS_REG]);
+}
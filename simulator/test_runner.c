@@ -0,0 +1,300 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Native test runner for the simulator.
+ *
+ * Finds every test under tests/, a binary X.o next to X.expected with an optional X.in,
+ * and runs them in-process through libsim on a pool of threads: each run reads its input
+ * from memory, prints into a memory stream, and is compared with the expected output in
+ * memory. Every run is reported with its wall time and instruction count. Tests with an
+ * X.args file need simulator options and are left to run_tests.sh.
+ *
+ * With --all-engines every test also runs on each engine, and the engines must agree on
+ * the output, the exit status and the number of instructions executed.
+ *
+ * Usage: test_runner [--engine=NAME | --all-engines] [--threads=N] [directory]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "simulator.h"
+
+#define NUM_ENGINES 5
+
+static const char* engine_names[NUM_ENGINES] = { "switch", "threaded", "jit", "simd", "compact" };
+
+typedef struct
+{
+  char* name;                  // path without the .o
+  sim_program_t* program;
+  char* input;                 // NULL without a .in file
+  size_t input_size;
+  char* expected;
+  size_t expected_size;
+} test_t;
+
+typedef struct
+{
+  char* output;
+  size_t output_size;
+  int status;                  // what the simulator would exit with
+  unsigned long long executed;
+  double seconds;
+} run_t;
+
+typedef struct
+{
+  test_t* tests;
+  int num_tests;
+  int engines[NUM_ENGINES];
+  int num_engines;
+  run_t* runs;                 // runs[test * num_engines + engine]
+  int next_run;                // next run to claim, taken with an atomic add
+} suite_t;
+
+/*
+ * Returns a monotonic timestamp in seconds
+*/
+static double get_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Reads the whole file into a new buffer and stores its size. Returns NULL if it does not
+ * exist.
+*/
+static char* read_file(const char* file_name, size_t* size)
+{
+  FILE* file = fopen(file_name, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  rewind(file);
+  char* bytes = malloc(*size + 1);
+  if (bytes == NULL || fread(bytes, 1, *size, file) != *size)
+    error_exit("unable to read test file");
+  fclose(file);
+  return bytes;
+}
+
+/*
+ * Adds every test in directory and the directories below it to the suite
+*/
+static void find_tests(suite_t* suite, const char* directory, int* capacity)
+{
+  struct dirent** entries;
+  int num_entries = scandir(directory, &entries, NULL, alphasort);
+  if (num_entries < 0)
+    error_exit("unable to read test directory");
+
+  for (int i = 0; i < num_entries; i++){
+    const char* entry = entries[i]->d_name;
+    size_t length = strlen(entry);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, entry);
+
+    if (entries[i]->d_type == DT_DIR){
+      if (entry[0] != '.')
+	find_tests(suite, path, capacity);
+    }
+    else if (length > 2 && strcmp(entry + length - 2, ".o") == 0){
+      path[strlen(path) - 2] = '\0';
+      char file_name[4096 + 16];
+      test_t test;
+      snprintf(file_name, sizeof(file_name), "%s.args", path);
+      if (access(file_name, F_OK) == 0){
+	// Runs with simulator options, which only run_tests.sh gives it
+	free(entries[i]);
+	continue;
+      }
+      snprintf(file_name, sizeof(file_name), "%s.expected", path);
+      test.expected = read_file(file_name, &test.expected_size);
+      if (test.expected != NULL){
+	snprintf(file_name, sizeof(file_name), "%s.in", path);
+	test.input = read_file(file_name, &test.input_size);
+	snprintf(file_name, sizeof(file_name), "%s.o", path);
+	test.program = sim_load_file(file_name, 1);
+	test.name = strdup(path);
+
+	if (suite->num_tests == *capacity){
+	  *capacity = *capacity * 2 + 16;
+	  suite->tests = realloc(suite->tests, sizeof(test_t) * *capacity);
+	  if (suite->tests == NULL)
+	    error_exit("unable to allocate memory for tests");
+	}
+	suite->tests[suite->num_tests++] = test;
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+/*
+ * Runs one test on one engine
+*/
+static void run_test(test_t* test, int engine, run_t* run)
+{
+  FILE* in = test->input != NULL ? fmemopen(test->input, test->input_size, "r") :
+    fopen("/dev/null", "r");
+  FILE* out = open_memstream(&run->output, &run->output_size);
+  if (in == NULL || out == NULL)
+    error_exit("unable to open streams for a test");
+
+  double start = get_seconds();
+  sim_ctx_t* ctx = sim_ctx_new(test->program, engine);
+  sim_set_files(ctx, in, out);
+
+  // A failing program fails only its own run, as it would fail the simulator
+  jmp_buf handler;
+  if (setjmp(handler) == 0){
+    error_handler = &handler;
+    sim_run(ctx, SIM_NO_BUDGET);
+    run->status = 0;
+    run->executed = sim_executed(ctx);
+    sim_ctx_free(ctx);
+  }
+  else {
+    // Whatever the program printed so far comes before the message
+    sim_ctx_free(ctx);
+    fprintf(out, "Error: %s\n", error_message);
+    run->status = 1;
+    run->executed = 0;
+  }
+  error_handler = NULL;
+  run->seconds = get_seconds() - start;
+
+  fclose(in);
+  fclose(out);
+}
+
+/*
+ * Worker thread: runs tests until none are left
+*/
+static void* test_worker(void* arg)
+{
+  suite_t* suite = arg;
+  int num_runs = suite->num_tests * suite->num_engines;
+  for (;;){
+    int i = __atomic_fetch_add(&suite->next_run, 1, __ATOMIC_RELAXED);
+    if (i >= num_runs)
+      break;
+    run_test(&suite->tests[i / suite->num_engines], suite->engines[i % suite->num_engines],
+	     &suite->runs[i]);
+  }
+  return NULL;
+}
+
+/*
+ * Returns whether the run produced the expected output and exited normally
+*/
+static int passed(test_t* test, run_t* run)
+{
+  return run->status == 0 && run->output_size == test->expected_size &&
+    memcmp(run->output, test->expected, test->expected_size) == 0;
+}
+
+int main(int argc, char** argv)
+{
+  suite_t suite;
+  memset(&suite, 0, sizeof(suite));
+  suite.engines[0] = ENGINE_SWITCH;
+  suite.num_engines = 1;
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* directory = "tests";
+
+  for (int i = 1; i < argc; i++){
+    if (strncmp(argv[i], "--engine=", 9) == 0){
+      suite.num_engines = 0;
+      for (int engine = 0; engine < NUM_ENGINES; engine++){
+	if (strcmp(argv[i] + 9, engine_names[engine]) == 0)
+	  suite.engines[suite.num_engines++] = engine;
+      }
+      if (suite.num_engines == 0)
+	error_exit("unknown engine");
+    }
+    else if (strcmp(argv[i], "--all-engines") == 0){
+      for (int engine = 0; engine < NUM_ENGINES; engine++)
+	suite.engines[engine] = engine;
+      suite.num_engines = NUM_ENGINES;
+    }
+    else if (strncmp(argv[i], "--threads=", 10) == 0)
+      num_threads = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--", 2) == 0)
+      error_exit("unknown option");
+    else
+      directory = argv[i];
+  }
+
+  int capacity = 0;
+  find_tests(&suite, directory, &capacity);
+  if (suite.num_tests == 0)
+    error_exit("no tests found");
+
+  int num_runs = suite.num_tests * suite.num_engines;
+  suite.runs = calloc(num_runs, sizeof(run_t));
+  if (suite.runs == NULL)
+    error_exit("unable to allocate memory for test results");
+
+  if (num_threads > num_runs)
+    num_threads = num_runs;
+  if (num_threads < 1)
+    num_threads = 1;
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  if (threads == NULL)
+    error_exit("unable to allocate memory for test threads");
+  double start = get_seconds();
+  for (int i = 0; i < num_threads; i++){
+    if (pthread_create(&threads[i], NULL, test_worker, &suite) != 0)
+      error_exit("unable to start test thread");
+  }
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = get_seconds() - start;
+
+  // Report in discovery order, each failure with what was expected and what came out
+  int num_passed = 0;
+  int num_agreed = 0;
+  printf("%-4s  %-32s %-9s %10s %14s\n", "", "test", "engine", "ms", "instructions");
+  for (int t = 0; t < suite.num_tests; t++){
+    test_t* test = &suite.tests[t];
+    run_t* runs = &suite.runs[t * suite.num_engines];
+    for (int e = 0; e < suite.num_engines; e++){
+      int pass = passed(test, &runs[e]);
+      num_passed += pass;
+      printf("%-4s  %-32s %-9s %10.3f %14llu\n", pass ? "PASS" : "FAIL", test->name,
+	     engine_names[suite.engines[e]], runs[e].seconds * 1e3, runs[e].executed);
+      if (!pass)
+	printf("Expected:\n\"%.*s\"\nGot:\n\"%.*s\"\n", (int)test->expected_size, test->expected,
+	       (int)runs[e].output_size, runs[e].output);
+    }
+
+    int agree = 1;
+    for (int e = 1; e < suite.num_engines; e++){
+      if (runs[e].status != runs[0].status || runs[e].executed != runs[0].executed ||
+	  runs[e].output_size != runs[0].output_size ||
+	  memcmp(runs[e].output, runs[0].output, runs[0].output_size) != 0){
+	printf("DISAGREE  %s: %s and %s differ\n", test->name,
+	       engine_names[suite.engines[0]], engine_names[suite.engines[e]]);
+	agree = 0;
+      }
+    }
+    num_agreed += agree;
+  }
+
+  printf("Passed %d / %d runs in %.3f s on %d threads\n", num_passed, num_runs, elapsed,
+	 num_threads);
+  if (suite.num_engines > 1)
+    printf("Engines agree on %d / %d tests\n", num_agreed, suite.num_tests);
+  return num_passed == num_runs && num_agreed == suite.num_tests ? 0 : 1;
+}
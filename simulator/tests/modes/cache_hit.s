@@ -0,0 +1,9 @@
+main:
+	movl	$5, %ecx
+.L1:
+	printr	%ecx
+	subl	$1, %ecx
+	movl	$0, %ebx
+	cmpl	%ebx, %ecx
+	jge	.L1
+	ret
@@ -0,0 +1,16 @@
+main:
+	movl	$3, %edi
+	call	outer
+	printr	%eax
+	movl	$4, %edi
+	call	outer
+	printr	%eax
+	ret
+outer:
+	call	inner
+	addl	$1, %eax
+	ret
+inner:
+	movl	%edi, %eax
+	imull	%edi, %eax
+	ret
@@ -0,0 +1,22 @@
+main:
+	movl	$256, %esi
+	movl	$0, %ecx
+	movl	$8, %ebx
+.L1:
+	movl	%ecx, 0(%esi)
+	addl	$16, %esi
+	addl	$1, %ecx
+	cmpl	%ebx, %ecx
+	jl	.L1
+	movl	$256, %esi
+	movl	$0, %ecx
+	movl	$0, %eax
+.L2:
+	movl	0(%esi), %edx
+	addl	%edx, %eax
+	addl	$16, %esi
+	addl	$1, %ecx
+	cmpl	%ebx, %ecx
+	jl	.L2
+	printr	%eax
+	ret
@@ -0,0 +1,33 @@
+main:
+	movl	$7, %ebx
+	movl	$3, %edi
+	call	square
+	printr	%eax
+	movl	$5, %edi
+	call	square
+	printr	%eax
+	movl	$3, %edi
+	call	square
+	printr	%eax
+	movl	$5, %edi
+	call	square
+	printr	%eax
+	movl	$0, %edx
+	movl	%edx, -4(%esp)
+	movl	%edx, -8(%esp)
+	movl	$3, %edi
+	call	square
+	printr	%eax
+	movl	-4(%esp), %ecx
+	printr	%ecx
+	movl	-8(%esp), %ecx
+	printr	%ecx
+	ret
+square:
+	pushl	%ebx
+	movl	%edi, %ebx
+	imull	%edi, %ebx
+	movl	%ebx, %eax
+	addl	$1, %eax
+	popl	%ebx
+	ret
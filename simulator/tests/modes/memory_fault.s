@@ -0,0 +1,9 @@
+main:
+	movl	$16380, %eax
+	movl	$7, %ebx
+	movl	%ebx, 0(%eax)
+	movl	0(%eax), %ecx
+	printr	%ecx
+	movl	%ebx, 4(%eax)
+	printr	%ebx
+	ret
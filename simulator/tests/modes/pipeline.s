@@ -0,0 +1,15 @@
+main:
+	movl	$512, %edi
+	movl	$3, %ecx
+	movl	%ecx, 0(%edi)
+	movl	$1, %eax
+	movl	$0, %edx
+	movl	$5, %ebx
+.L1:
+	movl	0(%edi), %ecx
+	imull	%ecx, %eax
+	addl	$1, %edx
+	cmpl	%ebx, %edx
+	jl	.L1
+	printr	%eax
+	ret
@@ -0,0 +1,19 @@
+main:
+	movl	$0, %ecx
+	movl	$0, %eax
+	movl	$12, %ebx
+	movl	$1, %edx
+.L1:
+	addl	$1, %ecx
+	movl	%ecx, %esi
+	shrl	%esi
+	movl	%esi, %edi
+	addl	%esi, %edi
+	cmpl	%edi, %ecx
+	je	.L2
+	addl	%ecx, %eax
+.L2:
+	cmpl	%ebx, %ecx
+	jl	.L1
+	printr	%eax
+	ret
@@ -0,0 +1,13 @@
+main:
+	movl	$0, %eax
+	movl	$1, %ecx
+	movl	$6, %ebx
+	pushl	%ebx
+.L1:
+	addl	%ecx, %eax
+	addl	$1, %ecx
+	cmpl	%ebx, %ecx
+	jle	.L1
+	popl	%ebx
+	printr	%eax
+	ret
@@ -0,0 +1,16 @@
+main:
+	movl	$512, %edi
+	movl	$0, %ecx
+	movl	%ecx, 0(%edi)
+	movl	$0, %edx
+	movl	$4, %ebx
+.L1:
+	readr	%eax
+	movl	0(%edi), %ecx
+	addl	%eax, %ecx
+	movl	%ecx, 0(%edi)
+	printr	%ecx
+	addl	$1, %edx
+	cmpl	%ebx, %edx
+	jl	.L1
+	ret
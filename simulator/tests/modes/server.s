@@ -0,0 +1,5 @@
+main:
+	readr	%eax
+	addl	%eax, %eax
+	printr	%eax
+	ret
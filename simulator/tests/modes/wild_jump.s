@@ -0,0 +1,5 @@
+main:
+	movl	$1, %eax
+	printr	%eax
+	jmp	$28672
+	ret
@@ -0,0 +1,504 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Static binary translator for the simulator.
+ *
+ * translate_program writes a standalone C program that does what the simulator would do
+ * with the binary, to be compiled with the system compiler at -O2. The program is split
+ * into one C function per call target (plus the entry at address 0); each reaches until
+ * the next call target. Jumps inside a function become gotos, and guest registers are
+ * locals that are saved to a global array around calls and returns; the flags only where
+ * a liveness pass says something on the other side may read them. Guest memory is a
+ * global array of the simulator's memory size, which the host backs with pages only as
+ * they are touched, and every load and store is checked against it.
+ *
+ * The only indirect control flow is ret, and a C function returns the address its guest
+ * ret popped. A caller that gets back the address after its call goes on there; any other
+ * address goes through the function's table of return points and, failing that, up to
+ * its own caller. At the top, enter() looks the address up in the table of all function
+ * entries, so a ret to some other call's return point still lands correctly; a ret to an
+ * address that follows no call stops with an error. Jumps into another function and
+ * falling through into the next one become tail calls.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "translate.h"
+#include "memory.h"
+
+// How an address is reached, for deciding which labels and table entries to emit
+#define MARK_LABEL 1        // target of a jump or return point inside its function
+#define MARK_ENTRY 2        // entered from outside its function
+#define MARK_RETURN 4       // address after a call
+
+static const char* register_names[NUM_REGS] = {
+  "eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "eflags"
+};
+
+// C conditions for the conditional jumps, first from the cmpl operands, then from %eflags
+static const char* compare_conditions[] = {
+  [je] = "cmp_left == cmp_right",
+  [jl] = "(int)cmp_left < (int)cmp_right",
+  [jle] = "(int)cmp_left <= (int)cmp_right",
+  [jge] = "(int)cmp_left >= (int)cmp_right",
+  [jbe] = "cmp_left <= cmp_right"
+};
+static const char* eflags_conditions[] = {
+  [je] = "ZF(eflags)",
+  [jl] = "SF(eflags) != OF(eflags)",
+  [jle] = "ZF(eflags) || SF(eflags) != OF(eflags)",
+  [jge] = "SF(eflags) == OF(eflags)",
+  [jbe] = "CF(eflags) || ZF(eflags)"
+};
+
+// Code shared by every translated program
+static const char* prelude =
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  "#define HALT_PC 0xFFFFFFFFu\n"
+  "#define CF(flags) (((flags) >> 0) & 1)\n"
+  "#define ZF(flags) (((flags) >> 6) & 1)\n"
+  "#define SF(flags) (((flags) >> 7) & 1)\n"
+  "#define OF(flags) (((flags) >> 11) & 1)\n"
+  "\n"
+  "// Guest registers while no translated function holds them in locals, then the lazy flags\n"
+  "static unsigned int regs[20];\n"
+  "static unsigned char memory[MEMORY_SIZE];\n"
+  "\n"
+  "#define MATERIALIZE if (pending){ eflags = flags_of(eflags, cmp_left, cmp_right); pending = 0; }\n"
+  "\n"
+  "static void fail(const char* message)\n"
+  "{\n"
+  "  fflush(stdout);\n"
+  "  printf(\"Error: %s\\n\", message);\n"
+  "  exit(1);\n"
+  "}\n"
+  "\n"
+  "static inline unsigned int load(unsigned int address)\n"
+  "{\n"
+  "  unsigned int value;\n"
+  "  if (address > MEMORY_SIZE - 4)\n"
+  "    fail(\"memory access out of range\");\n"
+  "  memcpy(&value, &memory[address], 4);\n"
+  "  return value;\n"
+  "}\n"
+  "\n"
+  "static inline void store(unsigned int address, unsigned int value)\n"
+  "{\n"
+  "  if (address > MEMORY_SIZE - 4)\n"
+  "    fail(\"memory access out of range\");\n"
+  "  memcpy(&memory[address], &value, 4);\n"
+  "}\n"
+  "\n"
+  "// %eflags after cmpl with the given operands, other bits kept from flags\n"
+  "static inline unsigned int flags_of(unsigned int flags, unsigned int left, unsigned int right)\n"
+  "{\n"
+  "  unsigned int result = left - right;\n"
+  "  flags &= ~0x8C1u;\n"
+  "  flags |= (left < right) << 0;\n"
+  "  flags |= (result == 0) << 6;\n"
+  "  flags |= (result >> 31) << 7;\n"
+  "  flags |= (((left ^ right) & (left ^ result)) >> 31) << 11;\n"
+  "  return flags;\n"
+  "}\n"
+  "\n"
+  "static inline unsigned int readr(unsigned int value)\n"
+  "{\n"
+  "  int read = value;\n"
+  "  if (scanf(\"%d\", &read) != 1)\n"
+  "    return value;\n"
+  "  return read;\n"
+  "}\n"
+  "\n";
+
+// The program being translated
+static instruction_t* program;
+static unsigned int program_length;
+static unsigned int* owner;           // first instruction of the function each belongs to
+static unsigned char* marks;          // MARK_ bits per instruction, one more for the end
+static char* flags_live;              // whether a flag read can come before the next cmpl
+static int returns_need_flags;        // whether some return point has live flags
+static int uses_flags;                // whether the program compares, branches or names %eflags
+
+/*
+ * Returns whether byte address is the address of an instruction
+*/
+static int is_instruction(long long address)
+{
+  return address >= 0 && address % 4 == 0 && address < (long long)program_length * 4;
+}
+
+/*
+ * Returns the target address of a jump or call at index
+*/
+static long long target_of(unsigned int index)
+{
+  return (long long)index * 4 + program[index].immediate + 4;
+}
+
+/*
+ * Records that control goes from the instruction at index to address without a call
+*/
+static void mark_transfer(unsigned int index, long long address)
+{
+  if (!is_instruction(address))
+    return;
+  if (owner[address / 4] == owner[index])
+    marks[address / 4] |= MARK_LABEL;
+  else
+    marks[address / 4] |= MARK_ENTRY;
+}
+
+/*
+ * Returns whether the flags are live at address, false past the program
+*/
+static int live_at(long long address)
+{
+  return is_instruction(address) && flags_live[address / 4];
+}
+
+/*
+ * Works out where the flags are live, so that they only cross calls, returns and jumps
+ * between functions when something on the other side may read them. A ret may go to any
+ * return point. A program that names %eflags keeps the flags live everywhere, since cmpl
+ * only replaces some of its bits.
+*/
+static void find_flags_liveness()
+{
+  int names_eflags = 0;
+  for (unsigned int i = 0; i < program_length; i++){
+    instruction_t instr = program[i];
+    names_eflags |= instr.opcode <= readr &&
+      (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG);
+    uses_flags |= instr.opcode >= cmpl && instr.opcode <= jbe;
+  }
+  uses_flags |= names_eflags;
+  memset(flags_live, names_eflags, program_length + 1);
+  returns_need_flags = names_eflags;
+  if (names_eflags)
+    return;
+
+  int changed = 1;
+  while (changed){
+    changed = 0;
+    for (unsigned int i = program_length; i-- > 0;){
+      unsigned char opcode = program[i].opcode;
+      int live;
+      if (opcode >= je && opcode <= jbe)
+	live = 1;
+      else if (opcode == cmpl)
+	live = 0;
+      else if (opcode == jmp || opcode == call)
+	live = live_at(target_of(i));
+      else if (opcode == ret)
+	live = returns_need_flags;
+      else
+	live = live_at((long long)(i + 1) * 4);
+
+      if (live != flags_live[i]){
+	flags_live[i] = live;
+	changed = 1;
+      }
+      if (live && marks[i] & MARK_RETURN && !returns_need_flags){
+	returns_need_flags = 1;
+	changed = 1;
+      }
+    }
+  }
+}
+
+/*
+ * Emits code that continues at address, from the function of the instruction at index
+*/
+static void emit_continue(FILE* out, unsigned int index, long long address)
+{
+  if (is_instruction(address) && owner[address / 4] == owner[index])
+    fprintf(out, "goto L_%06llx;", address);
+  else if (is_instruction(address))
+    fprintf(out, "{ SAVE_REGS;%s return f_%06x(0x%llxu); }",
+	    live_at(address) ? " SAVE_FLAGS;" : "", owner[address / 4] * 4, address);
+  else
+    fprintf(out, "{ SAVE_REGS; return 0x%xu; }", (unsigned int)address);
+}
+
+/*
+ * Emits the C statements for the instruction at index
+*/
+static void emit_instruction(FILE* out, unsigned int index)
+{
+  instruction_t instr = program[index];
+  if (instr.opcode > readr){
+    fprintf(out, "  // unknown opcode %d does nothing\n", instr.opcode);
+    return;
+  }
+  if (instr.first_register >= NUM_REGS || instr.second_register >= NUM_REGS)
+    error_exit("cannot translate an instruction with an invalid register");
+
+  const char* reg1 = register_names[instr.first_register];
+  const char* reg2 = register_names[instr.second_register];
+  int immediate = instr.immediate;
+  unsigned int program_counter = index * 4;
+
+  fprintf(out, "  ");
+  if (instr.first_register == EFLAGS_REG || instr.second_register == EFLAGS_REG)
+    fprintf(out, "MATERIALIZE ");
+
+  switch(instr.opcode)
+  {
+  case subl:
+    fprintf(out, "%s -= %d;\n", reg1, immediate);
+    break;
+  case addl_reg_reg:
+    fprintf(out, "%s += %s;\n", reg2, reg1);
+    break;
+  case addl_imm_reg:
+    fprintf(out, "%s += %d;\n", reg1, immediate);
+    break;
+  case imull:
+    fprintf(out, "%s *= %s;\n", reg2, reg1);
+    break;
+  case shrl:
+    fprintf(out, "%s >>= 1;\n", reg1);
+    break;
+  case movl_reg_reg:
+    fprintf(out, "%s = %s;\n", reg2, reg1);
+    break;
+  case movl_deref_reg:
+    fprintf(out, "%s = load(%s + %d);\n", reg2, reg1, immediate);
+    break;
+  case movl_reg_deref:
+    fprintf(out, "store(%s + %d, %s);\n", reg2, immediate, reg1);
+    break;
+  case movl_imm_reg:
+    fprintf(out, "%s = %d;\n", reg1, immediate);
+    break;
+  case cmpl:
+    fprintf(out, "cmp_left = %s; cmp_right = %s; pending = 1;\n", reg2, reg1);
+    break;
+  case je:
+  case jl:
+  case jle:
+  case jge:
+  case jbe:
+    fprintf(out, "if (pending ? %s : %s) ", compare_conditions[instr.opcode],
+	    eflags_conditions[instr.opcode]);
+    emit_continue(out, index, target_of(index));
+    fprintf(out, "\n");
+    break;
+  case jmp:
+    emit_continue(out, index, target_of(index));
+    fprintf(out, "\n");
+    break;
+  case call:
+    fprintf(out, "esp -= 4; store(esp, 0x%xu);\n", program_counter + 4);
+    if (!is_instruction(target_of(index))){
+      fprintf(out, "  ");
+      emit_continue(out, index, target_of(index));
+      fprintf(out, "\n");
+      break;
+    }
+    fprintf(out, "  SAVE_REGS;%s next = f_%06llx(0x%llxu); LOAD_REGS;%s\n",
+	    live_at(target_of(index)) ? " SAVE_FLAGS;" : "", target_of(index), target_of(index),
+	    live_at(program_counter + 4) ? " LOAD_FLAGS;" : "");
+    fprintf(out, "  if (next == 0x%xu) ", program_counter + 4);
+    emit_continue(out, index, program_counter + 4);
+    fprintf(out, "\n  goto dispatch;\n");
+    break;
+  case ret:
+    fprintf(out, "if (esp == MEMORY_SIZE){ SAVE_REGS; return HALT_PC; }\n");
+    fprintf(out, "  next = load(esp); esp += 4; SAVE_REGS;%s return next;\n",
+	    returns_need_flags ? " SAVE_FLAGS;" : "");
+    break;
+  case pushl:
+    fprintf(out, "esp -= 4; store(esp, %s);\n", reg1);
+    break;
+  case popl:
+    fprintf(out, "%s = load(esp); esp += 4;\n", reg1);
+    break;
+  case printr:
+    fprintf(out, "printf(\"%%d (0x%%x)\\n\", (int)%s, %s);\n", reg1, reg1);
+    break;
+  case readr:
+    fprintf(out, "%s = readr(%s);\n", reg1, reg1);
+    break;
+  }
+}
+
+/*
+ * Emits LOCALS, the guest registers as locals of a translated function, and the macros
+ * that move them between the locals and the global array: LOAD_REGS and SAVE_REGS for the
+ * registers the program names, LOAD_FLAGS and SAVE_FLAGS for %eflags and the cmpl operands.
+ * Moving only what is needed keeps calls cheap.
+*/
+static void emit_register_macros(FILE* out)
+{
+  int used[NUM_REGS] = { 0 };
+  used[ESP_REG] = 1;
+  for (unsigned int i = 0; i < program_length; i++){
+    instruction_t instr = program[i];
+    if (instr.opcode > readr)
+      continue;
+    used[instr.first_register] = 1;
+    used[instr.second_register] = 1;
+  }
+  used[EFLAGS_REG] = 0;
+
+  fprintf(out, "#define LOAD_REGS");
+  for (int r = 0; r < NUM_REGS; r++){
+    if (used[r])
+      fprintf(out, " %s = regs[%d];", register_names[r], r);
+  }
+  fprintf(out, " do {} while (0)\n#define SAVE_REGS");
+  for (int r = 0; r < NUM_REGS; r++){
+    if (used[r])
+      fprintf(out, " regs[%d] = %s;", r, register_names[r]);
+  }
+  fprintf(out, " do {} while (0)\n#define LOCALS unsigned int");
+  for (int r = 0; r < NUM_REGS; r++){
+    if (used[r])
+      fprintf(out, " %s,", register_names[r]);
+  }
+  if (uses_flags){
+    fprintf(out, " eflags = 0, cmp_left = 0, pending = 0, cmp_right = 0,");
+    fprintf(out, " next; (void)next; (void)eflags; (void)cmp_left; (void)pending; (void)cmp_right\n");
+    fprintf(out, "#define LOAD_FLAGS eflags = regs[16]; cmp_left = regs[17]; pending = regs[18]; "
+	    "cmp_right = regs[19]\n");
+    fprintf(out, "#define SAVE_FLAGS regs[16] = eflags; regs[17] = cmp_left; regs[18] = pending; "
+	    "regs[19] = cmp_right\n\n");
+  }
+  else
+    fprintf(out, " next; (void)next\n#define LOAD_FLAGS do {} while (0)\n"
+	    "#define SAVE_FLAGS do {} while (0)\n\n");
+}
+
+/*
+ * Emits the C function for the instructions first up to but not including end
+*/
+static void emit_function(FILE* out, unsigned int first, unsigned int end)
+{
+  int has_calls = 0;
+  for (unsigned int i = first; i < end; i++)
+    has_calls |= program[i].opcode == call && is_instruction(target_of(i));
+
+  fprintf(out, "static unsigned int f_%06x(unsigned int entry)\n{\n  LOCALS;\n  LOAD_REGS;\n",
+	  first * 4);
+  fprintf(out, "  switch (entry)\n  {\n");
+  for (unsigned int i = first; i < end; i++){
+    if (i == first || marks[i] & (MARK_ENTRY | MARK_RETURN))
+      fprintf(out, "  case 0x%xu:%s goto L_%06x;\n", i * 4,
+	      flags_live[i] ? " LOAD_FLAGS;" : "", i * 4);
+  }
+  fprintf(out, "  default: fail(\"program counter out of range\");\n  }\n\n");
+
+  for (unsigned int i = first; i < end; i++){
+    if (i == first || marks[i])
+      fprintf(out, " L_%06x:\n", i * 4);
+    emit_instruction(out, i);
+  }
+
+  // Falling off the end goes on into the next function, or ends the program
+  fprintf(out, "  ");
+  if (end < program_length)
+    emit_continue(out, end - 1, end * 4);
+  else
+    fprintf(out, "{ SAVE_REGS; return 0x%xu; }", end * 4);
+  fprintf(out, "\n");
+
+  if (has_calls){
+    fprintf(out, "\n  // A callee returned somewhere other than after its call\n");
+    fprintf(out, " dispatch:\n  switch (next)\n  {\n");
+    for (unsigned int i = first; i < end; i++){
+      if (marks[i] & MARK_RETURN)
+	fprintf(out, "  case 0x%xu:%s goto L_%06x;\n", i * 4,
+		flags_live[i] ? " LOAD_FLAGS;" : "", i * 4);
+    }
+    fprintf(out, "  default: return next;\n  }\n");
+  }
+  fprintf(out, "}\n\n");
+}
+
+/*
+ * Writes a C program equivalent to running the instructions to out
+*/
+void translate_program(instruction_t* instructions, unsigned int num_instructions,
+		       const char* binary_name, FILE* out)
+{
+  program = instructions;
+  program_length = num_instructions;
+  owner = malloc(sizeof(unsigned int) * (num_instructions + 1));
+  marks = calloc(num_instructions + 1, 1);
+  flags_live = calloc(num_instructions + 1, 1);
+  if (owner == NULL || marks == NULL || flags_live == NULL)
+    error_exit("unable to allocate memory for translation");
+
+  // Every call target starts a function
+  char* starts = calloc(num_instructions + 1, 1);
+  if (starts == NULL)
+    error_exit("unable to allocate memory for translation");
+  starts[0] = 1;
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (program[i].opcode == call && is_instruction(target_of(i)))
+      starts[target_of(i) / 4] = 1;
+  }
+  for (unsigned int i = 0; i < num_instructions; i++)
+    owner[i] = starts[i] ? i : owner[i - 1];
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    unsigned char opcode = program[i].opcode;
+    if (opcode >= je && opcode <= jmp)
+      mark_transfer(i, target_of(i));
+    if (opcode == call && i + 1 < num_instructions){
+      marks[i + 1] |= MARK_RETURN;
+      mark_transfer(i, (long long)(i + 1) * 4);
+    }
+  }
+
+  find_flags_liveness();
+
+  fprintf(out, "// Translated from %s by the CS 4400 simulator's --translate mode.\n",
+	  binary_name);
+  fprintf(out, "// Compile with: cc -O2 -o program program.c\n\n");
+  fprintf(out, "#define MEMORY_SIZE %uu\n\n", memory_size);
+  fprintf(out, "%s", prelude);
+  fprintf(out, "#define END_PC 0x%xu\n\n", num_instructions * 4);
+  emit_register_macros(out);
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (starts[i])
+      fprintf(out, "static unsigned int f_%06x(unsigned int entry);\n", i * 4);
+  }
+  fprintf(out, "\n");
+
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (!starts[i])
+      continue;
+    unsigned int end = i + 1;
+    while (end < num_instructions && !starts[end])
+      end++;
+    emit_function(out, i, end);
+  }
+
+  // Resumes at any function entry, for returns that no translated caller expects
+  fprintf(out, "static unsigned int enter(unsigned int address)\n{\n");
+  fprintf(out, "  switch (address)\n  {\n");
+  for (unsigned int i = 0; i < num_instructions; i++){
+    if (starts[i] || marks[i] & (MARK_ENTRY | MARK_RETURN))
+      fprintf(out, "  case 0x%xu: return f_%06x(address);\n", i * 4, owner[i] * 4);
+  }
+  fprintf(out, "  default: fail(\"program counter out of range\"); return HALT_PC;\n  }\n}\n\n");
+
+  fprintf(out, "int main()\n{\n");
+  fprintf(out, "  regs[6] = MEMORY_SIZE;\n");
+  fprintf(out, "  unsigned int address = 0;\n");
+  fprintf(out, "  while (address != END_PC && address != HALT_PC)\n");
+  fprintf(out, "    address = enter(address);\n");
+  fprintf(out, "  return 0;\n}\n");
+
+  free(starts);
+  free(owner);
+  free(marks);
+  free(flags_live);
+}
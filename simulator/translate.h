@@ -0,0 +1,12 @@
+/*
+ * CS 4400, University of Utah
+ *
+ * Ahead-of-time translator from decoded instructions to a standalone C program.
+*/
+
+#pragma once
+
+#include "simulator.h"
+
+void translate_program(instruction_t* instructions, unsigned int num_instructions,
+		       const char* binary_name, FILE* out);